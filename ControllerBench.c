@@ -0,0 +1,891 @@
+/*	SmartPort Controller benchmark
+	Plays PRU1 for SmartPortController.c built with -DPRU_SIM, no BeagleBone
+	gcc -O2 -pthread -DPRU_SIM SmartPortController.c ControllerBench.c -o ControllerBench
+
+	PRU memory is the Controller's anonymous mapping. simPru() plays PRU1
+	without PRU0, so every packet for our IDs goes to the Controller. It
+	sends A2 traffic encoded as on the wire, decodes it as ReceivePacket()
+	would, and times eRCVDPACK to GO. Wire time isn't modelled.
+	-R replays a packet trace instead of the workloads, each reply checked
+	against the recorded one. -K times the packet kernels on their own
+	and exits.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Must match SmartPortController.c
+#define NUM_BLOCKS			65536
+#define WAIT_SET			0x00
+#define WAIT_GO				0x01
+#define WAIT_SKIP			0x02
+#define WAIT_GO_BLOCK		0x03
+#define WAIT_GO_STREAM		0x04
+#define RESP_PACKET_ADR		0x0800
+#define RX_DATA_ADR			0x1100
+#define RX_DATA_LEN			512
+#define RX_INFO_CS			0
+#define RX_INFO_HDR			1
+#define RX_INFO_LEN			8
+#define RX_INFO_CALC		10
+#define RX_INFO_SENT		11
+#define RX_INFO_CURSOR		12
+#define WRITE_DESC_VALID	0
+#define WRITE_DESC_ID		1
+#define WRITE_DESC_CMD		2
+#define WRITE_DESC_BLOCK	4
+#define TX_SRC_ADR			0x1320
+#define TX_CURSOR_ADR		0x133C
+#define HIST_SUB_BITS		5
+#define HIST_SUB			(1<<HIST_SUB_BITS)
+#define HIST_BUCKETS		((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define TRACE_FILE_LEN		(4*1024*1024)
+#define TR_TX_DATA			0x02
+#define TR_TRUNCATED		0x04
+#define TR_ERROR1			0x08
+enum pruStatuses {eIDLE, eRESET, eENABLED, eRCVDPACK, eSENDING, eWRITING, eUNKNOWN};
+enum rxChecksums {eRX_CS_NONE, eRX_CS_GOOD, eRX_CS_BAD};
+struct latHist
+{
+	unsigned int counts[HIST_BUCKETS];
+	unsigned int cnt, max;
+	unsigned long long sum;
+};
+struct traceRec
+{
+	unsigned long long ns;
+	unsigned int turnNs;
+	unsigned int block;
+	unsigned short len;
+	unsigned short rxLen, txLen;
+	unsigned char dest, type, cmd, wait;
+	unsigned char flags, pad[5];
+};
+struct traceHeader
+{
+	char magic[8];
+	unsigned int fileLen, recSize;
+	unsigned long long startNs, startRealNs;
+	unsigned int seq;
+	unsigned int dropped;
+	_Alignas(64) _Atomic unsigned int used;
+	unsigned int records;
+};
+
+// Controller
+extern volatile unsigned char running;
+extern volatile unsigned int busLoops;
+extern unsigned char spID1, spID2;
+extern unsigned char (*theImages)[NUM_BLOCKS][512];
+extern unsigned char *pru1RAMptr;
+extern volatile unsigned char *pruStatusPtr;
+extern volatile unsigned char *busID1ptr;
+extern volatile unsigned char *busID2ptr;
+extern volatile unsigned char *pruWaitPtr;
+extern unsigned char *rcvdPacketPtr;
+extern unsigned char *rcvdPacketTypePtr;
+extern unsigned char *respPacketPtr;
+extern unsigned char *rxDataPtr;
+extern volatile unsigned char *rxInfoPtr;
+extern volatile unsigned char *writeDescPtr;
+extern unsigned char *txRawPtr;
+unsigned long long nowNs(void);
+void histAdd(struct latHist *hist, unsigned int value);
+void printHistLine(const char *name, struct latHist *hist);
+struct traceHeader *readTrace(const char *path, unsigned int *used);
+void encodeStdStatusReplyPacket(unsigned char *packet, unsigned char srcID, unsigned char dataStat);
+void encodeStdDibStatusReplyPacket(unsigned char *packet, unsigned char srcID, unsigned char dataStat, unsigned char device);
+void encodeDataPacket(unsigned char *packet, const unsigned char *data, unsigned char srcID, unsigned char dataStat, char stream);
+unsigned char xorBytes(const unsigned char *bytes, unsigned int len);
+
+// Called from Controller
+int  simOption(int opt, const char *arg);
+void simUsage(void);
+int  simBefore(void);
+int  simImages(void);
+void *simPru(void *arg);
+int  simAfter(void);
+
+void simFillImages(void);
+unsigned int simEncodePacket(unsigned char *wire, unsigned char dest, unsigned char type, const unsigned char *data, unsigned int len);
+char simDecodePacket(const unsigned char *wire, unsigned char *data, unsigned int *len, unsigned char *calc, unsigned char *sent);
+void simReceive(unsigned char dest, unsigned char type, const unsigned char *data, unsigned int len);
+void simReceived(void);
+unsigned char simTransact(unsigned int *ns);
+void simCommand(unsigned char dest, unsigned char cmd, unsigned char code, unsigned int block);
+void simRunWorkload(const char *name, unsigned char kind, unsigned int cmds);
+int  simReplayPrepare(void);
+void simReplay(void);
+struct traceRec;
+char simReplyMatches(const struct traceRec *rec, unsigned char waitCode);
+unsigned int simRand(void);
+int  benchKernels(unsigned int iters);
+void benchKernel(const char *kernel, const char *data, void (*fn)(void), unsigned int iters);
+void openKernelCounters(void);
+void kernEncode(void);
+void kernDecode(void);
+void kernChecksum(void);
+void kernStatus(void);
+void kernDib(void);
+
+#define SIM_ID1				0x81
+#define SIM_ID2				0x82
+#define SIM_TIMEOUT_NS		1000000000ULL		// no GO, Controller lost the packet
+#define SIM_WARMUP			100					// STATUS commands before timing
+enum simWorkloads {eSIM_SEQ_READ, eSIM_RAND_READ, eSIM_MIXED, eSIM_NO_WRITING};
+unsigned int simCmds = 20000;					// -N, commands per workload
+unsigned int simSeed = 0x12345678;
+unsigned int simBad, simLost;
+unsigned char simSkipWriting;					// next data packet goes straight to eRCVDPACK
+unsigned char simIDs[2] = {SIM_ID1, SIM_ID2};	// bus IDs simPru() gives us
+const char *simReplayPath;						// -R
+unsigned char simPaced;							// -L, replay at recorded spacing
+struct traceHeader *simTrace;
+unsigned int simTraceUsed;
+enum simReplayKinds {eRP_STATUS, eRP_READBLK, eRP_WRITEBLK, eRP_DATA, eRP_OTHER, eRP_ALL, eNUM_RP_KINDS};
+unsigned int kernIters;							// -K, calls per kernel
+enum kernCounters {eKC_CYCLES, eKC_INSTR, eKC_BRANCH_MISS, eKC_CACHE_MISS, eNUM_KC};
+int kernPerfFd[eNUM_KC];						// -1 where perf_event_open() said no
+unsigned char kernBlock[512], kernData[RX_DATA_LEN], kernPacket[604];	// data packet in memory
+volatile unsigned char kernSink;				// results go here so calls aren't optimised away
+
+//____________________
+int simOption(int opt, const char *arg)
+{
+	// Returns 0 if opt is ours
+	switch (opt)
+	{
+		case 'N':
+			simCmds = strtoul(arg, NULL, 0);
+			return 0;
+		case 'R':
+			simReplayPath = arg;
+			return 0;
+		case 'L':
+			simPaced = 1;
+			return 0;
+		case 'K':
+			kernIters = strtoul(arg, NULL, 0);
+			return 0;
+	}
+	return -1;
+}
+
+//____________________
+void simUsage(void)
+{
+	printf("\t-N  benchmark: commands per workload (%u)\n", simCmds);
+	printf("\t-R  benchmark: replay packet trace file instead, check every reply\n");
+	printf("\t-L  benchmark: replay at recorded packet spacing, not as fast as possible\n");
+	printf("\t-K  time encode, decode, checksum and status kernels n times each, print CSV and exit\n");
+}
+
+//____________________
+int simBefore(void)
+{
+	// Options parsed, nothing mapped yet
+	// Returns exit status if Controller shouldn't start, -1 to go on
+	if (kernIters != 0)
+		return benchKernels(kernIters) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	if ((simReplayPath != NULL) && ((simTrace = readTrace(simReplayPath, &simTraceUsed)) == NULL))
+		return EXIT_FAILURE;							// mapped before openTrace() can rotate it away
+	return -1;
+}
+
+//____________________
+int simImages(void)
+{
+	// In place of loadDiskImages(), returns 0 if ready
+	simFillImages();
+	if (simTrace != NULL)
+		return simReplayPrepare();
+	return 0;
+}
+
+//____________________
+int simAfter(void)
+{
+	// Controller shut down, returns its exit status
+	if (simTrace != NULL)
+		munmap(simTrace, TRACE_FILE_LEN);
+	return ((simBad != 0) || (simLost != 0)) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//____________________
+void *simPru(void *arg)
+{
+	// Plays PRU1: bus reset, IDs from Init, then each workload or the replay
+	unsigned int i, ns, start;
+
+	(void) arg;
+	*pruStatusPtr = eRESET;
+	*busID1ptr = simIDs[0];								// as if A2 sent both Inits
+	*busID2ptr = simIDs[1];
+	start = busLoops;
+	while (running && (busLoops - start < 2))
+		usleep(1000);
+	*pruStatusPtr = eENABLED;
+	while (running && ((spID1 != simIDs[0]) || (spID2 != simIDs[1])))
+		usleep(1000);
+
+	for (i=0; running && (i<SIM_WARMUP); i++)
+	{
+		simCommand(simIDs[0], 0x80, 0x00, 0);			// STATUS
+		simTransact(&ns);
+	}
+
+	if (simTrace != NULL)
+		simReplay();
+	else
+	{
+		printf("--- Benchmark, %u commands per workload, Controller time only\n", simCmds);
+		simRunWorkload("seqread",  eSIM_SEQ_READ,  simCmds);
+		simRunWorkload("randread", eSIM_RAND_READ, simCmds);
+		simRunWorkload("mixed",    eSIM_MIXED,     simCmds);
+		simRunWorkload("nowrite",  eSIM_NO_WRITING, simCmds);
+	}
+
+	running = 0;
+	return NULL;
+}
+
+//____________________
+void simRunWorkload(const char *name, unsigned char kind, unsigned int cmds)
+{
+	// seqread: READBLKs 0, 1, 2... on device 1
+	// randread: READBLKs anywhere on either device
+	// mixed: 50% random READBLK, 30% WRITEBLK + data packet, 20% STATUS
+	// nowrite: WRITEBLK + data packet, every other one without eWRITING as
+	//  if the bus thread missed it, with -T the stream copy must not be reused
+	// Every reply is checked, a wrong one counts in simBad
+	struct latHist *hist;
+	unsigned char dest, pick, data[RX_DATA_LEN];
+	unsigned int i, j, block, ns, blocks, bad, lost;
+	unsigned long long start, elapsed;
+
+	hist = calloc(1, sizeof(struct latHist));
+	if (hist == NULL)
+		return;
+	bad = simBad;
+	lost = simLost;
+	blocks = 0;
+	start = nowNs();
+	for (i=0; running && (i<cmds); i++)
+	{
+		dest  = (kind == eSIM_SEQ_READ) || (simRand() & 1) ? SIM_ID1 : SIM_ID2;
+		block = (kind == eSIM_SEQ_READ) ? i % NUM_BLOCKS : simRand() % NUM_BLOCKS;
+		pick  = (kind == eSIM_MIXED) ? simRand() % 10 : (kind == eSIM_NO_WRITING) ? 5 : 0;
+
+		if (pick < 5)
+		{
+			simCommand(dest, 0x81, 0, block);			// READBLK
+			if (simTransact(&ns) == WAIT_GO_BLOCK)
+			{
+				if ((*(pru1RAMptr + TX_SRC_ADR) != dest) || memcmp(txRawPtr, theImages[dest - SIM_ID1][block], 512))
+					simBad++;
+			}
+			else
+			{
+				if ((simDecodePacket(respPacketPtr, data, &j, NULL, NULL) != 0) || (j != RX_DATA_LEN) ||
+					memcmp(data, theImages[dest - SIM_ID1][block], 512))
+					simBad++;
+			}
+			histAdd(hist, ns);
+			blocks++;
+		}
+		else if (pick < 8)
+		{
+			simCommand(dest, 0x82, 0, block);			// WRITEBLK
+			if (simTransact(&ns) != WAIT_SKIP)
+				simBad++;
+			histAdd(hist, ns);
+
+			for (j=0; j<RX_DATA_LEN; j++)
+				data[j] = simRand();
+			simReceive(dest, 0x82, data, RX_DATA_LEN);
+			simSkipWriting = (kind == eSIM_NO_WRITING) && (i & 1);
+			if ((simTransact(&ns) != WAIT_GO) || (respPacketPtr[11] != 0x80) ||
+				memcmp(data, theImages[dest - SIM_ID1][block], 512))
+				simBad++;
+			histAdd(hist, ns);
+			blocks++;
+		}
+		else
+		{
+			simCommand(dest, 0x80, 0x00, 0);			// STATUS
+			if ((simTransact(&ns) != WAIT_GO) || (respPacketPtr[8] != dest) || (respPacketPtr[9] != 0x81))
+				simBad++;
+			histAdd(hist, ns);
+		}
+	}
+	elapsed = nowNs() - start;
+
+	printf("\t%-8s %u cmds in %.3f s\t%.0f cmds/s\t%.2f MB/s\tbad=%u\tlost=%u\n", name, i,
+		elapsed / 1e9, i * 1e9 / elapsed, blocks * 512.0 * 1000.0 / elapsed,
+		simBad - bad, simLost - lost);
+	printHistLine(name, hist);
+	free(hist);
+}
+
+//____________________
+void simCommand(unsigned char dest, unsigned char cmd, unsigned char code, unsigned int block)
+{
+	// Standard command packet as A2 sends it: command, parameter count,
+	//  then a group of 7: buffer pointer, block or status code
+	unsigned char data[9];
+
+	memset(data, 0, sizeof(data));
+	data[0] = cmd & 0x7F;
+	data[1] = 3;
+	if (cmd == 0x80)
+		data[4] = code;
+	else
+	{
+		data[4] = block;
+		data[5] = block >> 8;
+		data[6] = block >> 16;
+	}
+	simReceive(dest, 0x80, data, sizeof(data));
+}
+
+//____________________
+void simReceive(unsigned char dest, unsigned char type, const unsigned char *data, unsigned int len)
+{
+	// Put a packet in PRU RAM as ReceivePacket() leaves it: wire bytes,
+	//  decoded data and checksum result
+	simEncodePacket(rcvdPacketPtr, dest, type, data, len);
+	simReceived();
+}
+
+//____________________
+void simReceived(void)
+{
+	// Wire bytes are at rcvdPacketPtr, decode them as ReceivePacket() does
+	unsigned char calc, sent;
+	unsigned int n;
+
+	rxInfoPtr[RX_INFO_CS] = simDecodePacket(rcvdPacketPtr, rxDataPtr, &n, &calc, &sent) == 0 ? eRX_CS_GOOD : eRX_CS_BAD;
+	memcpy((unsigned char *) rxInfoPtr + RX_INFO_HDR, rcvdPacketPtr + 7, 7);
+	rxInfoPtr[RX_INFO_LEN]   = n & 0xFF;
+	rxInfoPtr[RX_INFO_LEN+1] = n >> 8;
+	rxInfoPtr[RX_INFO_CALC] = calc;
+	rxInfoPtr[RX_INFO_SENT] = sent;
+	*(volatile unsigned int *) (rxInfoPtr + RX_INFO_CURSOR) = RX_DATA_ADR + n;
+}
+
+//____________________
+unsigned char simTransact(unsigned int *ns)
+{
+	// Hand received packet to Controller and wait for GO like AskController()
+	// Returns wait code, ns = eRCVDPACK to GO
+	unsigned long long start, now;
+	unsigned int loops;
+	unsigned char waitCode;
+
+	// Data packet: eWRITING while it arrives, Controller starts a new stream copy
+	if ((*rcvdPacketTypePtr == 0x82) && !simSkipWriting)
+	{
+		*pruStatusPtr = eWRITING;
+		loops = busLoops;
+		while (running && (busLoops - loops < 2));
+	}
+
+	*pruWaitPtr = WAIT_SET;
+	__sync_synchronize();
+	start = nowNs();
+	*pruStatusPtr = eRCVDPACK;
+	do
+	{
+		waitCode = *pruWaitPtr;
+		now = nowNs();
+	} while ((waitCode == WAIT_SET) && (now - start < SIM_TIMEOUT_NS));
+	*ns = now - start;
+	if (waitCode == WAIT_SET)
+		simLost++;
+
+	// Streamed packet: Controller is still writing it, send when it's all there
+	if (waitCode == WAIT_GO_STREAM)
+	{
+		while (*(volatile unsigned int *) (pru1RAMptr + TX_CURSOR_ADR) != RESP_PACKET_ADR + 604)
+		{
+			if (nowNs() - start > SIM_TIMEOUT_NS)
+			{
+				simLost++;
+				break;
+			}
+		}
+	}
+	__sync_synchronize();
+
+	// Controller acts on status changes, make sure it sees this one
+	*pruStatusPtr = eSENDING;
+	loops = busLoops;
+	while (running && (busLoops - loops < 2));
+	*pruStatusPtr = eENABLED;
+	return waitCode;
+}
+
+//____________________
+int simReplayPrepare(void)
+{
+	// Bus IDs the recording answered, and blocks as it read them: a block's
+	//  first READBLK reply goes in its image unless a write came first,
+	//  so replayed reads return the recorded data
+	struct traceRec *rec;
+	unsigned char *seen, *tx, lo, hi, dev;
+	unsigned int pos, loaded;
+
+	lo = 0xFF;
+	hi = 0;
+	for (pos = 0; pos + sizeof(struct traceRec) <= simTraceUsed; pos += rec->len)
+	{
+		rec = (struct traceRec *) ((unsigned char *) (simTrace + 1) + pos);
+		if (rec->len < sizeof(struct traceRec) || pos + rec->len > simTraceUsed)
+			break;
+		if ((rec->flags & TR_ERROR1) || (rec->wait == WAIT_SKIP) || (rec->wait == WAIT_SET))
+			continue;
+		if (rec->dest < lo)
+			lo = rec->dest;
+		if (rec->dest > hi)
+			hi = rec->dest;
+	}
+	if (lo == 0xFF)
+	{
+		printf("*** ERROR: %s has no packets we answered\n", simReplayPath);
+		return -1;
+	}
+	simIDs[0] = lo;
+	simIDs[1] = (hi != lo) ? hi : lo + 1;
+
+	seen = calloc(2, NUM_BLOCKS);
+	if (seen == NULL)
+		return -1;
+	loaded = 0;
+	for (pos = 0; pos + sizeof(struct traceRec) <= simTraceUsed; pos += rec->len)
+	{
+		rec = (struct traceRec *) ((unsigned char *) (simTrace + 1) + pos);
+		if (rec->len < sizeof(struct traceRec) || pos + rec->len > simTraceUsed)
+			break;
+		if ((rec->flags & TR_ERROR1) || (rec->block >= NUM_BLOCKS) || ((rec->dest != lo) && (rec->dest != hi)))
+			continue;
+		dev = (rec->dest == simIDs[0]) ? 0 : 1;
+		if (rec->type == 0x82)
+			seen[dev * NUM_BLOCKS + rec->block] = 1;
+		else if ((rec->flags & TR_TX_DATA) && !seen[dev * NUM_BLOCKS + rec->block])
+		{
+			tx = (unsigned char *) (rec + 1) + rec->rxLen;
+			memcpy(theImages[dev][rec->block], tx, 512);
+			seen[dev * NUM_BLOCKS + rec->block] = 1;
+			loaded++;
+		}
+	}
+	free(seen);
+	printf("--- Replay %s: IDs 0x%02X 0x%02X, %u blocks loaded from recorded reads\n",
+		simReplayPath, simIDs[0], simIDs[1], loaded);
+	return 0;
+}
+
+//____________________
+void simReplay(void)
+{
+	// Hand recorded packets to Controller in order, as fast as it takes
+	//  them or with -L at their recorded spacing. Replies that differ from
+	//  the recorded ones count in simBad
+	// ERROR1 and cut records can't be sent again, they're skipped
+	// Only what the Controller answered was recorded: packets the PRU
+	//  answered aren't replayed, and a data packet whose WRITEBLK the PRU
+	//  took gets a writeDesc rebuilt from its recorded block
+	static const char *kindNames[eNUM_RP_KINDS] = {"STATUS", "READBLK", "WRITEBLK", "data", "other", "all"};
+	struct latHist *hist, *recorded;
+	struct traceRec *rec, *prev;
+	unsigned char kind, waitCode;
+	unsigned int pos, ns, n, bad, lost, skipped, rebuilt;
+	unsigned long long start, elapsed, firstNs, lastNs, due, now;
+
+	hist = calloc(eNUM_RP_KINDS + 1, sizeof(struct latHist));
+	if (hist == NULL)
+		return;
+	recorded = &hist[eNUM_RP_KINDS];
+	bad = simBad;
+	lost = simLost;
+	n = 0;
+	skipped = 0;
+	rebuilt = 0;
+	firstNs = 0;
+	lastNs = 0;
+	prev = NULL;
+	start = nowNs();
+	for (pos = 0; running && (pos + sizeof(struct traceRec) <= simTraceUsed); pos += rec->len)
+	{
+		rec = (struct traceRec *) ((unsigned char *) (simTrace + 1) + pos);
+		if (rec->len < sizeof(struct traceRec) || pos + rec->len > simTraceUsed)
+			break;
+		if (rec->flags & (TR_ERROR1 | TR_TRUNCATED))
+		{
+			skipped++;
+			continue;
+		}
+		if (n == 0)
+			firstNs = rec->ns;
+		lastNs = rec->ns;
+		if (simPaced)
+		{
+			due = start + (rec->ns - firstNs);
+			while (running && ((now = nowNs()) < due))
+			{
+				if (due - now > 200000)
+					usleep((due - now - 100000) / 1000);
+			}
+		}
+
+		// Data packet without its WRITEBLK: PRU took that, block is in writeDesc
+		if ((rec->type == 0x82) && ((prev == NULL) || (prev->type != 0x80) ||
+			((prev->cmd & 0xBF) != 0x82) || (prev->dest != rec->dest)))
+		{
+			writeDescPtr[WRITE_DESC_ID]  = rec->dest;
+			writeDescPtr[WRITE_DESC_CMD] = 0x82;
+			*(volatile unsigned int *) (writeDescPtr + WRITE_DESC_BLOCK) = rec->block;
+			__sync_synchronize();
+			writeDescPtr[WRITE_DESC_VALID] = 1;
+			rebuilt++;
+		}
+		memcpy(rcvdPacketPtr, rec + 1, rec->rxLen);
+		simReceived();
+		waitCode = simTransact(&ns);
+		if (!simReplyMatches(rec, waitCode))
+			simBad++;
+
+		if (rec->type == 0x82)
+			kind = eRP_DATA;
+		else if ((rec->cmd & 0xBF) >= 0x80 && (rec->cmd & 0xBF) <= 0x82)
+			kind = (rec->cmd & 0xBF) - 0x80;
+		else
+			kind = eRP_OTHER;
+		histAdd(&hist[kind], ns);
+		histAdd(&hist[eRP_ALL], ns);
+		histAdd(recorded, rec->turnNs);
+		prev = rec;
+		n++;
+	}
+	elapsed = nowNs() - start;
+
+	printf("\treplayed %u of %u packets in %.3f s, recorded over %.3f s%s\tdiffer=%u\tlost=%u\tskipped=%u\n",
+		n, n + skipped, elapsed / 1e9, (lastNs - firstNs) / 1e9, simPaced ? ", paced" : "",
+		simBad - bad, simLost - lost, skipped);
+	printf("\tController-answered packets only: PRU-answered STATUS, DIB, cached READBLK and WRITEBLK\n"
+		"\tweren't recorded, %u data packets got a writeDesc rebuilt from the recorded block\n", rebuilt);
+	for (kind=0; kind<eNUM_RP_KINDS; kind++)
+	{
+		if (hist[kind].cnt != 0)
+			printHistLine(kindNames[kind], &hist[kind]);
+	}
+	printHistLine("recorded", recorded);
+	free(hist);
+}
+
+//____________________
+char simReplyMatches(const struct traceRec *rec, unsigned char waitCode)
+{
+	// Same reply as the recording, however it went out: block from raw or
+	//  encoded, status packet byte for byte up to its end marker
+	// Returns 1 if it matches
+	const unsigned char *tx;
+	unsigned char data[RX_DATA_LEN];
+	unsigned int len;
+
+	tx = (const unsigned char *) (rec + 1) + rec->rxLen;
+	if (waitCode == WAIT_SET)
+		return 0;
+	if (rec->txLen == 0)
+		return waitCode == WAIT_SKIP;
+	if (rec->flags & TR_TX_DATA)
+	{
+		if (waitCode == WAIT_GO_BLOCK)
+			return memcmp(txRawPtr, tx, 512) == 0;
+		if (waitCode == WAIT_SKIP)
+			return 0;
+		return (simDecodePacket(respPacketPtr, data, &len, NULL, NULL) == 0) && (len == RX_DATA_LEN) &&
+			(memcmp(data, tx, 512) == 0);
+	}
+	return (waitCode == WAIT_GO) && (memcmp(respPacketPtr, tx, rec->txLen) == 0);
+}
+
+//____________________
+unsigned int simEncodePacket(unsigned char *wire, unsigned char dest, unsigned char type, const unsigned char *data, unsigned int len)
+{
+	// A2 side: sync, header, odd bytes, groups of 7, checksum, PEND, 0x00 in memory
+	// Returns bytes in memory
+	unsigned int i, j, odd, groups, n;
+	unsigned char checksum, msbs;
+
+	odd = len % 7;
+	groups = len / 7;
+	memcpy(wire, "\xFF\x3F\xCF\xF3\xFC\xFF", 6);
+	wire[6]  = 0xC3;
+	wire[7]  = dest;
+	wire[8]  = 0x80;									// source, A2 is host
+	wire[9]  = type;
+	wire[10] = 0x80;
+	wire[11] = 0x80;
+	wire[12] = odd | 0x80;
+	wire[13] = groups | 0x80;
+
+	checksum = 0;
+	for (i=7; i<14; i++)
+		checksum ^= wire[i];
+	for (i=0; i<len; i++)
+		checksum ^= data[i];
+
+	n = 14;
+	if (odd != 0)
+	{
+		msbs = 0;
+		for (i=0; i<odd; i++)
+			msbs |= (data[i] >> (i+1)) & (0x80 >> (i+1));
+		wire[n++] = msbs | 0x80;
+		for (i=0; i<odd; i++)
+			wire[n++] = data[i] | 0x80;
+	}
+	for (i=0; i<groups; i++)
+	{
+		msbs = 0;
+		for (j=0; j<7; j++)
+			msbs |= (data[odd + i*7 + j] >> (j+1)) & (0x80 >> (j+1));
+		wire[n++] = msbs | 0x80;
+		for (j=0; j<7; j++)
+			wire[n++] = data[odd + i*7 + j] | 0x80;
+	}
+	wire[n++] =  checksum       | 0xAA;				// 1 C6 1 C4 1 C2 1 C0
+	wire[n++] = (checksum >> 1) | 0xAA;				// 1 C7 1 C5 1 C3 1 C1
+	wire[n++] = 0xC8;								// PEND
+	wire[n++] = 0x00;
+	return n;
+}
+
+//____________________
+char simDecodePacket(const unsigned char *wire, unsigned char *data, unsigned int *len, unsigned char *calc, unsigned char *sent)
+{
+	// PRU side of simEncodePacket(), also checks Controller's replies
+	// Returns 0 if checksum good
+	unsigned int i, j, odd, groups, n;
+	unsigned char checksum, csSent, msbs;
+
+	odd = wire[12] & 0x7F;
+	groups = wire[13] & 0x7F;
+	checksum = 0;
+	for (i=7; i<14; i++)
+		checksum ^= wire[i];
+
+	n = 14;
+	*len = 0;
+	if (odd != 0)
+	{
+		msbs = wire[n++];
+		for (i=0; i<odd; i++)
+			data[(*len)++] = (wire[n++] & 0x7F) | ((msbs << (i+1)) & 0x80);
+	}
+	for (i=0; (i<groups) && (*len + 7 <= RX_DATA_LEN); i++)
+	{
+		msbs = wire[n++];
+		for (j=0; j<7; j++)
+			data[(*len)++] = (wire[n++] & 0x7F) | ((msbs << (j+1)) & 0x80);
+	}
+	for (i=0; i<*len; i++)
+		checksum ^= data[i];
+	csSent = (wire[n] & 0x55) | ((wire[n+1] & 0x55) << 1);
+
+	if (calc != NULL)
+		*calc = checksum;
+	if (sent != NULL)
+		*sent = csSent;
+	return checksum != csSent;
+}
+
+//____________________
+void simFillImages(void)
+{
+	// Blocks differ from each other, so a wrong block doesn't compare equal
+	unsigned int i, j;
+
+	for (i=0; i<NUM_BLOCKS; i++)
+	{
+		for (j=0; j<512; j++)
+		{
+			theImages[0][i][j] = simRand();
+			theImages[1][i][j] = simRand();
+		}
+	}
+}
+
+//____________________
+unsigned int simRand(void)
+{
+	// xorshift32, same traffic every run
+	simSeed ^= simSeed << 13;
+	simSeed ^= simSeed >> 17;
+	simSeed ^= simSeed << 5;
+	return simSeed;
+}
+
+//____________________
+int benchKernels(unsigned int iters)
+{
+	// -K: packet kernels on caller buffers, no PRU or Controller threads
+	// One CSV line per kernel and block: ns and perf counters per call,
+	//  NA where the kernel or perf_event_open() won't have them
+	// Decode is simDecodePacket(), the C version of what ReceivePacket()
+	//  does on the PRU, fed the packet encode just made
+	static const char *dataNames[3] = {"zero", "random", "text"};
+	static const char text[] = "The quick brown fox jumps over the lazy dog. 10 PRINT \"HELLO\"\r20 GOTO 10\r";
+	unsigned int i, pattern, len;
+
+	openKernelCounters();
+	printf("kernel,data,iters,ns,cycles,instructions,branch_misses,cache_misses\n");
+	for (pattern=0; pattern<3; pattern++)
+	{
+		for (i=0; i<512; i++)
+		{
+			if (pattern == 0)
+				kernBlock[i] = 0;
+			else if (pattern == 1)
+				kernBlock[i] = simRand();
+			else
+				kernBlock[i] = text[i % (sizeof(text) - 1)];
+		}
+
+		// Encode and decode have to agree before their times mean anything
+		encodeDataPacket(kernPacket, kernBlock, SIM_ID1, 0x00, 0);
+		if ((simDecodePacket(kernPacket, kernData, &len, NULL, NULL) != 0) || (len != RX_DATA_LEN) ||
+			memcmp(kernData, kernBlock, 512))
+		{
+			printf("*** ERROR: %s block doesn't decode to what was encoded\n", dataNames[pattern]);
+			return -1;
+		}
+
+		benchKernel("encode",	dataNames[pattern], kernEncode,	  iters);
+		benchKernel("decode",	dataNames[pattern], kernDecode,	  iters);
+		benchKernel("checksum", dataNames[pattern], kernChecksum, iters);
+	}
+	benchKernel("status", "NA", kernStatus, iters);
+	benchKernel("dib",	  "NA", kernDib,	iters);
+
+	for (i=0; i<eNUM_KC; i++)
+	{
+		if (kernPerfFd[i] != -1)
+			close(kernPerfFd[i]);
+	}
+	return 0;
+}
+
+//____________________
+void benchKernel(const char *kernel, const char *data, void (*fn)(void), unsigned int iters)
+{
+	// Warm caches and branch predictors, then count iters calls
+	unsigned long long start, elapsed, counts[eNUM_KC];
+	unsigned int i;
+
+	for (i=0; i<iters/10 + 1; i++)
+		fn();
+
+	for (i=0; i<eNUM_KC; i++)
+	{
+		if (kernPerfFd[i] != -1)
+		{
+			ioctl(kernPerfFd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(kernPerfFd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	start = nowNs();
+	for (i=0; i<iters; i++)
+		fn();
+	elapsed = nowNs() - start;
+	for (i=0; i<eNUM_KC; i++)
+	{
+		counts[i] = 0;
+		if (kernPerfFd[i] != -1)
+		{
+			ioctl(kernPerfFd[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(kernPerfFd[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+				counts[i] = 0;
+		}
+	}
+
+	printf("%s,%s,%u,%.2f", kernel, data, iters, (double) elapsed / iters);
+	for (i=0; i<eNUM_KC; i++)
+	{
+		if (kernPerfFd[i] != -1)
+			printf(",%.2f", (double) counts[i] / iters);
+		else
+			printf(",NA");
+	}
+	printf("\n");
+}
+
+//____________________
+void openKernelCounters(void)
+{
+	// This thread's hardware counters, user space only so a paranoid
+	//  setting of 2 still allows them. VMs and some ARM kernels have none
+	static const unsigned long long configs[eNUM_KC] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+	struct perf_event_attr attr;
+	unsigned int i;
+
+	for (i=0; i<eNUM_KC; i++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.type			= PERF_TYPE_HARDWARE;
+		attr.size			= sizeof(attr);
+		attr.config			= configs[i];
+		attr.disabled		= 1;
+		attr.exclude_kernel	= 1;
+		attr.exclude_hv		= 1;
+		kernPerfFd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	if (kernPerfFd[eKC_CYCLES] == -1)
+		fprintf(stderr, "perf_event_open: %s, counters are NA\n", strerror(errno));
+}
+
+//____________________
+void kernEncode(void)
+{
+	encodeDataPacket(kernPacket, kernBlock, SIM_ID1, 0x00, 0);
+	kernSink = kernPacket[600];
+}
+
+//____________________
+void kernDecode(void)
+{
+	unsigned int len;
+
+	kernSink = simDecodePacket(kernPacket, kernData, &len, NULL, NULL);
+}
+
+//____________________
+void kernChecksum(void)
+{
+	kernSink = xorBytes(kernBlock, 512);
+}
+
+//____________________
+void kernStatus(void)
+{
+	encodeStdStatusReplyPacket(kernPacket, SIM_ID1, 0x00);
+	kernSink = kernPacket[19];
+}
+
+//____________________
+void kernDib(void)
+{
+	encodeStdDibStatusReplyPacket(kernPacket, SIM_ID1, 0x00, 0);
+	kernSink = kernPacket[43];
+}
@@ -0,0 +1,298 @@
+;	SmartPort PRU bit loops
+;	Called from SmartPortPru.c when built with BITS_ASM
+;
+;	Every PRU instruction is one cycle (5 ns) except loads. Each counted
+;	stretch is between ;@begin and ;@end markers; cycles.awk adds them up
+;	and make fails if a total differs from the .set budget of the same
+;	name. Paths through a branch are tagged and each one is checked.
+;	Between ;@strict and ;@end strict (TxLoop and Fetch) an instruction
+;	must be counted or sit in a ;@begin uncounted stretch saying why.
+;	Loads count LBBO_CYCLES, ;@add counts a whole budget, e.g. a call.
+;
+;	The counts are only as good as LBBO_CYCLES: a load from Data RAM or
+;	shared RAM takes that long when nothing else is using the RAM. When
+;	the ARM (Controller writing TX_RAW or the cursor) or PRU0 (a cache
+;	block in shared RAM) gets there at the same time the load waits, and
+;	the cell it is in gets longer by that much. Nothing here bounds the
+;	wait. Checked with cycles.awk only, not yet assembled with clpru or
+;	timed on a PRU.
+;
+;	clpru calling convention: args r14, r15, r16, result r14,
+;	return address r3.w2, r0, r1 and r14-r29 free to use
+
+	.text
+
+LBBO_CYCLES			.set	3			; 1 to 4 aligned bytes from Data RAM or shared RAM, uncontended
+
+; ---- Transmit ----
+; A bit cell is src->cell cycles from one RDAT edge instruction to the next
+; A 1 is RDAT low for src->low cycles, a 0 leaves RDAT high
+; Both come from Controller or Calibrate(), SendBits() checked them and
+;	rounded them down to even: delay loops are 2 cycles
+TX_LOW_FIXED		.set	4			; edge to RDAT = 1, outside delay loop
+TX_HIGH_FIXED		.set	30			; RDAT = 1 to next edge, outside delay loop
+TX_FETCH_FIXED		.set	17			; Fetch, every path, JAL not included
+
+	.if (TX_LOW_FIXED & 1) | (TX_HIGH_FIXED & 1)
+	.emsg "TX_LOW_FIXED and TX_HIGH_FIXED must be even, 2 cycle delay loops"
+	.endif
+
+; Source struct, must match txSrc in SmartPortPru.c
+;	head bytes as they are, then groups of 7 (one msbs byte, 7 raw bytes
+;	with msb set), then tail bytes up to and including 0x00
+;	A packet already in RAM is all tail, and may still be being written:
+;	no tail byte at or past the uint32 at limit is sent
+
+;____________________
+; uint32_t TxLoop(txSrc *src)
+; Send from src, msb first, until the 0x00 end marker has been sent
+; Returns 0, or 1 if the tail caught up with limit, packet ends after the
+; byte before it
+; RDAT is r30.t6, caller has A2 ready and RDAT enabled
+;	r20 head ptr	r21 head left	r22 msbs ptr	r23 raw ptr
+;	r24 groups left	r25 tail ptr	r26 byte in group
+;	r27 byte being sent, shifted	r28 bits left	r19 byte being sent
+;	r18 fetched byte	r0 delay count
+;	r17 low delay count	r16 high delay count	r15 limit address
+	.global TxLoop
+;@strict
+TxLoop:
+;@begin uncounted before the first edge
+	LBBO	&r20, r14, 0, 24
+	LBBO	&r15, r14, 32, 4		; limit
+	LBBO	&r16, r14, 24, 8		; r16 cell, r17 low
+	SUB		r16, r16, r17
+	SUB		r16, r16, TX_HIGH_FIXED
+	LSR		r16, r16, 1
+	SUB		r17, r17, TX_LOW_FIXED
+	LSR		r17, r17, 1
+	LDI		r26, 0
+	JAL		r29.w0, Fetch
+	MOV		r27, r18
+	MOV		r19, r18
+	LDI		r28, 8
+;@end uncounted
+
+TxCell:
+;@begin TX_HIGH_FIXED
+	QBBS	TxOne, r27, 7
+;@end TX_HIGH_FIXED
+;@begin TX_HIGH_FIXED bit=zero
+	SET		r30, r30, 6				; a 0: RDAT stays 1, edge instruction
+;@end TX_HIGH_FIXED
+;@begin TX_LOW_FIXED bit=zero
+	QBA		TxLow
+;@end TX_LOW_FIXED
+TxOne:
+;@begin TX_HIGH_FIXED bit=one
+	CLR		r30, r30, 6				; a 1: RDAT = 0, edge instruction
+;@end TX_HIGH_FIXED
+;@begin TX_LOW_FIXED bit=one
+	NOP
+;@end TX_LOW_FIXED
+TxLow:
+;@begin TX_LOW_FIXED
+	NOP
+	MOV		r0, r17
+;@end TX_LOW_FIXED
+TxLowDelay:
+;@begin uncounted 2 cycles a pass, r17 passes
+	SUB		r0, r0, 1
+	QBNE	TxLowDelay, r0, 0
+;@end uncounted
+;@begin TX_LOW_FIXED
+	SET		r30, r30, 6				; RDAT = 1
+;@end TX_LOW_FIXED
+
+	; Same cycles whether or not a new byte is needed
+;@begin TX_HIGH_FIXED
+	LSL		r27, r27, 1
+	SUB		r28, r28, 1
+	QBNE	TxSameByte, r28, 0
+;@end TX_HIGH_FIXED
+;@begin TX_HIGH_FIXED byte=next
+	QBEQ	TxDone, r19, 0			; just sent end marker
+	JAL		r29.w0, Fetch
+;@add TX_FETCH_FIXED
+	MOV		r27, r18
+	MOV		r19, r18
+	LDI		r28, 8
+	QBA		TxHigh
+;@end TX_HIGH_FIXED
+TxSameByte:
+;@begin TX_HIGH_FIXED byte=same
+	LBBO	&r1, r20, 0, 1			; stands in for Fetch's loads
+	LBBO	&r1, r15, 0, 4
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+;@end TX_HIGH_FIXED
+TxHigh:
+;@begin TX_HIGH_FIXED
+	MOV		r0, r16
+;@end TX_HIGH_FIXED
+TxHighDelay:
+;@begin uncounted 2 cycles a pass, r16 passes
+	SUB		r0, r0, 1
+	QBNE	TxHighDelay, r0, 0
+;@end uncounted
+;@begin TX_HIGH_FIXED
+	QBA		TxCell
+;@end TX_HIGH_FIXED
+
+TxDone:
+;@begin uncounted after the last edge
+	LDI		r14, 0
+TxFinish:
+	MOV		r0, r16					; finish last cell
+TxDoneDelay:
+	SUB		r0, r0, 1
+	QBNE	TxDoneDelay, r0, 0
+	JMP		r3.w2
+
+TxUnderrun:							; from Fetch, RDAT already 1
+	LDI		r14, 1
+	QBA		TxFinish
+;@end uncounted
+
+;____________________
+; Fetch: next wire byte into r18, TX_FETCH_FIXED cycles on every path
+; Called with JAL r29.w0
+Fetch:
+;@begin TX_FETCH_FIXED
+	QBEQ	FetchGroups, r21, 0
+;@end TX_FETCH_FIXED
+;@begin TX_FETCH_FIXED src=head
+	LBBO	&r1, r15, 0, 4			; like tail's limit check
+	NOP
+	LBBO	&r18, r20, 0, 1
+	ADD		r20, r20, 1
+	SUB		r21, r21, 1
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	JMP		r29.w0
+;@end TX_FETCH_FIXED
+FetchGroups:
+;@begin TX_FETCH_FIXED src=msbs,raw,raw8,tail
+	QBEQ	FetchTail, r24, 0
+;@end TX_FETCH_FIXED
+;@begin TX_FETCH_FIXED src=msbs,raw,raw8
+	LBBO	&r1, r15, 0, 4			; like tail's limit check
+	NOP
+	QBNE	FetchRaw, r26, 0
+;@end TX_FETCH_FIXED
+;@begin TX_FETCH_FIXED src=msbs
+	LBBO	&r18, r22, 0, 1			; group msbs byte
+	ADD		r22, r22, 1
+	ADD		r26, r26, 1
+	NOP
+	NOP
+	NOP
+	NOP
+	JMP		r29.w0
+;@end TX_FETCH_FIXED
+FetchRaw:
+;@begin TX_FETCH_FIXED src=raw,raw8
+	LBBO	&r18, r23, 0, 1			; raw byte, msb set on the wire
+	OR		r18, r18, 0x80
+	ADD		r23, r23, 1
+	ADD		r26, r26, 1
+	QBNE	FetchRawMore, r26, 8
+;@end TX_FETCH_FIXED
+;@begin TX_FETCH_FIXED src=raw8
+	LDI		r26, 0					; group done
+	SUB		r24, r24, 1
+	JMP		r29.w0
+;@end TX_FETCH_FIXED
+FetchRawMore:
+;@begin TX_FETCH_FIXED src=raw
+	NOP
+	NOP
+	JMP		r29.w0
+;@end TX_FETCH_FIXED
+FetchTail:
+;@begin TX_FETCH_FIXED src=tail
+	LBBO	&r1, r15, 0, 4			; Controller's cursor, or 0xFFFFFFFF
+	QBLE	TxUnderrun, r25, r1		; not written yet
+	LBBO	&r18, r25, 0, 1
+	ADD		r25, r25, 1
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+	JMP		r29.w0
+;@end TX_FETCH_FIXED
+;@end strict
+
+; ---- Receive ----
+; WDAT is r31.t0. RX_LOOKS single-cycle looks at WDAT per CYCLE read
+; An edge is timestamped at most RX_EDGE_MAX cycles after it happens:
+;	worst case is just after the last look, then the timeout check and
+;	one more look run before the CYCLE read in WaitEdgeSeen
+RX_LOOKS			.set	8
+RX_EDGE_MAX			.set	6			; CYCLE load, SUB, QBLE, one look
+PRU1_CTRL			.set	0x24000
+CTRL_CYCLE			.set	12			; byte offset
+
+;____________________
+; uint32_t WaitEdge(uint32_t level, uint32_t lastEdge, uint32_t timeout)
+; Wait for WDAT to leave level (0 or 1)
+; Returns CYCLE at the edge, or 0 if CYCLE - lastEdge went past timeout
+	.global WaitEdge
+WaitEdge:
+	LDI32	r1, PRU1_CTRL
+	QBBS	WaitHigh, r14, 0
+
+WaitLow:								; WDAT = 0, wait for 1
+;@begin RX_EDGE_MAX level=low
+	QBBS	WaitEdgeSeen, r31, 0
+;@end RX_EDGE_MAX
+	.loop	RX_LOOKS - 1
+	QBBS	WaitEdgeSeen, r31, 0
+	.endloop
+;@begin RX_EDGE_MAX level=low
+	LBBO	&r0, r1, CTRL_CYCLE, 4
+	SUB		r0, r0, r15
+	QBLE	WaitLow, r16, r0		; loop while r0 <= timeout
+;@end RX_EDGE_MAX
+	LDI		r14, 0
+	JMP		r3.w2
+
+WaitHigh:								; WDAT = 1, wait for 0
+;@begin RX_EDGE_MAX level=high
+	QBBC	WaitEdgeSeen, r31, 0
+;@end RX_EDGE_MAX
+	.loop	RX_LOOKS - 1
+	QBBC	WaitEdgeSeen, r31, 0
+	.endloop
+;@begin RX_EDGE_MAX level=high
+	LBBO	&r0, r1, CTRL_CYCLE, 4
+	SUB		r0, r0, r15
+	QBLE	WaitHigh, r16, r0
+;@end RX_EDGE_MAX
+	LDI		r14, 0
+	JMP		r3.w2
+
+WaitEdgeSeen:
+	LBBO	&r14, r1, CTRL_CYCLE, 4
+	JMP		r3.w2
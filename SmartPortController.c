@@ -3,13 +3,25 @@
 	Modern OS, shared memory
 	08/2025
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
 
 #include <errno.h>
 extern int errno;
@@ -17,18 +29,122 @@ extern int errno;
 void myShutdown(int sig);
 void myDebug(int sig);
 void loadDiskImages(const char *image1, const char *image2);
-void saveDiskImage(unsigned char image, const char *fileName);
+int  saveDiskImage(unsigned char image, const char *fileName);
+void savedImageName(unsigned char image, char *saveName);
 
 void encodeInitReplyPackets(void);
-void encodeStdStatusReplyPacket(unsigned char srcID, unsigned char dataStat);
-void encodeStdDibStatusReplyPacket(unsigned char srcID, unsigned char dataStat);
-void encodeDataPacket(unsigned char srcID, unsigned char dataStat, unsigned char device, unsigned int block);
-
-char decodeDataPacket(void);
+void encodeStdStatusReplyPacket(unsigned char *packet, unsigned char srcID, unsigned char dataStat);
+void encodeStdDibStatusReplyPacket(unsigned char *packet, unsigned char srcID, unsigned char dataStat, unsigned char device);
+void primeStatusTemplates(void);
+void encodeDataPacket(unsigned char *packet, const unsigned char *data, unsigned char srcID, unsigned char dataStat, char stream);
+unsigned char xorBytes(const unsigned char *bytes, unsigned int len);
+void setTxCursor(unsigned int len);
+void streamRxData(void);
+void stageDataBlock(unsigned char srcID, unsigned char dataStat, unsigned char device, unsigned int block);
+
+char checkDataPacket(void);
 char checkCmdChecksum(void);
 void printRcvdPacket(void);
 void debugDataPacket(void);
 
+struct timingStat;
+void releasePru(unsigned char waitCode);
+void addTimingSample(struct timingStat *stat, unsigned int cycles);
+void queueTimingSample(void);
+void printTimingStat(const char *name, struct timingStat *stat);
+void printTimingStats(void);
+void setRxWindows(unsigned int cellNs);
+void setTxTiming(unsigned int cellNs, unsigned int lowNs, unsigned int gapNs);
+void printRxStats(void);
+void printCalStats(void);
+void samplePerf(void);
+void printPerfStats(void);
+
+struct latHist;
+unsigned long long nowNs(void);
+void histAdd(struct latHist *hist, unsigned int value);
+unsigned int histIndex(unsigned int value);
+unsigned int histPercentile(struct latHist *hist, double pct);
+void pollWait(unsigned char pruStatus);
+void switchPollMode(unsigned char mode, unsigned long long now);
+void printPollStats(void);
+void usage(const char *prog);
+
+int  enterRealTime(unsigned char *pru, pthread_attr_t *attr);
+void prefaultStack(void);
+void jitterProbe(unsigned int seconds);
+void printHistLine(const char *name, struct latHist *hist);
+
+struct spscQueue;
+struct mpscQueue;
+void spscInit(struct spscQueue *q, unsigned int size, unsigned int elemSize);
+int  spscPush(struct spscQueue *q, const void *elem);
+int  spscPop(struct spscQueue *q, void *elem);
+unsigned int spscDepth(struct spscQueue *q);
+void mpscInit(struct mpscQueue *q, unsigned int size, unsigned int elemSize);
+int  mpscPush(struct mpscQueue *q, const void *elem);
+int  mpscPop(struct mpscQueue *q, void *elem);
+unsigned int mpscDepth(struct mpscQueue *q);
+
+struct worker;
+void *busThread(void *arg);
+void logMsg(const char *fmt, ...);
+void startWorkers(void);
+void stopWorkers(void);
+void workerDone(struct worker *w, unsigned long long enqNs);
+void *logWorker(void *arg);
+void *storageWorker(void *arg);
+void *statsWorker(void *arg);
+void *prefetchWorker(void *arg);
+void printQueueStats(void);
+void queueCmdSample(unsigned char destID, unsigned char type, unsigned char cmdNum);
+void printCmdStats(void);
+int  openMetrics(const char *spec);
+void *metricsThread(void *arg);
+void metricsService(void);
+void metricsSnapshot(void);
+void closeMetrics(void);
+void leAdd(unsigned int *le, unsigned int value);
+unsigned int formatMetrics(char *buf, unsigned int size);
+void metricsAppend(char *buf, unsigned int size, unsigned int *len, const char *fmt, ...);
+
+void pruCmdService(void);
+void printPruCmdStats(void);
+
+#ifdef PRU_SIM
+// ControllerBench.c, benchmark build only
+int  simOption(int opt, const char *arg);
+void simUsage(void);
+int  simBefore(void);
+int  simImages(void);
+void *simPru(void *arg);
+int  simAfter(void);
+#endif
+
+void cacheFill(unsigned char busID, unsigned char device, unsigned int block);
+void cacheService(void);
+void cacheInvalidate(unsigned char busID, unsigned int block);
+void cacheInvalidateAll(void);
+void printCacheStats(void);
+
+struct eventRec;
+int  openEventLog(const char *path);
+void closeEventLog(void);
+void logEvent(unsigned short code, unsigned char device, unsigned int block, unsigned char status, unsigned int arg);
+unsigned int drainEvents(struct worker *w);
+void formatEvent(const struct eventRec *rec);
+int  dumpEventLog(const char *path);
+struct traceHeader;
+struct traceHeader *mapTraceFile(const char *name, unsigned int seq);
+void rotateTraceFiles(void);
+int  openTrace(const char *path);
+void closeTrace(void);
+void tracePacket(unsigned char dest, unsigned char type, unsigned char cmd, unsigned int block,
+	unsigned char device, char dataReply, unsigned char flags);
+unsigned int traceService(void);
+struct traceHeader *readTrace(const char *path, unsigned int *used);
+int  dumpTrace(const char *path, const char *filter);
+
 // PRU Memory Locations
 #define PRU_ADDR			0x4A300000		// Start of PRU memory Page 163 am335x TRM
 #define PRU_LEN				0x80000			// Length of PRU memory
@@ -42,7 +158,32 @@ void debugDataPacket(void);
 #define WAIT_SET			0x00			// PRU -> Controller: waiting
 #define WAIT_GO				0x01			// Controller -> PRU: send response
 #define WAIT_SKIP			0x02			// Controller -> PRU: continue without sending response
+#define WAIT_GO_BLOCK		0x03			// Controller -> PRU: encode and send data packet from raw block
+#define WAIT_GO_STREAM		0x04			// Controller -> PRU: send packet we are still writing, up to TX_CURSOR
 #define ERROR_ADR			0x0304			// address of PRU error code
+#define RX_REBUILD_ADR		0x0305			// Controller -> PRU: Rx windows changed
+#define STAT_READY_ADR		0x0306			// Controller -> PRU: status templates primed
+#define WRITE_ON_ADR		0x0307			// Controller -> PRU: take WRITEBLK commands
+#define CAL_MODE_ADR		0x0308			// Controller -> PRU: what to do with calibration
+#define CAL_ADAPT_RX		0x01			// PRU re-centres Rx windows on measured cell
+#define CAL_TRIM_TX			0x02			// PRU sends at measured cell
+
+// Transaction timing from PRU, 32-bit values in PRU cycles (5 ns)
+#define GO_START_ADR		0x0310			// GO to SendPacket() start
+#define GO_FIRSTBIT_ADR		0x0314			// GO to first bit on RDAT
+#define HOST_WAIT_ADR		0x0318			// eRCVDPACK to GO
+#define TIMING_SEQ_ADR		0x031C			// incremented each time timing is updated
+#define PRU_CYCLES_PER_US	200
+
+// Receive bit-cell windows, uint32 PRU cycles: below limit n-1 is n cells,
+//  above last limit ends the packet
+#define RX_LIMITS_ADR		0x0320
+#define RX_CELLS			8
+
+// Doorbell: system event set in PRU INTC after writing WAIT_ADR
+#define PRU_INTC			0x20000			// PRU-ICSS interrupt controller
+#define INTC_SRSR0			0x0020			// system event status raw set 0
+#define FROM_HOST_EVENT		19				// must match SmartPortPru.c
 
 #define RCVD_PACKET_ADR		0x0400			// 1048, command or data from A2
 #define RCVD_PBEGIN_ADR		0x0406			// Packet Begin
@@ -54,31 +195,155 @@ void debugDataPacket(void);
 #define INIT_RESP_1_ADR		0x0C00			// 3072
 #define INIT_RESP_2_ADR		0x0E00			// 3584
 
+// Received packet as decoded by PRU while it arrived, must match SmartPortPru.c
+#define RX_DATA_ADR			0x1100			// odd bytes then groups of 7
+#define RX_DATA_LEN			512
+#define RX_INFO_ADR			0x1300
+#define RX_INFO_CS			0				// eRxChecksum
+#define RX_INFO_HDR			1				// 7 header bytes, wire form
+#define RX_INFO_LEN			8				// uint16 decoded bytes
+#define RX_INFO_CALC		10				// checksum PRU computed
+#define RX_INFO_SENT		11				// checksum in packet
+#define RX_INFO_CURSOR		12				// uint32, PRU address after last decoded chunk
+
+// WRITEBLK command PRU took, block for the data packet that follows
+#define WRITE_DESC_ADR		0x1310
+#define WRITE_DESC_VALID	0				// PRU sets, we clear
+#define WRITE_DESC_ID		1				// bus ID
+#define WRITE_DESC_CMD		2				// 0x82 or 0xC2
+#define WRITE_DESC_BLOCK	4				// uint32
+
+// Raw block for PRU to encode, WAIT_GO_BLOCK
+#define TX_SRC_ADR			0x1320			// source ID, msb set
+#define TX_STAT_ADR			0x1321			// data status
+#define TX_RAW_ADR			0x1400			// 512 bytes
+
 // Someday might move everything to shared memory
-//#define PRU_SHAREDMEM	0x10000				// Offset to shared memory
-//unsigned int *prusharedMem_32int_ptr;		// Points to the start of shared memory
-
-static unsigned char *pru1RAMptr;			// start of PRU1 memory
-static unsigned char *pruStatusPtr;			// PRU -> Controller
-static unsigned char *busID1ptr;			// spID1 in PRU memory
-static unsigned char *busID2ptr;			// spID2 in PRU memory
-static unsigned char *pruWaitPtr;			// flag to pause PRU in PRU memory
-static unsigned char *pruErrorPtr;			// error code in PRU memory
-
-static unsigned char *rcvdPacketPtr;		// start packet A2 sent us
-static unsigned char *rcvdPacketBeginPtr;
-static unsigned char *rcvdPacketDestPtr;
-static unsigned char *rcvdPacketTypePtr;
-static unsigned char *rcvdPacketCmdPtr;
-
-static unsigned char *respPacketPtr;		// start of what we send to A2
-static unsigned char *initResp1Ptr;			// start of Init response 1
-static unsigned char *initResp2Ptr;			// start of Init response 2
-
-unsigned char running;
+#define PRU_SHAREDMEM		0x10000			// Offset to shared memory
+
+// Receive interval statistics in shared memory, word offsets, must match SmartPortPru.c
+#define RX_HIST_SHIFT		5				// 32 cycles per bin
+#define RX_HIST_BINS		256
+#define RX_HIST_OFS			0
+#define RX_CNT_OFS			256
+#define RX_MIN_OFS			264
+#define RX_MAX_OFS			272
+#define RX_WORK_MAX_OFS		280				// cycles from edge to ready for next edge
+#define RX_WORK_SUM_OFS		281				// last packet
+#define RX_EDGES_OFS		282				// last packet
+
+// PRU block cache in shared memory, word offsets, must match SmartPortPru.c
+// To replace an entry: clear tag, wait while CACHE_BUSY is that entry, write block, write tag
+#define CACHE_HITS_OFS		288				// READBLKs PRU sent from cache
+#define CACHE_MISSES_OFS	289				// READBLKs PRU passed to us
+#define CACHE_BUSY_OFS		290				// entry PRU is sending
+#define CACHE_LAST_OFS		291				// tag of last hit
+#define CACHE_TAGS_OFS		320
+#define CACHE_ENTRIES		20
+#define CACHE_DATA			0x0800			// byte offset in shared memory
+#define CACHE_NONE			0xFFFFFFFF
+#define CACHE_TAG(id, blk)	(((unsigned int) (id) << 24) | (blk))
+
+// STATUS and DIB replies PRU sends on its own, must match SmartPortPru.c
+// 4 templates: STATUS device 1, 2, DIB device 1, 2
+#define STAT_TMPL_ADR		0x1700
+#define STAT_TMPL_LEN		64
+#define STAT_TMPL_DIB		2				// first DIB template
+#define STAT_TMPL_CS		62				// offset of checksum in packet
+#define STAT_TMPL_PART		63				// checksum of all but source ID
+#define STAT_REPLIES_OFS	292				// word offsets in shared memory
+#define DIB_REPLIES_OFS		293
+
+// PRU0 protocol engine, when its firmware is loaded, must match SmartPortPru.c
+#define ENGINE_OFS			294				// ENGINE_MAGIC while running
+#define ENGINE_JOBS_OFS		295				// packets it planned for PRU1
+#define ENGINE_MAGIC		0x50525530
+
+// Disk images in a DDR carve-out PRU reads READBLKs from, must match SmartPortPru.c
+// Kernel must leave the memory alone, e.g. boot with mem=448M and use 0x9C000000
+#define DDR_BASE_ADR		0x1324			// uint32 physical address, 0 = off
+#define DDR_BLOCKS_ADR		0x1328			// uint32 blocks per image
+#define DDR_READS_OFS		296				// word offsets in shared memory
+#define DDR_LAST_OFS		297				// bus ID << 24 | block
+
+// Bit cell PRU measures on each packet's sync bytes, 1/16 cycles, must match SmartPortPru.c
+#define CAL_PACKETS_OFS		298				// word offsets in shared memory
+#define CAL_REJECTS_OFS		299				// sync didn't decode as 47 cells
+#define CAL_LAST_OFS		300
+#define CAL_AVG_OFS			301				// smoothed over about 8 packets
+#define CAL_MIN_OFS			302
+#define CAL_MAX_OFS			303
+#define CAL_RX_CELL_OFS		304				// cell Rx windows were last built for
+
+// Transmit timing PRU schedules its bits on, uint32 cycles, must match SmartPortPru.c
+#define TX_CELL_ADR			0x132C			// bit cell, PRU trims it with -a 2
+#define TX_LOW_ADR			0x1330			// RDAT low for a 1
+#define TX_GAP_ADR			0x1334			// after Init reply
+
+// Streaming, -T: PRU sends our packet while we write it, never past TX_CURSOR
+#define TX_CURSOR_ADR		0x133C			// uint32 PRU address, end of what we wrote
+#define TX_UNDERRUNS_OFS	305				// word offset in shared memory
+
+// PRU perf block, word offsets in shared memory, must match SmartPortPru.c
+// Phases in cycles since REQ rose, 0 = didn't happen; copy only while PERF_SEQ is even
+#define PERF_OFS			352
+#define PERF_SEQ			0
+#define PH_RX_START			1
+#define PH_RX_END			2
+#define PH_NOTIFY			3				// eRCVDPACK
+#define PH_GO				4
+#define PH_SEND_START		5
+#define PH_FIRST_BIT		6
+#define PH_SEND_END			7
+#define PH_DONE				8
+#define PF_PACKETS			9
+#define PF_ERROR1			10
+#define PF_ERROR2			11
+#define PF_ERROR3			12
+#define PF_RESETS			13
+#define PF_HOST_WAIT		14				// uint64 cycles
+#define PF_REQ_WAIT			16				// uint64 cycles
+#define PF_LAST_JOB			18				// eJobKind << 8 | eJobDone
+#define PF_WORDS			20
+
+// Not static: ControllerBench.c plays PRU1 through them
+unsigned char *pru1RAMptr;						// start of PRU1 memory
+volatile unsigned char *pruStatusPtr;			// PRU -> Controller
+volatile unsigned char *busID1ptr;				// spID1 in PRU memory
+volatile unsigned char *busID2ptr;				// spID2 in PRU memory
+volatile unsigned char *pruWaitPtr;				// flag to pause PRU in PRU memory
+volatile unsigned char *pruErrorPtr;			// error code in PRU memory
+volatile unsigned char *statReadyPtr;			// status templates primed
+volatile unsigned int *pruDoorbellPtr;			// INTC SRSR0
+
+volatile unsigned int *goStartPtr;				// PRU timing
+volatile unsigned int *goFirstBitPtr;
+volatile unsigned int *hostWaitPtr;
+volatile unsigned int *timingSeqPtr;
+volatile unsigned int *rxLimitsPtr;				// PRU receive windows
+volatile unsigned int *sharedMemPtr;			// PRU shared memory: receive stats, block cache
+unsigned char *cacheDataPtr;					// PRU block cache entries
+
+unsigned char *rcvdPacketPtr;					// start packet A2 sent us
+unsigned char *rcvdPacketBeginPtr;
+unsigned char *rcvdPacketDestPtr;
+unsigned char *rcvdPacketTypePtr;
+unsigned char *rcvdPacketCmdPtr;
+
+unsigned char *respPacketPtr;					// start of what we send to A2
+unsigned char *initResp1Ptr;					// start of Init response 1
+unsigned char *initResp2Ptr;					// start of Init response 2
+unsigned char *rxDataPtr;						// decoded payload
+volatile unsigned char *rxInfoPtr;				// decode result
+volatile unsigned char *writeDescPtr;			// WRITEBLK PRU took
+unsigned char *txRawPtr;						// raw block for PRU to encode
+
+volatile unsigned char running;
 #define NUM_BLOCKS	65536
-unsigned char theImages[2][NUM_BLOCKS][512];	// [device][block][byte]
-unsigned char tempBuffer[512];					// holds data from A2 till verified
+#define IMAGES_LEN	(2 * NUM_BLOCKS * 512)
+unsigned char (*theImages)[NUM_BLOCKS][512];	// [device][block][byte], DDR carve-out with -m
+unsigned long ddrAddr;							// -m, physical address of carve-out, 0 = none
+unsigned int ddrLastReads;
 
 // First image is boot device
 //const char *diskImages[] = {"IIGSSystem604/LiveInstall.po", "Large/BigBlank.po"};
@@ -96,26 +361,469 @@ const char *diskImages[] = {"Large/MySystem604.po", "Large/DISKS_AA.po"};
 // IDs provided by A2
 unsigned char spID1, spID2;
 
-//____________________
-int main(int argc, char *argv[])
+// PRU-reported transaction timing, in PRU cycles
+struct timingStat
 {
-	unsigned char destID, destDevice, type, cmdNum, statCode, id;
-	unsigned char msbs, blkNumLow, blkNumMid, blkNumHi;
-	unsigned char diskImage1Changed, diskImage2Changed;		// 1 = image changed since loading
-	unsigned int i, resetCnt, loopCnt, blkNum, readCnt1, writeCnt1, readCnt2, writeCnt2;
-	char saveName[64];
+	unsigned int cnt, min, max;
+	unsigned long long sum;
+};
+struct timingStat hostWaitStat, goStartStat, goFirstBitStat;
 
-	enum pruStatuses {eIDLE, eRESET, eENABLED, eRCVDPACK, eSENDING, eWRITING, eUNKNOWN};
-	enum pruStatuses pruStatus, lastPruStatus;
+// Transaction broken into phases from the PRU perf block, stats worker samples it
+struct perfInterval
+{
+	const char *name;
+	unsigned char from, to;		// PH_, PERF_SEQ = REQ rise
+	unsigned char pruOnly;		// only when Controller wasn't asked
+};
+const struct perfInterval perfIntervals[] =
+{
+	{"REQ->rx start",	PERF_SEQ,		PH_RX_START,	0},
+	{"receive",			PH_RX_START,	PH_RX_END,		0},
+	{"rx->RCVDPACK",	PH_RX_END,		PH_NOTIFY,		0},
+	{"RCVDPACK->GO",	PH_NOTIFY,		PH_GO,			0},
+	{"GO->send",		PH_GO,			PH_SEND_START,	0},
+	{"rx->send (PRU)",	PH_RX_END,		PH_SEND_START,	1},
+	{"send->first bit",	PH_SEND_START,	PH_FIRST_BIT,	0},
+	{"first->last bit",	PH_FIRST_BIT,	PH_SEND_END,	0},
+	{"send end->done",	PH_SEND_END,	PH_DONE,		0},
+	{"REQ->done",		PERF_SEQ,		PH_DONE,		0},
+};
+#define PERF_INTERVALS		(sizeof(perfIntervals) / sizeof(perfIntervals[0]))
+struct timingStat perfStats[PERF_INTERVALS];
+unsigned int perfLastSeq, perfSampled, perfMissed;
+unsigned int lastTimingSeq;
+unsigned int rxCellNs = 4000;					// -w, receive bit cell
+unsigned char pruEncode = 1;					// -H clears, host encodes data packets
+unsigned char pruReplies = 1;					// -S clears, host answers every STATUS
+unsigned int statLastReplies, dibLastReplies;	// PRU counters last seen
+unsigned char pruWriteCmds = 1;					// -W clears, host sees WRITEBLK commands
+unsigned int pruWrites;							// data packets after a WRITEBLK PRU took
+unsigned char calMode;							// -a, CAL_ADAPT_RX | CAL_TRIM_TX
+unsigned int txCellNs = 4000, txLowNs = 1750, txGapNs = 25000;	// -t
+unsigned char pruStream;						// -T, stream data packets both ways
+unsigned char rxStream[RX_DATA_LEN];			// WRITEBLK data copied while PRU receives it
+unsigned int rxStreamLen;
+
+// Must be identical to SmartPortPru.c
+enum pruStatuses {eIDLE, eRESET, eENABLED, eRCVDPACK, eSENDING, eWRITING, eUNKNOWN};
+enum pruErrors {eNOERROR, eERROR1, eERROR2, eERROR3, eERROR_UNDERRUN};
+enum rxChecksums {eRX_CS_NONE, eRX_CS_GOOD, eRX_CS_BAD};
+
+// Latency histogram, log-linear buckets, 32 per power of two (~3% resolution)
+#define HIST_SUB_BITS		5
+#define HIST_SUB			(1<<HIST_SUB_BITS)
+#define HIST_BUCKETS		((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+struct latHist
+{
+	unsigned int counts[HIST_BUCKETS];
+	unsigned int cnt, max;
+	unsigned long long sum;
+};
+
+// Adaptive wait between looks at PRU status:
+//	spin while bus enabled and traffic recent, back off to sleeping as bus
+//	goes quiet, park when A2 is off or in reset
+#if defined(__arm__) || defined(__aarch64__)
+#define cpu_relax()			__asm__ __volatile__("yield" ::: "memory")
+#elif defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()			__asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax()			__asm__ __volatile__("" ::: "memory")
+#endif
+#define SPIN_BATCH			64				// status checks between clock reads
+#define BACKOFF_MIN_US		1
+
+enum pollModes {eSPIN, eBACKOFF, ePARK, eNUM_POLL_MODES};
+const char *pollModeNames[] = {"spin", "backoff", "park"};
+struct pollModeStat
+{
+	unsigned long long wallNs, cpuNs;
+	unsigned int entries;
+	struct latHist turnaround;					// eRCVDPACK to GO, ns, by mode packet arrived in
+};
+struct pollModeStat pollStats[eNUM_POLL_MODES];
+
+unsigned int spinWindowUs = 2000;				// -s, keep spinning this long after traffic
+unsigned int backoffMaxUs = 1000;				// -b, longest sleep while enabled
+unsigned int parkUs		  = 20000;				// -p, sleep while idle or reset
+unsigned char pollMode, rcvdPollMode;
+unsigned int backoffUs;
+unsigned long long lastTrafficNs, modeStartNs;
+struct latHist allTurnaround;					// eRCVDPACK to GO, ns, all modes
+
+// Threads: bus thread services PRU, workers do everything that may block
+// Bus thread hands work over lock-free queues of fixed-size slots and
+//  never waits: a full queue drops the item and counts it
+struct spscQueue									// one producer, one consumer
+{
+	_Alignas(64) _Atomic unsigned int head;			// next slot to fill, producer
+	_Alignas(64) _Atomic unsigned int tail;			// next slot to empty, consumer
+	unsigned int mask, elemSize, highWater;
+	_Atomic unsigned int dropped;
+	unsigned char *slots;
+};
+struct mpscQueue									// many producers, one consumer
+{
+	_Alignas(64) _Atomic unsigned int head;			// next slot to claim, producers
+	_Alignas(64) _Atomic unsigned int tail;			// next slot to empty, consumer
+	unsigned int mask, elemSize;
+	_Atomic unsigned int highWater, dropped;
+	_Atomic unsigned int *seqs;						// slot free when seq == pos, full when pos+1
+	unsigned char *slots;
+};
+
+// Queue items, all start with time of enqueue for worker lag
+#define LOG_TEXT_LEN		112
+struct logEntry
+{
+	unsigned long long ns;
+	char text[LOG_TEXT_LEN];
+};
+struct storageOp
+{
+	unsigned long long ns;
+	unsigned int block;
+	unsigned char device;
+};
+struct prefetchOp
+{
+	unsigned long long ns;
+	unsigned int block;
+	unsigned char device, busID;
+};
+struct cacheFillOp
+{
+	unsigned long long ns;
+	unsigned int entry, tag, gen;
+};
+struct statSample
+{
+	unsigned long long ns;
+	unsigned int hostWait, goStart, goFirstBit;		// PRU cycles
+	unsigned int turnNs;							// eSAMPLE_CMD: eRCVDPACK seen to GO/SKIP written
+	unsigned char what;								// eSAMPLE_PRU or eSAMPLE_CMD
+	unsigned char mode;								// poller mode packet arrived in
+	unsigned char unit, kind;						// eSAMPLE_CMD: cmdHist[unit][kind]
+};
+enum statSamples {eSAMPLE_PRU, eSAMPLE_CMD};
+
+struct worker
+{
+	const char *name;
+	void *(*func)(void *);
+	pthread_t thread;
+	unsigned long long done, lagSumNs, lagMaxNs;	// lag = enqueue to start of work
+};
+enum workerIdx {eLOG_WORKER, eSTORAGE_WORKER, eSTATS_WORKER, ePREFETCH_WORKER, eNUM_WORKERS};
+struct worker workers[eNUM_WORKERS] =
+{
+	[eLOG_WORKER]		= {.name = "log",	   .func = logWorker},
+	[eSTORAGE_WORKER]	= {.name = "storage",  .func = storageWorker},
+	[eSTATS_WORKER]		= {.name = "stats",	   .func = statsWorker},
+	[ePREFETCH_WORKER]	= {.name = "prefetch", .func = prefetchWorker}
+};
+
+#define WORKER_IDLE_US		1000				// worker sleep when its queue is empty
+#define STATS_SAMPLE_NS		10000000ULL			// bus thread CPU time sampling
+#define FLUSH_INTERVAL_NS	1000000000ULL		// fdatasync Saved images this often
+#define PREFETCH_BLOCKS		4
+
+struct mpscQueue logQueue;						// any thread -> log worker
+struct spscQueue storageQueue;					// bus thread -> storage worker
+struct spscQueue statsQueue;					// bus thread -> stats worker
+struct spscQueue prefetchQueue;					// bus thread -> prefetch worker
+struct spscQueue cacheFillQueue;				// prefetch worker -> bus thread
+
+// PRU block cache: prefetch worker loads an entry, only bus thread publishes its tag,
+//  and only if no block was written since the load started
+unsigned char pruCache = 1;						// -C clears
+_Atomic unsigned int cacheWriteGen;				// bus thread bumps on every block write
+_Atomic unsigned char cachePending[CACHE_ENTRIES];	// loaded, tag not yet published
+unsigned int cacheFillTag[CACHE_ENTRIES];		// prefetch worker only
+unsigned int cacheNext;							// prefetch worker only, round robin
+unsigned int cacheLastHits, cacheFills, cacheFillsDropped;
+volatile unsigned char workersRunning, logRunning;	// log worker stops last
+pthread_t busThreadId;
+clockid_t busCpuClock;
+volatile unsigned char busCpuClockValid;
+
+#ifdef PRU_SIM
+// Benchmark build: no BeagleBone, PRU memory is an anonymous mapping and
+//  ControllerBench.c plays PRU1. Its options, see simUsage()
+#define SIM_OPTS			"N:R:LK:"
+volatile unsigned int busLoops;					// bus thread passes, simPru() waits for it to look
+pthread_t simThreadId;
+unsigned char simStarted;
+#else
+#define SIM_OPTS			""
+#endif
+
+// Command path event log: bus thread writes fixed-size binary records into
+//  a ring in locked anonymous memory, so it never takes a page fault or
+//  waits on writeback. Log worker turns them into text and copies each one
+//  to the same slot of an mmapped file. Ring never blocks, oldest records
+//  are overwritten, so after a crash the file holds the last EVENT_RECS
+//  events the log worker got to. Dump with -E.
+#define EVENT_RECS			16384				// power of 2
+#define EVENT_MAGIC			"SPEVLOG1"
+struct eventRec
+{
+	unsigned long long ns;						// CLOCK_MONOTONIC
+	_Atomic unsigned int seq;					// ring position + 1 once written, 0 while writing
+	unsigned int block;
+	unsigned int arg;
+	unsigned short code;
+	unsigned char device;						// bus ID
+	unsigned char status;
+};
+struct eventLogHeader
+{
+	char magic[8];
+	unsigned int recSize, numRecs;
+	unsigned long long startNs, startRealNs;	// CLOCK_MONOTONIC and CLOCK_REALTIME at open
+	_Alignas(64) _Atomic unsigned int head;		// next position to claim
+	_Atomic unsigned int dropped;				// overwritten before log worker formatted them
+};
+
+enum eventCodes {eEV_NONE, eEV_ERROR1, eEV_ERROR2, eEV_ERROR3, eEV_ERROR_UNKNOWN, eEV_ID_CHANGE, eEV_RESET,
+	eEV_DATA_WRITTEN, eEV_BAD_DATA_CS, eEV_STATUS, eEV_UNSUP_STATCODE, eEV_READBLK, eEV_EXTREADBLK,
+	eEV_BAD_READ_BLK, eEV_WRITEBLK, eEV_EXTWRITEBLK, eEV_BAD_WRITE_BLK, eEV_CONTROL, eEV_UNEXPECTED_CMD,
+	eEV_WRONG_DEST, eEV_UNEXPECTED_STATUS, eEV_BAD_CMD_CS, eEV_PACKET_BYTES, eEV_PACKET_END,
+	eEV_CACHE_HIT, eEV_PRU_STATUS, eEV_WRITE_DATA, eEV_DDR_READ, eEV_TX_UNDERRUN, eNUM_EVENTS};
+struct eventType
+{
+	const char *name;
+	unsigned char console;						// 0 = only kept in the file
+};
+const struct eventType eventTypes[eNUM_EVENTS] =
+{
+	{"none",			0},
+	{"ERROR1",			1},
+	{"ERROR2",			1},
+	{"ERROR3",			1},
+	{"ERROR?",			1},
+	{"idChange",		1},
+	{"reset",			1},
+	{"dataWritten",		0},
+	{"badDataCS",		1},
+	{"status",			0},
+	{"badStatCode",		1},
+	{"readBlk",			0},
+	{"extReadBlk",		1},
+	{"badReadBlk",		1},
+	{"writeBlk",		0},
+	{"extWriteBlk",		1},
+	{"badWriteBlk",		1},
+	{"control",			1},
+	{"badCmd",			1},
+	{"wrongDest",		1},
+	{"badPruStatus",	1},
+	{"badCmdCS",		1},
+	{"bytes",			1},
+	{"bytesEnd",		1},
+	{"cacheHit",		0},
+	{"pruStatus",		0},
+	{"writeData",		0},
+	{"ddrRead",			0},
+	{"txUnderrun",		1}
+};
+
+const char *eventLogPath = "SmartPortEvents.bin";	// -e
+struct eventLogHeader *eventLog;				// ring, bus thread writes
+struct eventRec *eventRecs;
+struct eventLogHeader *eventFile;				// file copy, log worker only
+struct eventRec *eventFileRecs;
+size_t eventLogLen;
+unsigned int eventTail;							// next position log worker formats
+
+// Packet trace: bus thread appends a record per packet it answered, wire
+//  bytes both ways, to a ring in locked anonymous memory. Written after
+//  GO/SKIP, so it is off the A2's clock, and never faults or waits on the
+//  file. Log worker copies records to an mmapped file and rotates it when
+//  full, keeping TRACE_FILES. Ring full: record dropped and counted.
+//  Packets the PRU answers itself (STATUS and DIB without -S, cached
+//  READBLKs without -C, WRITEBLK commands without -W) never reach us and
+//  aren't in it. Dump with -D, pick records with -F.
+#define TRACE_FILE_LEN		(4*1024*1024)
+#define TRACE_FILES			4					// file, .1, .2, .3
+#define TRACE_RING_LEN		(1024*1024)			// power of 2
+#define TRACE_MAGIC			"SPTRACE1"
+#define TRACE_MAX_WIRE		640					// longest packet kept, data packet is 603
+#define TRACE_STAT_MAX		64					// longest reply looked at for end marker
+#define TR_RX_BAD_CS		0x01				// record flags
+#define TR_TX_DATA			0x02				// tx bytes are the raw block, not wire bytes
+#define TR_TRUNCATED		0x04
+#define TR_ERROR1			0x08				// not a packet, rx bytes as PRU stored them
+#define TR_RING_SKIP		0x80				// ring only: rest of ring unused, go to start
+struct traceRec
+{
+	unsigned long long ns;						// eRCVDPACK seen, CLOCK_MONOTONIC
+	unsigned int turnNs;						// eRCVDPACK seen to GO/SKIP written
+	unsigned int block;							// READBLK, WRITEBLK and data packets
+	unsigned short len;							// whole record, multiple of 8
+	unsigned short rxLen, txLen;				// bytes after record, rx first
+	unsigned char dest, type, cmd, wait;		// wait: WAIT_GO, ...
+	unsigned char flags, pad[5];
+};
+struct traceHeader
+{
+	char magic[8];
+	unsigned int fileLen, recSize;
+	unsigned long long startNs, startRealNs;	// CLOCK_MONOTONIC and CLOCK_REALTIME at map
+	unsigned int seq;							// file number this run
+	unsigned int dropped;						// records lost this run before this file
+	_Alignas(64) _Atomic unsigned int used;		// record bytes published after header
+	unsigned int records;
+};
+
+const char *tracePath = "SmartPortTrace.bin";	// -P, - = off
+unsigned char *traceRing;
+_Atomic unsigned int traceHead, traceTail;		// ring bytes written by bus thread, copied by log worker
+_Atomic unsigned int traceDropped;
+struct traceHeader *trace;						// file, log worker only
+unsigned int traceSeq;							// log worker only
+_Atomic unsigned int traceRecords;				// this run, all files
+const char *traceDumpPath;						// -D
+const char *traceFilter = "";					// -F
+unsigned long long rcvdNs, releaseNs;			// eRCVDPACK seen, last GO/SKIP written
+unsigned char releaseWait;
+
+// Per-command latency by unit and command, eRCVDPACK seen to GO/SKIP written,
+//  for the packets the Controller answers. PRU-answered packets (STATUS and
+//  DIB without -S, cached READBLKs without -C, WRITEBLKs without -W) have
+//  no eRCVDPACK, their series stay empty; smartport_pru_packets_total counts
+//  everything. Stats worker owns the histograms and with -M formats them and
+//  the error counts as Prometheus text when the metrics thread asks, the
+//  metrics thread does the socket I/O: -M path is a Unix socket,
+//  -M [addr:]port is HTTP on 127.0.0.1 or addr
+#define CMD_UNITS			3					// device 1, device 2, not ours
+#define METRICS_IO_MS		200					// slow scraper is dropped, only metrics thread waits
+#define METRICS_LEN			(128*1024)
+enum cmdKinds {eCK_STATUS, eCK_DIB, eCK_READBLK, eCK_WRITEBLK, eCK_CONTROL,
+	eCK_XSTATUS, eCK_XDIB, eCK_XREADBLK, eCK_XWRITEBLK, eCK_XCONTROL, eCK_DATA, eCK_OTHER, eNUM_CK};
+const char *cmdKindNames[eNUM_CK] = {"STATUS", "DIB", "READBLK", "WRITEBLK", "CONTROL",
+	"XSTATUS", "XDIB", "XREADBLK", "XWRITEBLK", "XCONTROL", "data", "other"};
+const char *cmdUnitNames[CMD_UNITS] = {"1", "2", "none"};
+#define LE_BUCKETS			15
+const unsigned int leNs[LE_BUCKETS] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+	1000000, 2000000, 5000000, 10000000, 20000000, 50000000};
+struct latHist cmdHist[CMD_UNITS][eNUM_CK];		// stats worker only
+unsigned int cmdLe[CMD_UNITS][eNUM_CK][LE_BUCKETS];	// stats worker only, [i] = leNs[i-1] < value <= leNs[i]
+_Atomic unsigned int badCmdCs, badDataCs;		// bus thread counts, stats worker reads
+_Atomic unsigned int pruErrorCnt[eERROR_UNDERRUN + 1];
+const char *metricsSpec;						// -M
+int metricsFd = -1;
+unsigned char metricsHttp;
+char metricsBody[METRICS_LEN];					// stats worker writes when asked, metrics thread sends
+unsigned int metricsBodyLen;
+_Atomic unsigned int metricsAsked, metricsMade;	// text requests, metrics thread -> stats worker
+pthread_t metricsThreadId;
+unsigned char metricsStarted;
+
+// Real-time mode, opt in with -r
+#define STACK_PREFAULT		(64*1024)
+#define JITTER_INTERVAL_US	1000			// like cyclictest default
+unsigned int rtPriority	  = 0;				// -r, SCHED_FIFO priority, 0 = off
+int			 rtCpu		  = -1;				// -c, CPU to pin to, -1 = don't pin
+unsigned int jitterSecs	  = 0;				// -j, run jitter probe this long before starting
+struct latHist jitterHist;					// wake-up latency, ns
 
-	enum pruErrors {eNOERROR, eERROR1, eERROR2, eERROR3};
+//____________________
+int main(int argc, char *argv[])
+{
+	unsigned char *pru;		// start of PRU memory
+	void *images;
+	int	fd, opt, err;
+	pthread_attr_t busAttr;
+	sigset_t sigs;
 
-	enum cmdNums {eSTATUS=0x80, eREADBLK, eWRITEBLK, eFORMAT, eCONTROL, eINIT, eOPEN, eCLOSE, eREAD, eWRITE};
-	enum extCmdNums {eEXTSTATUS=0xC0, eEXTREADBLK, eEXTWRITEBLK, eEXTFORMAT, eEXTCONTROL, eEXTINIT, eEXTOPEN, eEXTCLOSE, eEXTREAD, eEXTWRITE};
+	while ((opt = getopt(argc, argv, "s:b:p:r:c:j:e:E:P:D:F:M:w:a:t:m:HCSWTh" SIM_OPTS)) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				spinWindowUs = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				backoffMaxUs = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				parkUs = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				rtPriority = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				rtCpu = strtol(optarg, NULL, 0);
+				break;
+			case 'j':
+				jitterSecs = strtoul(optarg, NULL, 0);
+				break;
+			case 'e':
+				eventLogPath = optarg;
+				break;
+			case 'w':
+				rxCellNs = strtoul(optarg, NULL, 0);
+				break;
+			case 'a':
+				calMode = strtoul(optarg, NULL, 0) & (CAL_ADAPT_RX | CAL_TRIM_TX);
+				break;
+			case 't':
+				sscanf(optarg, "%u,%u,%u", &txCellNs, &txLowNs, &txGapNs);
+				break;
+			case 'm':
+				ddrAddr = strtoul(optarg, NULL, 0);
+				break;
+			case 'H':
+				pruEncode = 0;
+				break;
+			case 'C':
+				pruCache = 0;
+				break;
+			case 'S':
+				pruReplies = 0;
+				break;
+			case 'W':
+				pruWriteCmds = 0;
+				break;
+			case 'T':
+				pruStream = 1;
+				break;
+			case 'E':
+				return dumpEventLog(optarg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+			case 'P':
+				tracePath = optarg;
+				break;
+			case 'D':
+				traceDumpPath = optarg;
+				break;
+			case 'F':
+				traceFilter = optarg;
+				break;
+			case 'M':
+				metricsSpec = optarg;
+				break;
+			default:
+#ifdef PRU_SIM
+				if (simOption(opt, optarg) == 0)
+					break;
+#endif
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
 
-	unsigned char *pru;		// start of PRU memory
-	int	fd;
+	if (traceDumpPath != NULL)
+		return dumpTrace(traceDumpPath, traceFilter) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
+#ifdef PRU_SIM
+	if ((err = simBefore()) != -1)						// -K, or -R trace won't map
+		return err;
+	ddrAddr = 0;										// simPru() doesn't read images
+	fd = -1;
+	pru = mmap(0, PRU_LEN, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#else
 	fd = open("/dev/mem", O_RDWR | O_SYNC);
 	if (fd == -1)
 	{
@@ -123,12 +831,26 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 	pru = mmap(0, PRU_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PRU_ADDR);
+#endif
 	if (pru == MAP_FAILED)
 	{
 		printf("*** ERROR: could not map memory.\n");
 		return EXIT_FAILURE;
 	}
-	close(fd);
+
+	// Disk images: physically contiguous carve-out PRU can read, or ordinary memory
+	if (ddrAddr != 0)
+		images = mmap(0, IMAGES_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, ddrAddr);
+	else
+		images = mmap(0, IMAGES_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (images == MAP_FAILED)
+	{
+		printf("*** ERROR: could not map disk images at 0x%lX: %s\n", ddrAddr, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	theImages = images;
+	if (fd != -1)
+		close(fd);
 
 	// Set memory pointers
 	pru1RAMptr 		= pru + PRU1_DRAM;
@@ -138,6 +860,16 @@ int main(int argc, char *argv[])
 	busID2ptr		= pru1RAMptr + BUS_ID_2_ADR;
 	pruWaitPtr		= pru1RAMptr + WAIT_ADR;
 	pruErrorPtr		= pru1RAMptr + ERROR_ADR;
+	statReadyPtr	= pru1RAMptr + STAT_READY_ADR;
+	pruDoorbellPtr	= (unsigned int *) (pru + PRU_INTC + INTC_SRSR0);
+
+	goStartPtr		= (unsigned int *) (pru1RAMptr + GO_START_ADR);
+	goFirstBitPtr	= (unsigned int *) (pru1RAMptr + GO_FIRSTBIT_ADR);
+	hostWaitPtr		= (unsigned int *) (pru1RAMptr + HOST_WAIT_ADR);
+	timingSeqPtr	= (unsigned int *) (pru1RAMptr + TIMING_SEQ_ADR);
+	rxLimitsPtr		= (unsigned int *) (pru1RAMptr + RX_LIMITS_ADR);
+	sharedMemPtr	= (unsigned int *) (pru + PRU_SHAREDMEM);
+	cacheDataPtr	= pru + PRU_SHAREDMEM + CACHE_DATA;
 
 	rcvdPacketPtr		= pru1RAMptr + RCVD_PACKET_ADR;
 	rcvdPacketBeginPtr	= pru1RAMptr + RCVD_PBEGIN_ADR;
@@ -148,31 +880,170 @@ int main(int argc, char *argv[])
 	respPacketPtr	= pru1RAMptr + RESP_PACKET_ADR;
 	initResp1Ptr	= pru1RAMptr + INIT_RESP_1_ADR;
 	initResp2Ptr	= pru1RAMptr + INIT_RESP_2_ADR;
-
+	rxDataPtr		= pru1RAMptr + RX_DATA_ADR;
+	rxInfoPtr		= pru1RAMptr + RX_INFO_ADR;
+	writeDescPtr	= pru1RAMptr + WRITE_DESC_ADR;
+	txRawPtr		= pru1RAMptr + TX_RAW_ADR;
+
+	*(volatile unsigned int *) (pru1RAMptr + DDR_BASE_ADR) = 0;
+#ifdef PRU_SIM
+	sharedMemPtr[CACHE_BUSY_OFS] = CACHE_NONE;			// as InitCache() leaves it, or cacheFill() waits on entry 0
+	if (simImages() != 0)
+		return EXIT_FAILURE;
+#else
 	loadDiskImages(diskImages[0], diskImages[1]);		// load both images
-	diskImage1Changed = 0;
-	diskImage2Changed = 0;
+#endif
+	if (ddrAddr != 0)
+	{
+		// PRU may serve READBLKs from now on, we still do every write
+		*(volatile unsigned int *) (pru1RAMptr + DDR_BLOCKS_ADR) = NUM_BLOCKS;
+		ddrLastReads = sharedMemPtr[DDR_READS_OFS];
+		__sync_synchronize();
+		*(volatile unsigned int *) (pru1RAMptr + DDR_BASE_ADR) = ddrAddr;
+	}
+	openEventLog(eventLogPath);
+	openTrace(tracePath);
+	if (openMetrics(metricsSpec) != 0)
+		return EXIT_FAILURE;
+
+	pthread_attr_init(&busAttr);
+	if (rtPriority != 0)
+	{
+		if (enterRealTime(pru, &busAttr) != 0)
+			return EXIT_FAILURE;
+	}
 
 	(void) signal(SIGINT,  myShutdown);					// ^c = graceful shutdown
 	(void) signal(SIGTSTP, myDebug);					// ^z
 
-	lastPruStatus = eUNKNOWN;
 	spID1 = 0xFF;										// we are not inited yet
 	spID2 = 0xFF;
+	lastTimingSeq = *timingSeqPtr;
+	running = 1;
+
+	encodeInitReplyPackets();							// put two Init reply packets in PRU ram
+	primeStatusTemplates();								// and STATUS, DIB replies
+	setRxWindows(rxCellNs);
+	cacheInvalidateAll();
+	writeDescPtr[WRITE_DESC_VALID] = 0;
+	*(pru1RAMptr + WRITE_ON_ADR) = pruWriteCmds;
+	*(pru1RAMptr + CAL_MODE_ADR) = calMode;
+	setTxTiming(txCellNs, txLowNs, txGapNs);
+
+	printf("\n--- SmartPortIF running\n");
+	printf("\tspin %u us, backoff <= %u us, park %u us\n", spinWindowUs, backoffMaxUs, parkUs);
+
+	// Only main thread takes signals, bus thread and workers inherit this mask
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTSTP);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	startWorkers();
+	if ((metricsFd != -1) && (pthread_create(&metricsThreadId, NULL, metricsThread, NULL) == 0))
+		metricsStarted = 1;
+	err = pthread_create(&busThreadId, &busAttr, busThread, NULL);
+	if (err != 0)
+	{
+		printf("*** ERROR: could not start bus thread: %s\n", strerror(err));
+		running = 0;
+		closeMetrics();
+		stopWorkers();
+		return EXIT_FAILURE;
+	}
+	pthread_getcpuclockid(busThreadId, &busCpuClock);
+	busCpuClockValid = 1;
+#ifdef PRU_SIM
+	if (pthread_create(&simThreadId, NULL, simPru, NULL) == 0)
+		simStarted = 1;
+	else
+	{
+		printf("*** ERROR: could not start PRU simulator\n");
+		running = 0;
+	}
+#endif
+
+	pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+	while (running)
+		usleep(100000);
+
+	pthread_join(busThreadId, NULL);
+#ifdef PRU_SIM
+	if (simStarted)
+		pthread_join(simThreadId, NULL);
+#endif
+	*(volatile unsigned int *) (pru1RAMptr + DDR_BASE_ADR) = 0;	// images go away with us
+	closeMetrics();										// before stats worker, it may be making the text
+	stopWorkers();										// drains queues, flushes Saved images
+
+	printTimingStats();
+	printRxStats();
+	printCalStats();
+	printCacheStats();
+	printPruCmdStats();
+	printPollStats();
+	printCmdStats();
+	printQueueStats();
+	closeEventLog();
+	closeTrace();
+	printf ("\n---Shutting down...\n");
+
+	if(munmap(pru, PRU_LEN))
+		printf("*** ERROR: munmap failed at Shutdown\n");
+
+#ifdef PRU_SIM
+	return simAfter();									// fails on wrong or missing replies, for scripts
+#else
+	return EXIT_SUCCESS;
+#endif
+}
+
+//____________________
+void *busThread(void *arg)
+{
+	// Services PRU handshake and packet encode/decode only
+	// Anything slow goes to a worker through a lock-free queue
+	unsigned char destID, destDevice, type, cmdNum, statCode, id, waitCode, pruCmd, dataReply;
+	unsigned char msbs, blkNumLow, blkNumMid, blkNumHi;
+	unsigned int resetCnt, loopCnt, blkNum, readCnt1, writeCnt1, readCnt2, writeCnt2;
+	struct storageOp storageOp;
+	struct prefetchOp prefetchOp;
+
+	enum pruStatuses pruStatus, lastPruStatus;
+
+	enum cmdNums {eSTATUS=0x80, eREADBLK, eWRITEBLK, eFORMAT, eCONTROL, eINIT, eOPEN, eCLOSE, eREAD, eWRITE};
+	enum extCmdNums {eEXTSTATUS=0xC0, eEXTREADBLK, eEXTWRITEBLK, eEXTFORMAT, eEXTCONTROL, eEXTINIT, eEXTOPEN, eEXTCLOSE, eEXTREAD, eEXTWRITE};
+
+	(void) arg;
+	if (rtPriority != 0)
+		prefaultStack();
+	if (jitterSecs != 0)
+		jitterProbe(jitterSecs);
+
+	lastPruStatus = eUNKNOWN;
 	resetCnt = 0;
 	readCnt1 = 0;
 	readCnt2 = 0;
 	writeCnt1 = 0;
 	writeCnt2 = 0;
+	blkNum = 0;
+	destDevice = 0;
 	loopCnt = 0;										// do something every n times around the loop
-	running = 1;
-
-	encodeInitReplyPackets();							// put two Init reply packets in PRU ram
+	pollMode = ePARK;
+	backoffUs = BACKOFF_MIN_US;
+	modeStartNs = nowNs();
 
-	printf("\n--- SmartPortIF running\n");
+	logMsg("\n");
 	do
 	{
-		usleep(40);		// was 100, then 20
+#ifdef PRU_SIM
+		busLoops++;
+#endif
+		pollWait(lastPruStatus);
+		if (pruCache)
+			cacheService();
+		pruCmdService();
 
 		switch(*pruErrorPtr)
 		{
@@ -180,29 +1051,33 @@ int main(int argc, char *argv[])
 				break;
 
 			case eERROR1:
-				printf("*** ERROR1 detected:\n");
+				atomic_fetch_add_explicit(&pruErrorCnt[eERROR1], 1, memory_order_relaxed);
+				logEvent(eEV_ERROR1, 0, 0, 0, 0);
 				printRcvdPacket();
+				tracePacket(*rcvdPacketDestPtr, *rcvdPacketTypePtr, *rcvdPacketCmdPtr, 0, 0, 0, TR_ERROR1);
 				*pruErrorPtr = eNOERROR;
 				break;
 
 			case eERROR2:
-				printf("*** ERROR2 detcted:\n");
-				printf("\tMy IDs: 0x%X\t0x%X\n", *busID1ptr, *busID2ptr);
-				printf("\tDEST = 0x%X\n", *rcvdPacketDestPtr);
-				printf("\tCMD  = 0x%X\n", *rcvdPacketCmdPtr);
+				atomic_fetch_add_explicit(&pruErrorCnt[eERROR2], 1, memory_order_relaxed);
+				logEvent(eEV_ERROR2, *rcvdPacketDestPtr, 0, *rcvdPacketCmdPtr, (*busID1ptr << 8) | *busID2ptr);
 				*pruErrorPtr = eNOERROR;
 				break;
 
 			case eERROR3:
-				printf("*** ERROR3 detected\n");
-				printf("\tMy IDs: 0x%X\t0x%X\n", *busID1ptr, *busID2ptr);
-				printf("\tDEST = 0x%X\n", *rcvdPacketDestPtr);
-				printf("\tCMD  = 0x%X\n", *rcvdPacketCmdPtr);
+				atomic_fetch_add_explicit(&pruErrorCnt[eERROR3], 1, memory_order_relaxed);
+				logEvent(eEV_ERROR3, *rcvdPacketDestPtr, 0, *rcvdPacketCmdPtr, (*busID1ptr << 8) | *busID2ptr);
+				*pruErrorPtr = eNOERROR;
+				break;
+
+			case eERROR_UNDERRUN:
+				atomic_fetch_add_explicit(&pruErrorCnt[eERROR_UNDERRUN], 1, memory_order_relaxed);
+				logEvent(eEV_TX_UNDERRUN, *rcvdPacketDestPtr, 0, 0, sharedMemPtr[TX_UNDERRUNS_OFS]);
 				*pruErrorPtr = eNOERROR;
 				break;
 
 			default:
-				printf("*** Unknown ERROR\n");
+				logEvent(eEV_ERROR_UNKNOWN, 0, 0, *pruErrorPtr, 0);
 		}
 
 		pruStatus = *pruStatusPtr;
@@ -217,13 +1092,13 @@ int main(int argc, char *argv[])
 					if (id != spID1)
 					{
 						spID1 = id;
-						printf("\tspID1 changed to 0x%X\n", spID1);
+						logEvent(eEV_ID_CHANGE, spID1, 0, 1, 0);
 					}
 					id = *busID2ptr;
 					if (id != spID2)
 					{
 						spID2 = id;
-						printf("\tspID2 changed to 0x%X\n", spID2);
+						logEvent(eEV_ID_CHANGE, spID2, 0, 2, 0);
 					}
 					lastPruStatus = pruStatus;
 				}
@@ -233,10 +1108,10 @@ int main(int argc, char *argv[])
 			{
 				if (pruStatus != lastPruStatus)
 				{
-					printf("--- Reset %d \n", resetCnt);
 					spID1 = *busID1ptr;
 					spID2 = *busID2ptr;
-					printf("\tspID1=0x%X spID2=0x%X\n", spID1, spID2);
+					logEvent(eEV_RESET, 0, 0, 0, (resetCnt << 16) | (spID1 << 8) | spID2);
+					cacheInvalidateAll();						// tags hold old bus IDs
 
 					readCnt1 = 0;
 					writeCnt1 = 0;
@@ -256,13 +1131,13 @@ int main(int argc, char *argv[])
 					if (id != spID1)
 					{
 						spID1 = id;
-						printf("\tspID1 changed to 0x%X\n", spID1);
+						logEvent(eEV_ID_CHANGE, spID1, 0, 1, 0);
 					}
 					id = *busID2ptr;
 					if (id != spID2)
 					{
 						spID2 = id;
-						printf("\tspID2 changed to 0x%X\n", spID2);
+						logEvent(eEV_ID_CHANGE, spID2, 0, 2, 0);
 					}
 					lastPruStatus = pruStatus;
 				}
@@ -273,6 +1148,10 @@ int main(int argc, char *argv[])
 				if (pruStatus != lastPruStatus)
 				{
 //					printf("Received packet\n");
+					lastTrafficNs = nowNs();
+					rcvdNs = lastTrafficNs;
+					rcvdPollMode = pollMode;
+					dataReply = 0;
 
 					destID = *rcvdPacketDestPtr;			// with msb = 1
 					type   = *rcvdPacketTypePtr;			// 0x80=Cmd, 0x81=Status, 0x82=Data
@@ -291,29 +1170,62 @@ int main(int argc, char *argv[])
 
 						if (type == 0x82)				// data packet
 						{
-							// blkNum was set previously by WriteBlock command so
-							//  decode to tempBuffer[] and check status
-							if (decodeDataPacket() == 0)						// checksum ok
+							// blkNum was set previously by WriteBlock command,
+							//  ours or the one PRU took
+							// PRU already decoded it and checked checksum
+							pruCmd = 0;
+							if (writeDescPtr[WRITE_DESC_VALID] && (writeDescPtr[WRITE_DESC_ID] == destID))
 							{
-//								printf("[0x%X] CS GOOD\n", destID);
-								for (i=0; i<512; i++)
-									theImages[destDevice][blkNum][i] = tempBuffer[i];
+								pruCmd = writeDescPtr[WRITE_DESC_CMD];
+								blkNum = *(volatile unsigned int *) (writeDescPtr + WRITE_DESC_BLOCK);
+								if (destID == spID1)
+									writeCnt1++;
+								else
+									writeCnt2++;
+								pruWrites++;
+							}
+							writeDescPtr[WRITE_DESC_VALID] = 0;
 
-								if (destDevice == 0)
-									diskImage1Changed = 1;
+							if (blkNum >= NUM_BLOCKS)
+							{
+								if (pruCmd)
+									logEvent(eEV_BAD_WRITE_BLK, destID, blkNum, 0, 0);
+								encodeStdStatusReplyPacket(respPacketPtr, destID, 0x06);		// 0x06 = bus error
+							}
+							else if (checkDataPacket() == 0)				// checksum ok
+							{
+								if (pruCmd)
+									logEvent(eEV_WRITE_DATA, destID, blkNum, pruCmd, 0);
+								else
+									logEvent(eEV_DATA_WRITTEN, destID, blkNum, 0, 0);
+								if (pruStream)
+									streamRxData();					// last chunk, rest already here
+								// rxStream only if it is this packet: PRU's cursor at the
+								//  end and every byte up to it copied since eRCVDPACK
+								if (pruStream && (rxStreamLen == RX_DATA_LEN) &&
+									(*(volatile unsigned int *) (rxInfoPtr + RX_INFO_CURSOR) == RX_DATA_ADR + RX_DATA_LEN))
+									memcpy(theImages[destDevice][blkNum], rxStream, RX_DATA_LEN);
 								else
-									diskImage2Changed = 1;
+									memcpy(theImages[destDevice][blkNum], rxDataPtr, RX_DATA_LEN);
+								atomic_fetch_add_explicit(&cacheWriteGen, 1, memory_order_release);
+								cacheInvalidate(destID, blkNum);				// before GO, A2 may read it next
 
-								encodeStdStatusReplyPacket(destID, 0x00);		// 0x00 = no error
+								storageOp.ns = nowNs();				// worker writes it to Saved image
+								storageOp.device = destDevice;
+								storageOp.block = blkNum;
+								spscPush(&storageQueue, &storageOp);
+
+								encodeStdStatusReplyPacket(respPacketPtr, destID, 0x00);		// 0x00 = no error
 							}
 							else
 							{
-								printf("*** [0x%X] Bad checksum in received datablock %d\n", destID, blkNum);
-								encodeStdStatusReplyPacket(destID, 0x06);		// 0x06 = bus error
+								atomic_fetch_add_explicit(&badDataCs, 1, memory_order_relaxed);
+								logEvent(eEV_BAD_DATA_CS, destID, blkNum, 0, 0);
+								encodeStdStatusReplyPacket(respPacketPtr, destID, 0x06);		// 0x06 = bus error
 
 								debugDataPacket();
 							}
-							*pruWaitPtr = WAIT_GO;
+							releasePru(WAIT_GO);
 						}
 						else							// command packet
 						{
@@ -324,20 +1236,20 @@ int main(int argc, char *argv[])
 								case eEXTSTATUS:
 								{
 									statCode = *(rcvdPacketPtr + 20) & 0x7F;
-//									printf("[0x%X] Std Status: %d\n", destID, statCode);
+									logEvent(eEV_STATUS, destID, 0, statCode, cmdNum);
 
 									if (statCode == 0x00)
-										encodeStdStatusReplyPacket(destID, 0x00);	// 0x00 = no error
+										encodeStdStatusReplyPacket(respPacketPtr, destID, 0x00);	// 0x00 = no error
 
 									else if (statCode == 0x03)
-										encodeStdDibStatusReplyPacket(destID, 0x00);	// 0x00 = no error
+										encodeStdDibStatusReplyPacket(respPacketPtr, destID, 0x00, destDevice);	// 0x00 = no error
 
 									else
 									{
-										printf("*** [0x%X] Unsupported statCode: 0x%X\n", destID, statCode);
-										encodeStdStatusReplyPacket(destID, 0x21);	// 0x21 = not supported
+										logEvent(eEV_UNSUP_STATCODE, destID, 0, statCode, 0);
+										encodeStdStatusReplyPacket(respPacketPtr, destID, 0x21);	// 0x21 = not supported
 									}
-									*pruWaitPtr = WAIT_GO;
+									releasePru(WAIT_GO);
 									break;
 								}
 
@@ -356,7 +1268,7 @@ int main(int argc, char *argv[])
 										blkNumMid = (*(rcvdPacketPtr + 21) & 0x7F) | ((msbs << 4) & 0x80);
 										blkNumHi  = (*(rcvdPacketPtr + 22) & 0x7F) | ((msbs << 5) & 0x80);
 										blkNum = blkNumLow + 256*blkNumMid + 65536*blkNumHi;
-//										printf("[0x%X] RB: %d\n", destID, blkNum);
+										logEvent(eEV_READBLK, destID, blkNum, 0, 0);
 									}
 									else
 									{
@@ -364,18 +1276,40 @@ int main(int argc, char *argv[])
 										blkNumMid = (*(rcvdPacketPtr + 20) & 0x7F) | ((msbs << 3) & 0x80);
 										blkNumHi  = (*(rcvdPacketPtr + 21) & 0x7F) | ((msbs << 4) & 0x80);
 										blkNum = blkNumLow + 256*blkNumMid + 65536*blkNumHi;
-										printf("[0x%X] ExtRB: %d\n", destID, blkNum);
+										logEvent(eEV_EXTREADBLK, destID, blkNum, 0, 0);
 									}
 
+									waitCode = WAIT_GO;
 									if (blkNum < NUM_BLOCKS)
-										encodeDataPacket(destID, 0x00, destDevice, blkNum);	// 0x00 = no error
+									{
+										if (pruStream)
+										{
+											encodeDataPacket(respPacketPtr, theImages[destDevice][blkNum], destID, 0x00, 1);	// releases PRU
+											waitCode = WAIT_SET;
+										}
+										else if (pruEncode)
+										{
+											stageDataBlock(destID, 0x00, destDevice, blkNum);	// PRU encodes
+											waitCode = WAIT_GO_BLOCK;
+										}
+										else
+											encodeDataPacket(respPacketPtr, theImages[destDevice][blkNum], destID, 0x00, 0);	// 0x00 = no error
+
+										dataReply = 1;
+										prefetchOp.ns = nowNs();			// warm up blocks A2 likely wants next
+										prefetchOp.device = destDevice;
+										prefetchOp.busID = destID;
+										prefetchOp.block = blkNum;
+										spscPush(&prefetchQueue, &prefetchOp);
+									}
 									else
 									{
-										printf("*** [0x%X] Bad Read BlkNum: %d\n", destID, blkNum);
+										logEvent(eEV_BAD_READ_BLK, destID, blkNum, 0, 0);
 //										printRcvdPacket();
-										encodeStdStatusReplyPacket(destID, 0x06);		// 0x06 = bus error
+										encodeStdStatusReplyPacket(respPacketPtr, destID, 0x06);		// 0x06 = bus error
 									}
-									*pruWaitPtr = WAIT_GO;
+									if (waitCode != WAIT_SET)
+										releasePru(waitCode);
 									break;
 								}
 
@@ -394,7 +1328,7 @@ int main(int argc, char *argv[])
 										blkNumMid = (*(rcvdPacketPtr + 21) & 0x7F) | ((msbs << 4) & 0x80);
 										blkNumHi  = (*(rcvdPacketPtr + 22) & 0x7F) | ((msbs << 5) & 0x80);
 										blkNum = blkNumLow + 256*blkNumMid + 65536*blkNumHi;
-//										printf("[0x%X] WB: %d\n", destID, blkNum);
+										logEvent(eEV_WRITEBLK, destID, blkNum, 0, 0);
 									}
 									else
 									{
@@ -402,30 +1336,31 @@ int main(int argc, char *argv[])
 										blkNumMid = (*(rcvdPacketPtr + 20) & 0x7F) | ((msbs << 3) & 0x80);
 										blkNumHi  = (*(rcvdPacketPtr + 21) & 0x7F) | ((msbs << 4) & 0x80);
 										blkNum = blkNumLow + 256*blkNumMid + 65536*blkNumHi;
-										printf("[0x%X] ExtWB: %d\n", destID, blkNum);
+										logEvent(eEV_EXTWRITEBLK, destID, blkNum, 0, 0);
 									}
 									if (blkNum > NUM_BLOCKS)
-										printf("*** [0x%X] Bad Write BlkNum: %d\n", destID, blkNum);
+										logEvent(eEV_BAD_WRITE_BLK, destID, blkNum, 0, 0);
+									writeDescPtr[WRITE_DESC_VALID] = 0;		// ours, not one PRU took earlier
 
-									*pruWaitPtr = WAIT_SKIP;
+									releasePru(WAIT_SKIP);
 									break;
 								}
 
 								case eCONTROL:
 								{
 									statCode = *(rcvdPacketPtr + 11);
-									printf("[0x%X] Control: 0x%X\n", destID, statCode);
-									encodeStdStatusReplyPacket(destID, 0x21);		// 0x21 = not supported
-									*pruWaitPtr = WAIT_GO;
+									logEvent(eEV_CONTROL, destID, 0, statCode, 0);
+									encodeStdStatusReplyPacket(respPacketPtr, destID, 0x21);		// 0x21 = not supported
+									releasePru(WAIT_GO);
 									break;
 								}
 
 								default:
 								{
-									printf("*** [0x%X] Unexpected cmdNum= 0x%X\n", destID, cmdNum);
-									encodeStdStatusReplyPacket(destID, 0x21);		// 0x21 = not supported
+									logEvent(eEV_UNEXPECTED_CMD, destID, 0, cmdNum, 0);
+									encodeStdStatusReplyPacket(respPacketPtr, destID, 0x21);		// 0x21 = not supported
 									printRcvdPacket();
-									*pruWaitPtr = WAIT_GO;
+									releasePru(WAIT_GO);
 								}
 							}
 						}
@@ -433,10 +1368,13 @@ int main(int argc, char *argv[])
 					else
 					{
 						// A bus ID that is not ours - this should never happen
-						printf("*** destID [0x%X] != spID1 [0x%X] or spID2 [0x%X]\n", destID, spID1, spID2);
+						logEvent(eEV_WRONG_DEST, destID, 0, 0, (spID1 << 8) | spID2);
 //						printRcvdPacket();
-						*pruWaitPtr = WAIT_SKIP;
+						releasePru(WAIT_SKIP);
 					}
+					tracePacket(destID, type, cmdNum, blkNum, destDevice, dataReply, 0);
+					queueCmdSample(destID, type, cmdNum);
+					rxStreamLen = 0;						// next data packet starts clean, eWRITING may go unseen
 					lastPruStatus = eRCVDPACK;
 				}
 				break;
@@ -451,18 +1389,24 @@ int main(int argc, char *argv[])
 				break;
 			}
 			case eWRITING:
-			{
+			{	// PRU is receiving a data packet
 				if (pruStatus != lastPruStatus)
 				{
 //					printf("Writing...\n");
+					rxStreamLen = 0;
 					lastPruStatus = eWRITING;
 				}
+				if (pruStream)
+					streamRxData();
 				break;
 			}
 			default:
-				printf("*** Unexpected pruStatus: %d\n", pruStatus);
+				logEvent(eEV_UNEXPECTED_STATUS, 0, 0, pruStatus, 0);
 		}
 
+		if (*timingSeqPtr != lastTimingSeq)
+			queueTimingSample();
+
 		loopCnt++;
 		if (loopCnt == 600000)
 		{
@@ -471,46 +1415,14 @@ int main(int argc, char *argv[])
 		}
 	} while (running);
 
-    char *slash;
-    int slashIdx;
-	if (diskImage1Changed)
-	{
-		slash  = strchr(diskImages[0], '/');
-        slashIdx = (int)(slash - diskImages[0] + 1);    // 1 char past '/'
-
-        i = 0;
-        while((saveName[i] = diskImages[0][i+slashIdx]) != '\0')
-            i++;
-
-        printf("FYI - %s was modified. Saving to Saved folder.:\n", saveName);
-		saveDiskImage(0, saveName);
-	}
-
-	if (diskImage2Changed)
-	{
-        slash = strchr(diskImages[1], '/');
-        slashIdx = (int)(slash - diskImages[1] + 1);
-
-        i = 0;
-        while((saveName[i] = diskImages[1][i+slashIdx]) != '\0')
-            i++;
-
-		printf("FYI - %s was modified. Saving to Saved folder\n", saveName);
-		saveDiskImage(1, saveName);
-	}
-
-	printf ("\n---Shutting down...\n");
-
-	if(munmap(pru, PRU_LEN))
-		printf("*** ERROR: munmap failed at Shutdown\n");
-
-	return EXIT_SUCCESS;
+	return NULL;
 }
 
 //____________________
 void myShutdown(int sig)
 {
 	// ctrl-c
+	(void) sig;
 	printf("\n");
 	running = 0;
 	(void) signal(SIGINT, SIG_DFL);		// reset signal handling of SIGINT
@@ -522,9 +1434,19 @@ void myDebug(int sig)
 	// ctrl-z
 	unsigned int i;
 
+	(void) sig;
 	printf("\n");
 	for (i=0; i<32; i++)
 		printf("%d\t0x%X\n", i, *(rcvdPacketPtr + i));
+
+	printTimingStats();
+	printRxStats();
+	printCalStats();
+	printCacheStats();
+	printPruCmdStats();
+	printPollStats();
+	printCmdStats();
+	printQueueStats();
 }
 
 //____________________
@@ -607,11 +1529,13 @@ void loadDiskImages(const char *image1, const char *image2)
 }
 
 //____________________
-void saveDiskImage(unsigned char image, const char *fileName)
+int saveDiskImage(unsigned char image, const char *fileName)
 {
 	// Always save in .po format to /Saved directory
+	// Returns fd of saved file for block updates, -1 on failure
 	char imagePath[128];
 	unsigned int i, totalBlksSaved;
+	int savedFd;
 	FILE *fd;
 
 	sprintf(imagePath, "/root/DiskImages/Saved/%s", fileName);	// create image path
@@ -629,12 +1553,14 @@ void saveDiskImage(unsigned char image, const char *fileName)
 //		perror("Error printed by perror");
 		fprintf(stderr, "\tError opening file: %s\n", strerror(errnum));
 
-		printf("\n\tTrying to save as asdfghjkl.po\n");
-		fd = fopen("/root/DiskImages/Saved/asdfghjkl.po", "wb");
+		// One fallback per image, both stay open for block updates
+		sprintf(imagePath, "/root/DiskImages/Saved/asdfghjkl%u.po", image + 1);
+		printf("\n\tTrying to save as asdfghjkl%u.po\n", image + 1);
+		fd = fopen(imagePath, "wb");
 		if (fd == NULL)
 		{
 			printf("*** Problem opening. Giving up.\n");
-			return;
+			return -1;
 		}
 //		return;
 	}
@@ -646,49 +1572,67 @@ void saveDiskImage(unsigned char image, const char *fileName)
 //		fwrite(theImages[image][i], 1, 512, fd);
 		totalBlksSaved++;
 	}
+	fflush(fd);
+	savedFd = dup(fileno(fd));
 	fclose(fd);
 //	printf("(Total blocks saved= %d)\n", totalBlksSaved);
+	return savedFd;
+}
+
+//____________________
+void savedImageName(unsigned char image, char *saveName)
+{
+	// Name in Saved folder is image name without its folder
+	char *slash;
+	int i, slashIdx;
+
+	slash  = strchr(diskImages[image], '/');
+	slashIdx = (int)(slash - diskImages[image] + 1);	// 1 char past '/'
+
+	i = 0;
+	while((saveName[i] = diskImages[image][i+slashIdx]) != '\0')
+		i++;
 }
 
 //____________________
-void encodeStdStatusReplyPacket(unsigned char srcID, unsigned char dataStat)
+void encodeStdStatusReplyPacket(unsigned char *packet, unsigned char srcID, unsigned char dataStat)
 {
 	// Reply to init and standard status commands with Statcode = 0x00
 	// Assumes srcID has MSB set
 	unsigned char checksum = 0;
 	unsigned int i;
 
-	*(respPacketPtr     ) = 0xFF;				// sync bytes
-	*(respPacketPtr +  1) = 0x3F;
-	*(respPacketPtr +  2) = 0xCF;
-	*(respPacketPtr +  3) = 0xF3;
-	*(respPacketPtr +  4) = 0xFC;
-	*(respPacketPtr +  5) = 0xFF;
-
-	*(respPacketPtr +  6) = 0xC3;				// packet begin
-	*(respPacketPtr +  7) = 0x80;				// destination
-	*(respPacketPtr +  8) = srcID;				// source
-	*(respPacketPtr +  9) = 0x81;				// packet Type: 1 = status
-	*(respPacketPtr + 10) = 0x80;				// aux type: 0 = standard packet
-	*(respPacketPtr + 11) = dataStat | 0x80;	// data status
-	*(respPacketPtr + 12) = 0x84;				// odd byte count: 4
-	*(respPacketPtr + 13) = 0x80;				// groups-of-7 count: 0
+	*(packet     ) = 0xFF;				// sync bytes
+	*(packet +  1) = 0x3F;
+	*(packet +  2) = 0xCF;
+	*(packet +  3) = 0xF3;
+	*(packet +  4) = 0xFC;
+	*(packet +  5) = 0xFF;
+
+	*(packet +  6) = 0xC3;				// packet begin
+	*(packet +  7) = 0x80;				// destination
+	*(packet +  8) = srcID;				// source
+	*(packet +  9) = 0x81;				// packet Type: 1 = status
+	*(packet + 10) = 0x80;				// aux type: 0 = standard packet
+	*(packet + 11) = dataStat | 0x80;	// data status
+	*(packet + 12) = 0x84;				// odd byte count: 4
+	*(packet + 13) = 0x80;				// groups-of-7 count: 0
 
 	for (i=7; i<14; i++)
-		checksum ^= *(respPacketPtr+i);
+		checksum ^= *(packet+i);
 											// 32 MB - 0x010000 = 65536 blocks
-	*(respPacketPtr + 14) = 0xC0;			// odd MSBs: 100 0000
-	*(respPacketPtr + 15) = 0xF0;			// device status: 1111 1000, read/write
+	*(packet + 14) = 0xC0;			// odd MSBs: 100 0000
+	*(packet + 15) = 0xF0;			// device status: 1111 1000, read/write
 	checksum ^= 0xF0;
-	*(respPacketPtr + 16) = 0x80;			// block size low byte: 0x00
-	*(respPacketPtr + 17) = 0x80;			// block size mid byte: 0x00
-	*(respPacketPtr + 18) = 0x81;			// block size high byte: 0x01
+	*(packet + 16) = 0x80;			// block size low byte: 0x00
+	*(packet + 17) = 0x80;			// block size mid byte: 0x00
+	*(packet + 18) = 0x81;			// block size high byte: 0x01
 	checksum ^= 0x01;
 
-	*(respPacketPtr + 19) =  checksum	    | 0xAA;	// 1 C6 1 C4 1 C2 1 C0
-	*(respPacketPtr + 20) = (checksum >> 1) | 0xAA;	// 1 C7 1 C5 1 C3 1 C1
-	*(respPacketPtr + 21) = 0xC8;					// PEND
-	*(respPacketPtr + 22) = 0x00;					// end of packet marker in memory
+	*(packet + 19) =  checksum	    | 0xAA;	// 1 C6 1 C4 1 C2 1 C0
+	*(packet + 20) = (checksum >> 1) | 0xAA;	// 1 C7 1 C5 1 C3 1 C1
+	*(packet + 21) = 0xC8;					// PEND
+	*(packet + 22) = 0x00;					// end of packet marker in memory
 }
 
 //____________________
@@ -777,249 +1721,322 @@ void encodeInitReplyPackets(void)
 }
 
 //____________________
-void encodeStdDibStatusReplyPacket(unsigned char srcID, unsigned char dataStat)
+void encodeStdDibStatusReplyPacket(unsigned char *packet, unsigned char srcID, unsigned char dataStat, unsigned char device)
 {
 	// Reply to standard status commands with Statcode = 0x03
 	// Assumes srcID has MSB set
 	unsigned char checksum = 0;
 	unsigned int i;
 
-	*(respPacketPtr     ) = 0xFF;				// sync bytes
-	*(respPacketPtr +  1) = 0x3F;
-	*(respPacketPtr +  2) = 0xCF;
-	*(respPacketPtr +  3) = 0xF3;
-	*(respPacketPtr +  4) = 0xFC;
-	*(respPacketPtr +  5) = 0xFF;
-
-	*(respPacketPtr +  6) = 0xC3;				// packet begin
-	*(respPacketPtr +  7) = 0x80;				// destination
-	*(respPacketPtr +  8) = srcID;				// source
-	*(respPacketPtr +  9) = 0x81;				// packet Type: 1 = status
-	*(respPacketPtr + 10) = 0x80;				// aux type: 0 = standard packet
-	*(respPacketPtr + 11) = dataStat | 0x80;	// data status
-	*(respPacketPtr + 12) = 0x84;				// odd byte count: 4
-	*(respPacketPtr + 13) = 0x83;				// groups-of-7 count: 3
+	*(packet     ) = 0xFF;				// sync bytes
+	*(packet +  1) = 0x3F;
+	*(packet +  2) = 0xCF;
+	*(packet +  3) = 0xF3;
+	*(packet +  4) = 0xFC;
+	*(packet +  5) = 0xFF;
+
+	*(packet +  6) = 0xC3;				// packet begin
+	*(packet +  7) = 0x80;				// destination
+	*(packet +  8) = srcID;				// source
+	*(packet +  9) = 0x81;				// packet Type: 1 = status
+	*(packet + 10) = 0x80;				// aux type: 0 = standard packet
+	*(packet + 11) = dataStat | 0x80;	// data status
+	*(packet + 12) = 0x84;				// odd byte count: 4
+	*(packet + 13) = 0x83;				// groups-of-7 count: 3
 
 	for (i=7; i<14; i++)
-		checksum ^= *(respPacketPtr+i);
+		checksum ^= *(packet+i);
 
-	if (srcID == spID1)
+	if (device == 0)
 	{
 													// 32 MB - 0x010000 = 65536 blocks
-		*(respPacketPtr + 14) = 0xC0;				// odd MSBs: 100 0000
-		*(respPacketPtr + 15) = 0xF0;				// device status: 1110 1000, read/write
+		*(packet + 14) = 0xC0;				// odd MSBs: 100 0000
+		*(packet + 15) = 0xF0;				// device status: 1110 1000, read/write
 		checksum ^= 0xF0;
-		*(respPacketPtr + 16) = 0x80;				// block size low byte: 0x00
-		*(respPacketPtr + 17) = 0x80;				// block size mid byte: 0x00
-		*(respPacketPtr + 18) = 0x81;				// block size high byte: 0x01
+		*(packet + 16) = 0x80;				// block size low byte: 0x00
+		*(packet + 17) = 0x80;				// block size mid byte: 0x00
+		*(packet + 18) = 0x81;				// block size high byte: 0x01
 		checksum ^= 0x01;
 
-		*(respPacketPtr + 19) = 0x80;				// GRP1 MSBs
-		*(respPacketPtr + 20) = 0x8B;				// ID string length, 11 chars
+		*(packet + 19) = 0x80;				// GRP1 MSBs
+		*(packet + 20) = 0x8B;				// ID string length, 11 chars
 		checksum ^= 0x0B;
-		*(respPacketPtr + 21) = 'B' | 0x80;			// ID string, 16 chars total
+		*(packet + 21) = 'B' | 0x80;			// ID string, 16 chars total
 		checksum ^= 'B';
-		*(respPacketPtr + 22) = 'e' | 0x80;
+		*(packet + 22) = 'e' | 0x80;
 		checksum ^= 'e';
-		*(respPacketPtr + 23) = 'a' | 0x80;
+		*(packet + 23) = 'a' | 0x80;
 		checksum ^= 'a';
-		*(respPacketPtr + 24) = 'g' | 0x80;
+		*(packet + 24) = 'g' | 0x80;
 		checksum ^= 'g';
-		*(respPacketPtr + 25) = 'l' | 0x80;
+		*(packet + 25) = 'l' | 0x80;
 		checksum ^= 'l';
-		*(respPacketPtr + 26) = 'e' | 0x80;
+		*(packet + 26) = 'e' | 0x80;
 		checksum ^= 'e';
 
-		*(respPacketPtr + 27) = 0x80;				// GRP2 MSBs
-		*(respPacketPtr + 28) = 'B' | 0x80;
+		*(packet + 27) = 0x80;				// GRP2 MSBs
+		*(packet + 28) = 'B' | 0x80;
 		checksum ^= 'B';
-		*(respPacketPtr + 29) = 'o' | 0x80;
+		*(packet + 29) = 'o' | 0x80;
 		checksum ^= 'o';
-		*(respPacketPtr + 30) = 'n' | 0x80;
+		*(packet + 30) = 'n' | 0x80;
 		checksum ^= 'n';
-		*(respPacketPtr + 31) = 'e' | 0x80;
+		*(packet + 31) = 'e' | 0x80;
 		checksum ^= 'e';
-		*(respPacketPtr + 32) = '1' | 0x80;
+		*(packet + 32) = '1' | 0x80;
 		checksum ^= '1';
-		*(respPacketPtr + 33) = ' ' | 0x80;
+		*(packet + 33) = ' ' | 0x80;
 		checksum ^= 0x20;
-		*(respPacketPtr + 34) = ' ' | 0x80;
+		*(packet + 34) = ' ' | 0x80;
 		checksum ^= 0x20;
 
 		// Pretending to be a non-removable hard disk
-		*(respPacketPtr + 35) = 0x80;				// GRP3 MSBs: 000 0000
-		*(respPacketPtr + 36) = ' ' | 0x80;
+		*(packet + 35) = 0x80;				// GRP3 MSBs: 000 0000
+		*(packet + 36) = ' ' | 0x80;
 		checksum ^= 0x20;
-		*(respPacketPtr + 37) = ' ' | 0x80;
+		*(packet + 37) = ' ' | 0x80;
 		checksum ^= 0x20;
-		*(respPacketPtr + 38) = ' ' | 0x80;
+		*(packet + 38) = ' ' | 0x80;
 		checksum ^= 0x20;
 
-		*(respPacketPtr + 39) = 0x82;				// device type: 0x02 = Hard disk
+		*(packet + 39) = 0x82;				// device type: 0x02 = Hard disk
 		checksum ^= 0x02;
-		*(respPacketPtr + 40) = 0xA0;				// device subtype: 0x20 = not removable
+		*(packet + 40) = 0xA0;				// device subtype: 0x20 = not removable
 		checksum ^= 0x20;
 
-		*(respPacketPtr + 41) = 0x82;				// firmware version, 2 bytes
+		*(packet + 41) = 0x82;				// firmware version, 2 bytes
 		checksum ^= 0x02;
-		*(respPacketPtr + 42) = 0x80;
+		*(packet + 42) = 0x80;
 	}
 	else
 	{
 													// 32 MB - 0x010000 = 65536 blocks
-		*(respPacketPtr + 14) = 0xC0;				// odd MSBs: 100 0000
-		*(respPacketPtr + 15) = 0xF0;				// device status: 1110 1000, read/write
+		*(packet + 14) = 0xC0;				// odd MSBs: 100 0000
+		*(packet + 15) = 0xF0;				// device status: 1110 1000, read/write
 		checksum ^= 0xF0;
-		*(respPacketPtr + 16) = 0x80;				// block size low byte: 0x00
-		*(respPacketPtr + 17) = 0x80;				// block size mid byte: 0x00
-		*(respPacketPtr + 18) = 0x81;				// block size high byte: 0x01
+		*(packet + 16) = 0x80;				// block size low byte: 0x00
+		*(packet + 17) = 0x80;				// block size mid byte: 0x00
+		*(packet + 18) = 0x81;				// block size high byte: 0x01
 		checksum ^= 0x01;
 
-		*(respPacketPtr + 19) = 0x80;				// GRP1 MSBs
-		*(respPacketPtr + 20) = 0x8B;				// ID string length, 11 chars
+		*(packet + 19) = 0x80;				// GRP1 MSBs
+		*(packet + 20) = 0x8B;				// ID string length, 11 chars
 		checksum ^= 0x0B;
-		*(respPacketPtr + 21) = 'B' | 0x80;			// ID string, 16 chars total
+		*(packet + 21) = 'B' | 0x80;			// ID string, 16 chars total
 		checksum ^= 'B';
-		*(respPacketPtr + 22) = 'e' | 0x80;
+		*(packet + 22) = 'e' | 0x80;
 		checksum ^= 'e';
-		*(respPacketPtr + 23) = 'a' | 0x80;
+		*(packet + 23) = 'a' | 0x80;
 		checksum ^= 'a';
-		*(respPacketPtr + 24) = 'g' | 0x80;
+		*(packet + 24) = 'g' | 0x80;
 		checksum ^= 'g';
-		*(respPacketPtr + 25) = 'l' | 0x80;
+		*(packet + 25) = 'l' | 0x80;
 		checksum ^= 'l';
-		*(respPacketPtr + 26) = 'e' | 0x80;
+		*(packet + 26) = 'e' | 0x80;
 		checksum ^= 'e';
 
-		*(respPacketPtr + 27) = 0x80;				// GRP2 MSBs
-		*(respPacketPtr + 28) = 'B' | 0x80;
+		*(packet + 27) = 0x80;				// GRP2 MSBs
+		*(packet + 28) = 'B' | 0x80;
 		checksum ^= 'B';
-		*(respPacketPtr + 29) = 'o' | 0x80;
+		*(packet + 29) = 'o' | 0x80;
 		checksum ^= 'o';
-		*(respPacketPtr + 30) = 'n' | 0x80;
+		*(packet + 30) = 'n' | 0x80;
 		checksum ^= 'n';
-		*(respPacketPtr + 31) = 'e' | 0x80;
+		*(packet + 31) = 'e' | 0x80;
 		checksum ^= 'e';
-		*(respPacketPtr + 32) = '2' | 0x80;
+		*(packet + 32) = '2' | 0x80;
 		checksum ^= '2';
-		*(respPacketPtr + 33) = ' ' | 0x80;
+		*(packet + 33) = ' ' | 0x80;
 		checksum ^= 0x20;
-		*(respPacketPtr + 34) = ' ' | 0x80;
+		*(packet + 34) = ' ' | 0x80;
 		checksum ^= 0x20;
 
 		// Pretending to be a non-removable hard disk
-		*(respPacketPtr + 35) = 0x80;				// GRP3 MSBs: 000 0000
-		*(respPacketPtr + 36) = ' ' | 0x80;
+		*(packet + 35) = 0x80;				// GRP3 MSBs: 000 0000
+		*(packet + 36) = ' ' | 0x80;
 		checksum ^= 0x20;
-		*(respPacketPtr + 37) = ' ' | 0x80;
+		*(packet + 37) = ' ' | 0x80;
 		checksum ^= 0x20;
-		*(respPacketPtr + 38) = ' ' | 0x80;
+		*(packet + 38) = ' ' | 0x80;
 		checksum ^= 0x20;
 
-		*(respPacketPtr + 39) = 0x82;				// device type: 0x02 = Hard disk
+		*(packet + 39) = 0x82;				// device type: 0x02 = Hard disk
 		checksum ^= 0x02;
-		*(respPacketPtr + 40) = 0xA0;				// device subtype: 0x20 = not removable
+		*(packet + 40) = 0xA0;				// device subtype: 0x20 = not removable
 		checksum ^= 0x20;
 
-		*(respPacketPtr + 41) = 0x82;				// firmware version, 2 bytes
+		*(packet + 41) = 0x82;				// firmware version, 2 bytes
 		checksum ^= 0x02;
-		*(respPacketPtr + 42) = 0x80;
+		*(packet + 42) = 0x80;
 	}
 
-	*(respPacketPtr + 43) =  checksum       | 0xAA;	// 1 C6 1 C4 1 C2 1 C0
-	*(respPacketPtr + 44) = (checksum >> 1) | 0xAA;	// 1 C7 1 C5 1 C3 1 C1
-	*(respPacketPtr + 45) = 0xC8;					// PEND
-	*(respPacketPtr + 46) = 0x00;					// End of packet marker in memory
+	*(packet + 43) =  checksum       | 0xAA;	// 1 C6 1 C4 1 C2 1 C0
+	*(packet + 44) = (checksum >> 1) | 0xAA;	// 1 C7 1 C5 1 C3 1 C1
+	*(packet + 45) = 0xC8;					// PEND
+	*(packet + 46) = 0x00;					// End of packet marker in memory
+}
+
+//____________________
+void primeStatusTemplates(void)
+{
+	// STATUS and DIB replies for PRU to send without asking us
+	// Like Init replies: source ID is filled in by PRU, and this routine
+	//  leaves the checksum of everything else at +STAT_TMPL_PART
+	unsigned char *tmpl, checksum, csOfs;
+	unsigned int i, device;
+
+	*statReadyPtr = 0;
+	__sync_synchronize();
+	for (i=0; i<4; i++)
+	{
+		tmpl = pru1RAMptr + STAT_TMPL_ADR + i*STAT_TMPL_LEN;
+		device = i % 2;
+		if (i < STAT_TMPL_DIB)
+		{
+			encodeStdStatusReplyPacket(tmpl, 0x80, 0x00);	// 0x00 = no error
+			csOfs = 19;
+		}
+		else
+		{
+			encodeStdDibStatusReplyPacket(tmpl, 0x80, 0x00, device);
+			csOfs = 43;
+		}
+		checksum = (tmpl[csOfs] & 0x55) | ((tmpl[csOfs+1] & 0x55) << 1);
+		tmpl[STAT_TMPL_CS]	 = csOfs;
+		tmpl[STAT_TMPL_PART] = checksum ^ 0x80;			// take out source ID
+	}
+	statLastReplies = sharedMemPtr[STAT_REPLIES_OFS];
+	dibLastReplies	= sharedMemPtr[DIB_REPLIES_OFS];
+	__sync_synchronize();
+	*statReadyPtr = pruReplies;
 }
 
 //____________________
-void encodeDataPacket(unsigned char srcID, unsigned char dataStat, unsigned char device, unsigned int block)
+void encodeDataPacket(unsigned char *packet, const unsigned char *data, unsigned char srcID, unsigned char dataStat, char stream)
 {
 	// Creates 512 byte (1 block) data packet for reply to read block command
 	// Assumes srcID has MSB set
-	unsigned int i, groupByte, groupCount;
-	unsigned char checksum = 0, groupMsb;
-
-	*(respPacketPtr     ) = 0xFF;				// sync bytes
-	*(respPacketPtr +  1) = 0x3F;
-	*(respPacketPtr +  2) = 0xCF;
-	*(respPacketPtr +  3) = 0xF3;
-	*(respPacketPtr +  4) = 0xFC;
-	*(respPacketPtr +  5) = 0xFF;
-
-	*(respPacketPtr +  6) = 0xC3;				// packet begin
-	*(respPacketPtr +  7) = 0x80;				// destination
-	*(respPacketPtr +  8) = srcID;				// source
-	*(respPacketPtr +  9) = 0x82;				// type: 2 = data
-	*(respPacketPtr + 10) = 0x80;				// aux type: 0 = standard packet
-	*(respPacketPtr + 11) = dataStat | 0x80;	// data status
-	*(respPacketPtr + 12) = 0x81;				// odd byte count: 1
-	*(respPacketPtr + 13) = 0xC9;				// groups-of-7 count: 73 (for 512-byte packet)
+	// stream: packet must be respPacketPtr. Release PRU with WAIT_GO_STREAM
+	//  once header is in, then move TX_CURSOR after each group; PRU sends
+	//  the header while we encode
+	unsigned int groupByte, groupCount;
+	unsigned char checksum, groupMsb;
+
+	if (stream)
+		setTxCursor(0);
+
+	*(packet     ) = 0xFF;				// sync bytes
+	*(packet +  1) = 0x3F;
+	*(packet +  2) = 0xCF;
+	*(packet +  3) = 0xF3;
+	*(packet +  4) = 0xFC;
+	*(packet +  5) = 0xFF;
+
+	*(packet +  6) = 0xC3;				// packet begin
+	*(packet +  7) = 0x80;				// destination
+	*(packet +  8) = srcID;				// source
+	*(packet +  9) = 0x82;				// type: 2 = data
+	*(packet + 10) = 0x80;				// aux type: 0 = standard packet
+	*(packet + 11) = dataStat | 0x80;	// data status
+	*(packet + 12) = 0x81;				// odd byte count: 1
+	*(packet + 13) = 0xC9;				// groups-of-7 count: 73 (for 512-byte packet)
 
 	// Total number of packet data bytes for one block is 584
 	// Odd byte
-	*(respPacketPtr + 14) = ((theImages[device][block][0] >> 1) & 0x40) | 0x80;
-	*(respPacketPtr + 15) =   theImages[device][block][0]			    | 0x80;
+	*(packet + 14) = ((data[0] >> 1) & 0x40) | 0x80;
+	*(packet + 15) =   data[0]			    | 0x80;
+	if (stream)
+	{
+		setTxCursor(16);
+		releasePru(WAIT_GO_STREAM);
+	}
 
 	// Groups of 7
 	for (groupCount=0; groupCount<73; groupCount++)
 	{
 		groupMsb = 0;
 		for (groupByte=0; groupByte<7; groupByte++)
-			groupMsb = groupMsb | ((theImages[device][block][1+(groupCount*7)+groupByte] >> (groupByte+1)) & (0x80 >> (groupByte+1)));
+			groupMsb = groupMsb | ((data[1+(groupCount*7)+groupByte] >> (groupByte+1)) & (0x80 >> (groupByte+1)));
 
-		*(respPacketPtr+16+(groupCount*8)) = groupMsb | 0x80;	// set msb to one
+		*(packet+16+(groupCount*8)) = groupMsb | 0x80;	// set msb to one
 
 		// Now add group data bytes bits 6-0
 		for (groupByte=0; groupByte<7; groupByte++)
-			*(respPacketPtr+17+(groupCount*8) + groupByte) = theImages[device][block][1+(groupCount*7) + groupByte] | 0x80;
+			*(packet+17+(groupCount*8) + groupByte) = data[1+(groupCount*7) + groupByte] | 0x80;
+		if (stream)
+			setTxCursor(24 + groupCount*8);
 	}
 
-	// Checksum
-	for (i=0; i<512; i++)								// xor data bytes
-		checksum = checksum ^ theImages[device][block][i];
+	// Checksum: data bytes and packet header bytes
+	checksum = xorBytes(data, 512) ^ xorBytes(packet + 7, 7);
 
-	for (i=7; i<14; i++)
-		checksum = checksum ^ *(respPacketPtr+i);		// xor packet header bytes
+    *(packet + 600) =  checksum		 | 0xAA;	// 1 c6 1 c4 1 c2 1 c0
+    *(packet + 601) = (checksum >> 1) | 0xAA;	// 1 c7 1 c5 1 c3 1 c1
+	*(packet + 602) = 0xC8;						// PEND
+	*(packet + 603) = 0x00;						// end of packet marker in memory
+	if (stream)
+		setTxCursor(604);
+}
+
+//____________________
+unsigned char xorBytes(const unsigned char *bytes, unsigned int len)
+{
+	// SmartPort checksum part: all bytes xored
+	unsigned char x = 0;
+	unsigned int i;
 
-    *(respPacketPtr + 600) =  checksum		 | 0xAA;	// 1 c6 1 c4 1 c2 1 c0
-    *(respPacketPtr + 601) = (checksum >> 1) | 0xAA;	// 1 c7 1 c5 1 c3 1 c1
-	*(respPacketPtr + 602) = 0xC8;						// PEND
-	*(respPacketPtr + 603) = 0x00;						// end of packet marker in memory
+	for (i=0; i<len; i++)
+		x ^= bytes[i];
+	return x;
 }
 
 //____________________
-char decodeDataPacket(void)
+void setTxCursor(unsigned int len)
 {
-	// Decode 512-byte data packet (1 block) from A2 into tempBuffer[]
-	// Returns 0 if checksum good, 6 otherwise
-	unsigned int i, groupByte, groupCount;
-	unsigned char checksum = 0, bit0to6, bit7, oddbits, evenbits;
+	// PRU may send the first len bytes of respPacketPtr
+	__sync_synchronize();							// bytes before cursor
+	*(volatile unsigned int *) (pru1RAMptr + TX_CURSOR_ADR) = RESP_PACKET_ADR + len;
+}
 
-	// Add oddbyte, 1 in a 512 data packet
-	tempBuffer[0] = ((*(rcvdPacketPtr+14) << 1) & 0x80) | (*(rcvdPacketPtr+15) & 0x7F);
+//____________________
+void streamRxData(void)
+{
+	// Copy decoded data chunks PRU finished since last time into rxStream
+	// PRU Data RAM reads are slow, doing them during the packet keeps them
+	//  out of the time A2 waits for our reply
+	unsigned int end;
 
-	// 73 grps of 7 in a 512 byte packet
-	for (groupCount=0; groupCount<73; groupCount++)
-	{
-		for (groupByte=0; groupByte<7; groupByte++)
-		{
-			bit7    = (*(rcvdPacketPtr+16+8*groupCount) << (groupByte+1)) & 0x80;
-			bit0to6 = (*(rcvdPacketPtr+17+8*groupCount + groupByte))      & 0x7F;
-			tempBuffer[1 + 7*groupCount + groupByte] = (bit7 | bit0to6);
-		}
-	}
+	end = *(volatile unsigned int *) (rxInfoPtr + RX_INFO_CURSOR) - RX_DATA_ADR;
+	if (end > RX_DATA_LEN)
+		return;
+	if (end < rxStreamLen)							// cursor went back, PRU started another packet
+		rxStreamLen = 0;
+	if (end == rxStreamLen)
+		return;
+	__sync_synchronize();							// cursor before data
+	memcpy(rxStream + rxStreamLen, rxDataPtr + rxStreamLen, end - rxStreamLen);
+	rxStreamLen = end;
+}
 
-	// Verify checksum
-	for (i=0; i<512; i++)							// xor all data bytes
-		checksum ^= tempBuffer[i];
+//____________________
+void stageDataBlock(unsigned char srcID, unsigned char dataStat, unsigned char device, unsigned int block)
+{
+	// Like encodeDataPacket() but PRU builds the packet while sending it
+	// Release PRU with WAIT_GO_BLOCK
+	memcpy(txRawPtr, theImages[device][block], 512);
+	*(pru1RAMptr + TX_SRC_ADR)  = srcID;
+	*(pru1RAMptr + TX_STAT_ADR) = dataStat;
+}
 
-	for (i=7; i<14; i++)
-        checksum ^= *(rcvdPacketPtr+i);				// xor packet header bytes
+//____________________
+char checkDataPacket(void)
+{
+	// PRU decoded 512-byte data packet (1 block) into rxDataPtr as it arrived
+	// Returns 0 if checksum good, 6 otherwise
+	unsigned int len;
 
-	evenbits =  *(rcvdPacketPtr+600) & 0x55;
-	oddbits  = (*(rcvdPacketPtr+601) & 0x55) << 1;
-	if (checksum == (oddbits | evenbits))
+	len = rxInfoPtr[RX_INFO_LEN] | (rxInfoPtr[RX_INFO_LEN+1] << 8);
+	if ((rxInfoPtr[RX_INFO_CS] == eRX_CS_GOOD) && (len == RX_DATA_LEN))
 		return 0;									// checksum good
 	else
 		return 6;									// SmartPort bus error
@@ -1028,40 +2045,17 @@ char decodeDataPacket(void)
 //____________________
 char checkCmdChecksum(void)
 {
-	// Returns 0 if checksum ok
-	unsigned char msbs, packetCS, checksum = 0;
-
-	checksum ^=  *(rcvdPacketPtr +  7);
-	checksum ^=  *(rcvdPacketPtr +  8);
-	checksum ^=  *(rcvdPacketPtr +  9);
-	checksum ^=  *(rcvdPacketPtr + 10);
-	checksum ^=  *(rcvdPacketPtr + 11);
-	checksum ^=  *(rcvdPacketPtr + 12);
-	checksum ^=  *(rcvdPacketPtr + 13);
-
-	msbs      =  *(rcvdPacketPtr + 14);
-	checksum ^= (*(rcvdPacketPtr + 15) & 0x7F) | ((msbs << 1) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 16) & 0x7F) | ((msbs << 2) & 0x80);
-
-	msbs      = *(rcvdPacketPtr+ 17);
-	checksum ^= (*(rcvdPacketPtr + 18) & 0x7F) | ((msbs << 1) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 19) & 0x7F) | ((msbs << 2) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 20) & 0x7F) | ((msbs << 3) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 21) & 0x7F) | ((msbs << 4) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 22) & 0x7F) | ((msbs << 5) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 23) & 0x7F) | ((msbs << 6) & 0x80);
-	checksum ^= (*(rcvdPacketPtr + 24) & 0x7F) | ((msbs << 7) & 0x80);
-
-	packetCS = *(rcvdPacketPtr+25) & ((*(rcvdPacketPtr+26) << 1) | 0x01);
-
-	if (checksum == packetCS)
+	// Returns 0 if checksum ok, PRU checked it as packet arrived
+	if (rxInfoPtr[RX_INFO_CS] == eRX_CS_GOOD)
 	{
 //		printf("GOOD checksum\n");
 		return 0;
 	}
 	else
 	{
-		printf("*** checkCmdChecksum() reports BAD checksum\n");
+		atomic_fetch_add_explicit(&badCmdCs, 1, memory_order_relaxed);
+		logEvent(eEV_BAD_CMD_CS, *rcvdPacketDestPtr, 0, *rcvdPacketCmdPtr,
+			(rxInfoPtr[RX_INFO_CALC] << 8) | rxInfoPtr[RX_INFO_SENT]);
 		return 1;
 	}
 }
@@ -1069,10 +2063,18 @@ char checkCmdChecksum(void)
 //____________________
 void printRcvdPacket(void)
 {
-	int i;
-	for (i=6; i<28; i++)
-		printf("\t%d 0x%X\n", i, *(rcvdPacketPtr+i));
-	printf("\n");
+	// Bytes go to event log 4 at a time: block = offset, status = count
+	int i, j, n;
+	unsigned int bytes;
+	for (i=6; i<28; i+=4)
+	{
+		n = (28 - i < 4) ? 28 - i : 4;
+		bytes = 0;
+		for (j=0; j<n; j++)
+			bytes |= *(rcvdPacketPtr+i+j) << (j * 8);
+		logEvent(eEV_PACKET_BYTES, 0, i, n, bytes);
+	}
+	logEvent(eEV_PACKET_END, 0, 0, 0, 0);
 }
 
 //____________________
@@ -1083,10 +2085,2103 @@ void debugDataPacket(void)
 	{
 		if (*(rcvdPacketPtr+i) < 0x80)
 		{
-			printf("\t%d 0x%X\n", i-1, *(rcvdPacketPtr+i-1));
-			printf("\t%d 0x%X\n", i  , *(rcvdPacketPtr+i  ));
-			printf("\t%d 0x%X\n", i+1, *(rcvdPacketPtr+i+1));
+			logEvent(eEV_PACKET_BYTES, 0, i-1, 3, *(rcvdPacketPtr+i-1) | (*(rcvdPacketPtr+i) << 8) | (*(rcvdPacketPtr+i+1) << 16));
 			break;
 		}
 	}
 }
+
+//____________________
+void releasePru(unsigned char waitCode)
+{
+	// Tell PRU to continue, WAIT_GO or WAIT_SKIP
+	// PRU watches WAIT_ADR and the doorbell event in a tight loop
+	__sync_synchronize();							// block writes before WAIT_ADR, PRU may read DDR images
+	*pruWaitPtr = waitCode;
+	__sync_synchronize();							// WAIT_ADR before doorbell
+	*pruDoorbellPtr = 0x1 << FROM_HOST_EVENT;
+	releaseNs = nowNs();							// PRU already going
+	releaseWait = waitCode;
+}
+
+//____________________
+void addTimingSample(struct timingStat *stat, unsigned int cycles)
+{
+	if ((stat->cnt == 0) || (cycles < stat->min))
+		stat->min = cycles;
+	if (cycles > stat->max)
+		stat->max = cycles;
+	stat->sum += cycles;
+	stat->cnt++;
+}
+
+//____________________
+void queueTimingSample(void)
+{
+	// PRU finished a transaction, hand its timing to stats worker
+	struct statSample sample;
+
+	lastTimingSeq = *timingSeqPtr;
+	sample.ns = nowNs();
+	sample.hostWait   = *hostWaitPtr;
+	sample.goStart    = *goStartPtr;
+	sample.goFirstBit = *goFirstBitPtr;
+	sample.what = eSAMPLE_PRU;
+	sample.mode = rcvdPollMode;
+	spscPush(&statsQueue, &sample);
+}
+
+//____________________
+void queueCmdSample(unsigned char destID, unsigned char type, unsigned char cmdNum)
+{
+	// Controller answered a packet, hand its unit, command and
+	//  eRCVDPACK to GO/SKIP time to stats worker
+	struct statSample sample;
+	unsigned char base;
+
+	sample.ns = nowNs();
+	sample.what = eSAMPLE_CMD;
+	sample.turnNs = releaseNs - rcvdNs;
+	if (destID == spID1)
+		sample.unit = 0;
+	else if (destID == spID2)
+		sample.unit = 1;
+	else
+		sample.unit = 2;
+
+	base = cmdNum & 0xBF;
+	if (type == 0x82)
+		sample.kind = eCK_DATA;
+	else if (type != 0x80)
+		sample.kind = eCK_OTHER;
+	else if (base == 0x80)
+		sample.kind = ((*(rcvdPacketPtr + 20) & 0x7F) == 0x03) ? eCK_DIB : eCK_STATUS;
+	else if (base == 0x81)
+		sample.kind = eCK_READBLK;
+	else if (base == 0x82)
+		sample.kind = eCK_WRITEBLK;
+	else if (base == 0x84)
+		sample.kind = eCK_CONTROL;
+	else
+		sample.kind = eCK_OTHER;
+	if ((cmdNum & 0x40) && (sample.kind <= eCK_CONTROL))
+		sample.kind += eCK_XSTATUS;						// extended command, same order
+	spscPush(&statsQueue, &sample);
+}
+
+//____________________
+void printTimingStat(const char *name, struct timingStat *stat)
+{
+	if (stat->cnt == 0)
+		printf("\t%-14s no samples\n", name);
+	else
+		printf("\t%-14s n=%u\tmin=%.2f\tavg=%.2f\tmax=%.2f us\n", name, stat->cnt,
+			(double) stat->min / PRU_CYCLES_PER_US,
+			(double) stat->sum / stat->cnt / PRU_CYCLES_PER_US,
+			(double) stat->max / PRU_CYCLES_PER_US);
+}
+
+//____________________
+void printTimingStats(void)
+{
+	printf("--- PRU transaction timing (Tx cell %.2f, low %.2f, Init gap %.2f us)\n",
+		*(volatile unsigned int *) (pru1RAMptr + TX_CELL_ADR) / (double) PRU_CYCLES_PER_US,
+		*(volatile unsigned int *) (pru1RAMptr + TX_LOW_ADR) / (double) PRU_CYCLES_PER_US,
+		*(volatile unsigned int *) (pru1RAMptr + TX_GAP_ADR) / (double) PRU_CYCLES_PER_US);
+	printTimingStat("RCVDPACK->GO", &hostWaitStat);
+	printTimingStat("GO->send", &goStartStat);
+	printTimingStat("GO->first bit", &goFirstBitStat);
+	printPerfStats();
+}
+
+//____________________
+void samplePerf(void)
+{
+	// Copy PRU perf block if a transaction finished since last look
+	// PRU counts PERF_SEQ up at packet end and again when done, so odd = being written
+	// Transactions between our looks are only in the counters
+	unsigned int block[PF_WORDS], seq, i, from, to;
+
+	seq = sharedMemPtr[PERF_OFS + PERF_SEQ];
+	if ((seq == perfLastSeq) || (seq & 1))
+		return;
+	__sync_synchronize();
+	for (i=0; i<PF_WORDS; i++)
+		block[i] = sharedMemPtr[PERF_OFS + i];
+	__sync_synchronize();
+	if (sharedMemPtr[PERF_OFS + PERF_SEQ] != seq)
+		return;									// PRU started the next one, try again
+
+	if (seq > perfLastSeq)						// else PRU restarted
+		perfMissed += (seq - perfLastSeq) / 2 - 1;
+	perfLastSeq = seq;
+	perfSampled++;
+
+	for (i=0; i<PERF_INTERVALS; i++)
+	{
+		from = (perfIntervals[i].from == PERF_SEQ) ? 0 : block[perfIntervals[i].from];
+		to = block[perfIntervals[i].to];
+		if ((perfIntervals[i].from != PERF_SEQ) && (from == 0))
+			continue;
+		if ((to == 0) || (perfIntervals[i].pruOnly && (block[PH_NOTIFY] != 0)))
+			continue;
+		addTimingSample(&perfStats[i], to - from);
+	}
+}
+
+//____________________
+void printPerfStats(void)
+{
+	unsigned int i, lastJob;
+	unsigned long long hostWait, reqWait;
+
+	printf("--- PRU transaction phases (%u sampled, %u between samples)\n", perfSampled, perfMissed);
+	for (i=0; i<PERF_INTERVALS; i++)
+		printTimingStat(perfIntervals[i].name, &perfStats[i]);
+
+	hostWait = sharedMemPtr[PERF_OFS + PF_HOST_WAIT] | (unsigned long long) sharedMemPtr[PERF_OFS + PF_HOST_WAIT + 1] << 32;
+	reqWait  = sharedMemPtr[PERF_OFS + PF_REQ_WAIT]  | (unsigned long long) sharedMemPtr[PERF_OFS + PF_REQ_WAIT + 1] << 32;
+	lastJob  = sharedMemPtr[PERF_OFS + PF_LAST_JOB];
+	printf("\tpackets=%u\terror1=%u\terror2=%u\terror3=%u\tresets=%u\n",
+		sharedMemPtr[PERF_OFS + PF_PACKETS], sharedMemPtr[PERF_OFS + PF_ERROR1],
+		sharedMemPtr[PERF_OFS + PF_ERROR2], sharedMemPtr[PERF_OFS + PF_ERROR3],
+		sharedMemPtr[PERF_OFS + PF_RESETS]);
+	printf("\twaited on Controller %.3f ms, on REQ %.3f ms, last job kind=%u done=%u\n",
+		hostWait / (PRU_CYCLES_PER_US * 1000.0), reqWait / (PRU_CYCLES_PER_US * 1000.0),
+		lastJob >> 8, lastJob & 0xFF);
+}
+
+//____________________
+void setRxWindows(unsigned int cellNs)
+{
+	// n cells up to n + 1/2 cells, packet ends after 9 1/2 cells without an edge
+	unsigned int i, cell;
+
+	cell = cellNs * PRU_CYCLES_PER_US / 1000;
+	for (i=0; i<RX_CELLS-1; i++)
+		rxLimitsPtr[i] = (2*i + 3) * cell / 2;
+	rxLimitsPtr[RX_CELLS-1] = 19 * cell / 2;
+	sharedMemPtr[CAL_RX_CELL_OFS] = cell * 16;		// PRU re-centres from here with -a 1
+	__sync_synchronize();
+	*(pru1RAMptr + RX_REBUILD_ADR) = 1;				// PRU rebuilds its lookup table
+}
+
+//____________________
+void setTxTiming(unsigned int cellNs, unsigned int lowNs, unsigned int gapNs)
+{
+	// PRU reads these before each packet; a cell or pulse too short to run
+	//  makes it send at 4 us / 1.75 us. BITS_ASM firmware rounds cell and
+	//  low down to an even number of cycles
+	*(volatile unsigned int *) (pru1RAMptr + TX_CELL_ADR) = cellNs * PRU_CYCLES_PER_US / 1000;
+	*(volatile unsigned int *) (pru1RAMptr + TX_LOW_ADR)  = lowNs * PRU_CYCLES_PER_US / 1000;
+	*(volatile unsigned int *) (pru1RAMptr + TX_GAP_ADR)  = gapNs * PRU_CYCLES_PER_US / 1000;
+}
+
+//____________________
+void printRxStats(void)
+{
+	// Edge intervals PRU saw, by number of bit cells, with distance to the windows
+	// margin- = min to lower limit, margin+ = upper limit to max
+	unsigned int i, cnt, min, max, lower, upper, total;
+
+	printf("--- Receive intervals, us (cell %.2f)\n", rxCellNs / 1000.0);
+	total = 0;
+	for (i=0; i<RX_CELLS; i++)
+	{
+		cnt = sharedMemPtr[RX_CNT_OFS + i];
+		if (cnt == 0)
+			continue;
+		total += cnt;
+		min = sharedMemPtr[RX_MIN_OFS + i];
+		max = sharedMemPtr[RX_MAX_OFS + i];
+		lower = i ? rxLimitsPtr[i-1] : 0;
+		upper = rxLimitsPtr[i];
+		printf("\t%u cell%s\tcnt=%u\tmin=%.2f\tmax=%.2f\tmargin-=%.2f\tmargin+=%.2f\n",
+			i+1, i ? "s" : " ", cnt,
+			(double) min / PRU_CYCLES_PER_US, (double) max / PRU_CYCLES_PER_US,
+			((double) min - lower) / PRU_CYCLES_PER_US, ((double) upper - max) / PRU_CYCLES_PER_US);
+	}
+	if (total == 0)
+		printf("\tno edges yet\n");
+	else
+		printf("\tedge work: last packet avg=%.1f max=%u cycles\n",
+			sharedMemPtr[RX_EDGES_OFS] ? (double) sharedMemPtr[RX_WORK_SUM_OFS] / sharedMemPtr[RX_EDGES_OFS] : 0.0,
+			sharedMemPtr[RX_WORK_MAX_OFS]);
+}
+
+//____________________
+void printCalStats(void)
+{
+	// Bit cell A2 sends, as PRU measured it on sync bytes, drift vs 4 us nominal
+	unsigned int packets, avg, min, max;
+
+	packets = sharedMemPtr[CAL_PACKETS_OFS];
+	printf("--- Bit cell calibration (%s%s)\n", calMode & CAL_ADAPT_RX ? "adapt Rx" : "measure only",
+		calMode & CAL_TRIM_TX ? ", trim Tx" : "");
+	if (packets == 0)
+	{
+		printf("\tno packets yet, rejected=%u\n", sharedMemPtr[CAL_REJECTS_OFS]);
+		return;
+	}
+	avg = sharedMemPtr[CAL_AVG_OFS];
+	min = sharedMemPtr[CAL_MIN_OFS];
+	max = sharedMemPtr[CAL_MAX_OFS];
+	printf("\tpackets=%u\trejected=%u\tlast=%.2f\tavg=%.2f\tmin=%.2f\tmax=%.2f cycles\n",
+		packets, sharedMemPtr[CAL_REJECTS_OFS], sharedMemPtr[CAL_LAST_OFS] / 16.0,
+		avg / 16.0, min / 16.0, max / 16.0);
+	printf("\tdrift=%+.0f ppm\tspread=%.0f ppm\tRx windows at %.2f\tTx cell %u cycles\n",
+		((double) avg / (16.0 * 800) - 1.0) * 1e6, (double) (max - min) / (16.0 * 800) * 1e6,
+		sharedMemPtr[CAL_RX_CELL_OFS] / 16.0, *(volatile unsigned int *) (pru1RAMptr + TX_CELL_ADR));
+}
+
+//____________________
+unsigned long long nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//____________________
+void histAdd(struct latHist *hist, unsigned int value)
+{
+	hist->counts[histIndex(value)]++;
+	hist->cnt++;
+	hist->sum += value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+//____________________
+unsigned int histIndex(unsigned int value)
+{
+	// Values below HIST_SUB are exact, above keep HIST_SUB_BITS+1 significant bits
+	unsigned int shift;
+
+	if (value < HIST_SUB)
+		return value;
+	shift = (31 - __builtin_clz(value)) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) - HIST_SUB);
+}
+
+//____________________
+unsigned int histPercentile(struct latHist *hist, double pct)
+{
+	// Returns upper edge of bucket holding pct percentile
+	unsigned int idx, shift;
+	unsigned long long target, seen;
+
+	if (hist->cnt == 0)
+		return 0;
+
+	target = (unsigned long long) (hist->cnt * pct / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	seen = 0;
+	for (idx=0; idx<HIST_BUCKETS; idx++)
+	{
+		seen += hist->counts[idx];
+		if (seen >= target)
+			break;
+	}
+
+	if (idx < HIST_SUB)
+		return idx;
+	shift = (idx >> HIST_SUB_BITS) - 1;
+	if (idx == HIST_BUCKETS - 1)
+		return hist->max;
+	return ((((idx & (HIST_SUB - 1)) + HIST_SUB) + 1) << shift) - 1;
+}
+
+//____________________
+void pollWait(unsigned char pruStatus)
+{
+	// Wait before next look at PRU status, how long depends on bus activity
+	unsigned long long now;
+	unsigned char mode;
+	unsigned int i;
+
+	now = nowNs();
+	if ((pruStatus == eIDLE) || (pruStatus == eRESET))
+		mode = ePARK;
+	else if (pruStatus != eENABLED)						// receiving, sending, ...
+	{
+		lastTrafficNs = now;
+		mode = eSPIN;
+	}
+	else if (now - lastTrafficNs < spinWindowUs * 1000ULL)
+		mode = eSPIN;
+	else
+		mode = eBACKOFF;
+
+	if (mode != pollMode)
+		switchPollMode(mode, now);
+
+	switch (mode)
+	{
+		case eSPIN:
+			backoffUs = BACKOFF_MIN_US;
+			for (i=0; i<SPIN_BATCH; i++)
+			{
+				if ((*pruStatusPtr != pruStatus) || (*pruErrorPtr != eNOERROR))
+					break;
+				cpu_relax();
+			}
+			break;
+
+		case eBACKOFF:
+			usleep(backoffUs);
+			backoffUs *= 2;
+			if (backoffUs > backoffMaxUs)
+				backoffUs = backoffMaxUs;
+			break;
+
+		default:
+			backoffUs = BACKOFF_MIN_US;
+			usleep(parkUs);
+	}
+}
+
+//____________________
+void switchPollMode(unsigned char mode, unsigned long long now)
+{
+	// Charge wall time to the mode we are leaving
+	// CPU time is sampled by stats worker, no syscall here
+	pollStats[pollMode].wallNs += now - modeStartNs;
+	pollStats[mode].entries++;
+
+	pollMode = mode;
+	modeStartNs = now;
+}
+
+//____________________
+void printPollStats(void)
+{
+	unsigned int i;
+	unsigned long long wallNs;
+	struct pollModeStat *stat;
+
+	printf("--- Poller (spin %u us, backoff <= %u us, park %u us)\n", spinWindowUs, backoffMaxUs, parkUs);
+	for (i=0; i<eNUM_POLL_MODES; i++)
+	{
+		stat = &pollStats[i];
+		wallNs = stat->wallNs;
+		if (i == pollMode)							// include time in current mode
+			wallNs += nowNs() - modeStartNs;
+		printf("\t%-8s wall=%.1f s\tcpu=%.1f s (%.0f%%)\tentries=%u\n", pollModeNames[i],
+			wallNs / 1e9, stat->cpuNs / 1e9,
+			wallNs ? 100.0 * stat->cpuNs / wallNs : 0.0, stat->entries);
+		if (stat->turnaround.cnt != 0)
+			printHistLine("\t cmds", &stat->turnaround);
+	}
+	printHistLine("all cmds", &allTurnaround);
+	if (jitterHist.cnt != 0)
+		printHistLine("jitter", &jitterHist);
+}
+
+//____________________
+void printCmdStats(void)
+{
+	// Per unit and command, only the packets the Controller answered
+	unsigned int unit, kind;
+	char name[24];
+
+	printf("--- Commands, eRCVDPACK to GO/SKIP\n");
+	for (unit=0; unit<CMD_UNITS; unit++)
+	{
+		for (kind=0; kind<eNUM_CK; kind++)
+		{
+			if (cmdHist[unit][kind].cnt == 0)
+				continue;
+			snprintf(name, sizeof(name), "%s %s", cmdUnitNames[unit], cmdKindNames[kind]);
+			printHistLine(name, &cmdHist[unit][kind]);
+		}
+	}
+	printf("\tbad checksum cmd=%u data=%u\tERROR1=%u ERROR2=%u ERROR3=%u underrun=%u\n",
+		atomic_load(&badCmdCs), atomic_load(&badDataCs), atomic_load(&pruErrorCnt[eERROR1]),
+		atomic_load(&pruErrorCnt[eERROR2]), atomic_load(&pruErrorCnt[eERROR3]),
+		atomic_load(&pruErrorCnt[eERROR_UNDERRUN]));
+}
+
+//____________________
+void printHistLine(const char *name, struct latHist *hist)
+{
+	printf("\t%-8s n=%u\tp50=%.1f\tp90=%.1f\tp99=%.1f\tp99.9=%.1f\tmax=%.1f us\n", name, hist->cnt,
+		histPercentile(hist, 50.0) / 1000.0,
+		histPercentile(hist, 90.0) / 1000.0,
+		histPercentile(hist, 99.0) / 1000.0,
+		histPercentile(hist, 99.9) / 1000.0,
+		hist->max / 1000.0);
+}
+
+//____________________
+void usage(const char *prog)
+{
+	printf("Usage: %s [-s spinUs] [-b backoffMaxUs] [-p parkUs] [-r prio] [-c cpu] [-j secs] [-e file] [-E file] [-P file] [-D file [-F filter]] [-M path|[addr:]port] [-w cellNs] [-a mode] [-t cell,low,gap] [-m addr] [-H] [-C] [-S] [-W] [-T]\n", prog);
+	printf("\t-s  keep spinning this long after bus traffic (%u)\n", spinWindowUs);
+	printf("\t-b  longest sleep while bus enabled and quiet (%u)\n", backoffMaxUs);
+	printf("\t-p  sleep while bus idle or in reset (%u)\n", parkUs);
+	printf("\t-r  real-time mode: mlock, pre-fault, SCHED_FIFO at prio (off)\n");
+	printf("\t-c  pin to cpu (not pinned)\n");
+	printf("\t-j  run scheduling jitter probe for secs before starting (off)\n");
+	printf("\t-e  command event log file (%s)\n", eventLogPath);
+	printf("\t-w  receive bit cell in ns, windows at n+1/2 cells (%u)\n", rxCellNs);
+	printf("\t-a  bit cell PRU measures on sync bytes: 1 = adapt Rx windows, 2 = trim Tx cell, 3 = both (%u)\n", calMode);
+	printf("\t-t  transmit bit cell, RDAT low for a 1, gap after Init reply, ns; PRU asm loop rounds cell, low to 10 ns (%u,%u,%u)\n", txCellNs, txLowNs, txGapNs);
+	printf("\t-m  physical address of DDR carve-out for images, PRU reads blocks there (off)\n");
+	printf("\t-H  host encodes data packets (PRU encodes from raw block)\n");
+	printf("\t-C  don't load PRU block cache\n");
+	printf("\t-S  answer STATUS here (PRU sends STATUS and DIB replies)\n");
+	printf("\t-W  see WRITEBLK commands here (PRU takes them, block comes with data)\n");
+	printf("\t-T  stream: PRU sends data packets while we encode them, we copy WRITEBLK data as it arrives\n");
+	printf("\t-E  print events saved in file and exit\n");
+	printf("\t-P  trace of packets answered here, not by PRU (see -C -S -W), rotated as .1 .. .%u, - = off (%s)\n", TRACE_FILES-1, tracePath);
+	printf("\t-D  print packet trace file and exit, -F dev=0x81,cmd=0x81,blk=n[-m],slow=us,err,hex picks records\n");
+	printf("\t-M  serve per-command latency and error counts as Prometheus text on a Unix socket or HTTP port\n");
+#ifdef PRU_SIM
+	simUsage();
+#endif
+}
+
+//____________________
+int enterRealTime(unsigned char *pru, pthread_attr_t *attr)
+{
+	// Lock and pre-fault everything the bus thread touches, and set up
+	//  attr so bus thread runs SCHED_FIFO
+	// theImages was zeroed and loaded, but mlockall() keeps it resident
+	struct sched_param param;
+	cpu_set_t cpus;
+	long numCpus;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		printf("*** ERROR: mlockall failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (mlock(pru, PRU_LEN) != 0)					// /dev/mem mapping, PTEs set at mmap
+		printf("*** mlock of PRU memory failed: %s\n", strerror(errno));
+
+	numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((rtCpu >= 0) && (numCpus > 1))
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(rtCpu, &cpus);
+		if (pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus) != 0)
+		{
+			printf("*** ERROR: could not pin to cpu %d: %s\n", rtCpu, strerror(errno));
+			return -1;
+		}
+	}
+	else if (rtCpu >= 0)
+		printf("FYI - single cpu, -c ignored\n");
+
+	param.sched_priority = rtPriority;
+	if ((pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) != 0) ||
+		(pthread_attr_setschedpolicy(attr, SCHED_FIFO) != 0) ||
+		(pthread_attr_setschedparam(attr, &param) != 0))
+	{
+		printf("*** ERROR: could not set SCHED_FIFO %u\n", rtPriority);
+		return -1;
+	}
+
+	printf("--- Real-time: bus thread SCHED_FIFO %u, cpu %d of %ld, memory locked\n", rtPriority, rtCpu, numCpus);
+	return 0;
+}
+
+//____________________
+void prefaultStack(void)
+{
+	// Touch stack we may need later so it never faults in the bus loop
+	volatile unsigned char dummy[STACK_PREFAULT];
+
+	memset((unsigned char *) dummy, 0, STACK_PREFAULT);
+}
+
+//____________________
+void jitterProbe(unsigned int seconds)
+{
+	// Measure scheduling latency like cyclictest: sleep to absolute
+	//  deadlines and record how late we wake up
+	struct timespec next, now;
+	unsigned long long lateNs, loops, i;
+
+	logMsg("--- Jitter probe, %u s at %u us interval\n", seconds, JITTER_INTERVAL_US);
+
+	loops = seconds * 1000000ULL / JITTER_INTERVAL_US;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i=0; i<loops; i++)
+	{
+		next.tv_nsec += JITTER_INTERVAL_US * 1000;
+		if (next.tv_nsec >= 1000000000)
+		{
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		lateNs = (now.tv_sec - next.tv_sec) * 1000000000ULL + now.tv_nsec - next.tv_nsec;
+		histAdd(&jitterHist, lateNs > 0xFFFFFFFF ? 0xFFFFFFFF : (unsigned int) lateNs);
+	}
+	logMsg("\tjitter p99.9=%.1f max=%.1f us\n", histPercentile(&jitterHist, 99.9) / 1000.0, jitterHist.max / 1000.0);
+}
+
+//____________________
+void spscInit(struct spscQueue *q, unsigned int size, unsigned int elemSize)
+{
+	// size must be a power of 2
+	q->slots = calloc(size, elemSize);
+	q->mask = size - 1;
+	q->elemSize = elemSize;
+	q->highWater = 0;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->dropped, 0);
+}
+
+//____________________
+int spscPush(struct spscQueue *q, const void *elem)
+{
+	// Returns 0 if queued, -1 if full (dropped)
+	unsigned int head, depth;
+
+	head  = atomic_load_explicit(&q->head, memory_order_relaxed);
+	depth = head - atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (depth > q->mask)
+	{
+		atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	memcpy(q->slots + (head & q->mask) * q->elemSize, elem, q->elemSize);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	if (depth + 1 > q->highWater)
+		q->highWater = depth + 1;
+	return 0;
+}
+
+//____________________
+int spscPop(struct spscQueue *q, void *elem)
+{
+	// Returns 0 if elem filled, -1 if empty
+	unsigned int tail;
+
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+		return -1;
+
+	memcpy(elem, q->slots + (tail & q->mask) * q->elemSize, q->elemSize);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+//____________________
+unsigned int spscDepth(struct spscQueue *q)
+{
+	return atomic_load(&q->head) - atomic_load(&q->tail);
+}
+
+//____________________
+void mpscInit(struct mpscQueue *q, unsigned int size, unsigned int elemSize)
+{
+	// size must be a power of 2
+	unsigned int i;
+
+	q->slots = calloc(size, elemSize);
+	q->seqs  = calloc(size, sizeof(*q->seqs));
+	q->mask = size - 1;
+	q->elemSize = elemSize;
+	for (i=0; i<size; i++)
+		atomic_init(&q->seqs[i], i);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->highWater, 0);
+	atomic_init(&q->dropped, 0);
+}
+
+//____________________
+int mpscPush(struct mpscQueue *q, const void *elem)
+{
+	// Bounded queue with per-slot sequence numbers, producers claim a slot with CAS
+	// Returns 0 if queued, -1 if full (dropped)
+	unsigned int pos, seq, depth;
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	while (1)
+	{
+		seq = atomic_load_explicit(&q->seqs[pos & q->mask], memory_order_acquire);
+		if (seq == pos)
+		{
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;								// slot is ours
+		}
+		else if ((int) (seq - pos) < 0)				// consumer hasn't freed it, full
+		{
+			atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+			return -1;
+		}
+		else										// another producer got it
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	}
+
+	memcpy(q->slots + (pos & q->mask) * q->elemSize, elem, q->elemSize);
+	atomic_store_explicit(&q->seqs[pos & q->mask], pos + 1, memory_order_release);
+
+	depth = pos + 1 - atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (depth > atomic_load_explicit(&q->highWater, memory_order_relaxed))
+		atomic_store_explicit(&q->highWater, depth, memory_order_relaxed);	// approximate
+	return 0;
+}
+
+//____________________
+int mpscPop(struct mpscQueue *q, void *elem)
+{
+	// Returns 0 if elem filled, -1 if empty
+	unsigned int pos, seq;
+
+	pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	seq = atomic_load_explicit(&q->seqs[pos & q->mask], memory_order_acquire);
+	if (seq != pos + 1)
+		return -1;
+
+	memcpy(elem, q->slots + (pos & q->mask) * q->elemSize, q->elemSize);
+	atomic_store_explicit(&q->seqs[pos & q->mask], pos + q->mask + 1, memory_order_release);
+	atomic_store_explicit(&q->tail, pos + 1, memory_order_relaxed);
+	return 0;
+}
+
+//____________________
+unsigned int mpscDepth(struct mpscQueue *q)
+{
+	return atomic_load(&q->head) - atomic_load(&q->tail);
+}
+
+//____________________
+void logMsg(const char *fmt, ...)
+{
+	// printf for bus thread: format into log queue, log worker prints it
+	// Never blocks, message dropped and counted if queue is full
+	struct logEntry entry;
+	va_list args;
+
+	entry.ns = nowNs();
+	va_start(args, fmt);
+	vsnprintf(entry.text, LOG_TEXT_LEN, fmt, args);
+	va_end(args);
+	mpscPush(&logQueue, &entry);
+}
+
+//____________________
+int openEventLog(const char *path)
+{
+	// Previous run's file kept as .prev so a crash record survives restart
+	// Ring is locked and touched here, before the bus thread starts
+	// Keeps events in memory only if file can't be made
+	char prevName[256];
+	struct timespec ts;
+	int fd;
+
+	eventLogLen = sizeof(struct eventLogHeader) + EVENT_RECS * sizeof(struct eventRec);
+	eventLog = mmap(0, eventLogLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (eventLog == MAP_FAILED)
+	{
+		printf("*** ERROR: could not map event log ring\n");
+		eventLog = NULL;
+		return -1;
+	}
+	if (mlock(eventLog, eventLogLen) != 0)
+		printf("*** mlock of event log ring failed: %s\n", strerror(errno));
+
+	memcpy(eventLog->magic, EVENT_MAGIC, sizeof(eventLog->magic));
+	eventLog->recSize = sizeof(struct eventRec);
+	eventLog->numRecs = EVENT_RECS;
+	eventLog->startNs = nowNs();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	eventLog->startRealNs = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	eventRecs = (struct eventRec *) (eventLog + 1);
+	eventTail = 0;
+
+	snprintf(prevName, sizeof(prevName), "%s.prev", path);
+	rename(path, prevName);
+	eventFile = MAP_FAILED;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1)
+	{
+		if (ftruncate(fd, eventLogLen) == 0)
+			eventFile = mmap(0, eventLogLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (eventFile == MAP_FAILED)
+	{
+		printf("*** ERROR: could not map event log %s, keeping events in memory only\n", path);
+		eventFile = NULL;
+		return 0;
+	}
+	memcpy(eventFile, eventLog, sizeof(struct eventLogHeader));
+	eventFileRecs = (struct eventRec *) (eventFile + 1);
+	return 0;
+}
+
+//____________________
+void closeEventLog(void)
+{
+	if (eventFile != NULL)
+	{
+		msync(eventFile, eventLogLen, MS_SYNC);
+		munmap(eventFile, eventLogLen);
+		eventFile = NULL;
+	}
+	if (eventLog == NULL)
+		return;
+	munmap(eventLog, eventLogLen);
+	eventLog = NULL;
+}
+
+//____________________
+void logEvent(unsigned short code, unsigned char device, unsigned int block, unsigned char status, unsigned int arg)
+{
+	// Bus thread's printf: claim a slot, fill it, publish with seq
+	// Slot seq is 0 while being written so a reader can't take half a record
+	struct eventRec *rec;
+	unsigned int pos;
+
+	if (eventLog == NULL)
+		return;
+	pos = atomic_fetch_add_explicit(&eventLog->head, 1, memory_order_relaxed);
+	rec = &eventRecs[pos & (EVENT_RECS - 1)];
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	rec->ns		= nowNs();
+	rec->block	= block;
+	rec->arg	= arg;
+	rec->code	= code;
+	rec->device	= device;
+	rec->status	= status;
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+}
+
+//____________________
+unsigned int drainEvents(struct worker *w)
+{
+	// Log worker: format everything published since last call and copy it
+	//  to the file
+	// Returns number formatted, records overwritten before we got to them are counted dropped
+	struct eventRec rec, *slot;
+	unsigned int head, n;
+
+	if (eventLog == NULL)
+		return 0;
+	head = atomic_load_explicit(&eventLog->head, memory_order_acquire);
+	if (head - eventTail > EVENT_RECS)
+	{
+		atomic_fetch_add(&eventLog->dropped, head - eventTail - EVENT_RECS);
+		eventTail = head - EVENT_RECS;
+	}
+
+	n = 0;
+	while (eventTail != head)
+	{
+		slot = &eventRecs[eventTail & (EVENT_RECS - 1)];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != eventTail + 1)
+			break;									// still being written, or lapped: next call sorts it out
+		rec.ns		= slot->ns;
+		rec.block	= slot->block;
+		rec.arg		= slot->arg;
+		rec.code	= slot->code;
+		rec.device	= slot->device;
+		rec.status	= slot->status;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != eventTail + 1)
+			break;									// overwritten while copying
+		workerDone(w, rec.ns);
+		if (rec.code < eNUM_EVENTS && eventTypes[rec.code].console)
+			formatEvent(&rec);
+		if (eventFile != NULL)
+		{
+			slot = &eventFileRecs[eventTail & (EVENT_RECS - 1)];
+			atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			slot->ns		= rec.ns;
+			slot->block		= rec.block;
+			slot->arg		= rec.arg;
+			slot->code		= rec.code;
+			slot->device	= rec.device;
+			slot->status	= rec.status;
+			atomic_store_explicit(&slot->seq, eventTail + 1, memory_order_release);
+		}
+		eventTail++;
+		n++;
+	}
+	if (eventFile != NULL)
+	{
+		atomic_store(&eventFile->head, eventTail);
+		atomic_store(&eventFile->dropped, atomic_load(&eventLog->dropped));
+	}
+	return n;
+}
+
+//____________________
+void formatEvent(const struct eventRec *rec)
+{
+	// Same text the bus thread used to printf
+	unsigned int i;
+
+	switch (rec->code)
+	{
+		case eEV_ERROR1:
+			printf("*** ERROR1 detected:\n");
+			break;
+		case eEV_ERROR2:
+		case eEV_ERROR3:
+			printf("*** ERROR%d detected:\n", rec->code == eEV_ERROR2 ? 2 : 3);
+			printf("\tMy IDs: 0x%X\t0x%X\n", rec->arg >> 8, rec->arg & 0xFF);
+			printf("\tDEST = 0x%X\n", rec->device);
+			printf("\tCMD  = 0x%X\n", rec->status);
+			break;
+		case eEV_ERROR_UNKNOWN:
+			printf("*** Unknown ERROR %d\n", rec->status);
+			break;
+		case eEV_ID_CHANGE:
+			printf("\tspID%d changed to 0x%X\n", rec->status, rec->device);
+			break;
+		case eEV_RESET:
+			printf("--- Reset %d \n", rec->arg >> 16);
+			printf("\tspID1=0x%X spID2=0x%X\n", (rec->arg >> 8) & 0xFF, rec->arg & 0xFF);
+			break;
+		case eEV_DATA_WRITTEN:
+			printf("[0x%X] CS GOOD\n", rec->device);
+			break;
+		case eEV_BAD_DATA_CS:
+			printf("*** [0x%X] Bad checksum in received datablock %d\n", rec->device, rec->block);
+			break;
+		case eEV_STATUS:
+			printf("[0x%X] Std Status: %d\n", rec->device, rec->status);
+			break;
+		case eEV_UNSUP_STATCODE:
+			printf("*** [0x%X] Unsupported statCode: 0x%X\n", rec->device, rec->status);
+			break;
+		case eEV_READBLK:
+			printf("[0x%X] RB: %d\n", rec->device, rec->block);
+			break;
+		case eEV_EXTREADBLK:
+			printf("[0x%X] ExtRB: %d\n", rec->device, rec->block);
+			break;
+		case eEV_BAD_READ_BLK:
+			printf("*** [0x%X] Bad Read BlkNum: %d\n", rec->device, rec->block);
+			break;
+		case eEV_WRITEBLK:
+			printf("[0x%X] WB: %d\n", rec->device, rec->block);
+			break;
+		case eEV_EXTWRITEBLK:
+			printf("[0x%X] ExtWB: %d\n", rec->device, rec->block);
+			break;
+		case eEV_BAD_WRITE_BLK:
+			printf("*** [0x%X] Bad Write BlkNum: %d\n", rec->device, rec->block);
+			break;
+		case eEV_CONTROL:
+			printf("[0x%X] Control: 0x%X\n", rec->device, rec->status);
+			break;
+		case eEV_UNEXPECTED_CMD:
+			printf("*** [0x%X] Unexpected cmdNum= 0x%X\n", rec->device, rec->status);
+			break;
+		case eEV_WRONG_DEST:
+			printf("*** destID [0x%X] != spID1 [0x%X] or spID2 [0x%X]\n", rec->device, rec->arg >> 8, rec->arg & 0xFF);
+			break;
+		case eEV_UNEXPECTED_STATUS:
+			printf("*** Unexpected pruStatus: %d\n", rec->status);
+			break;
+		case eEV_BAD_CMD_CS:
+			printf("*** checkCmdChecksum() reports BAD checksum\n");
+			break;
+		case eEV_PACKET_BYTES:
+			for (i=0; i<rec->status && i<4; i++)
+				printf("\t%d 0x%X\n", rec->block + i, (rec->arg >> (i * 8)) & 0xFF);
+			break;
+		case eEV_PACKET_END:
+			printf("\n");
+			break;
+		case eEV_CACHE_HIT:
+			printf("[0x%X] RB: %d from PRU cache\n", rec->device, rec->block);
+			break;
+		case eEV_PRU_STATUS:
+			printf("STATUS: %d, DIB: %d from PRU\n", rec->block, rec->arg);
+			break;
+		case eEV_DDR_READ:
+			printf("[0x%X] RB: %d from DDR\n", rec->device, rec->block);
+			break;
+		case eEV_WRITE_DATA:
+			printf("[0x%X] %s: %d, CS GOOD\n", rec->device, rec->status == 0x82 ? "WB" : "ExtWB", rec->block);
+			break;
+		case eEV_TX_UNDERRUN:
+			printf("*** [0x%X] PRU caught up with streamed packet, cut short (%u so far)\n", rec->device, rec->arg);
+			break;
+	}
+}
+
+//____________________
+int dumpEventLog(const char *path)
+{
+	// -E: print every record still in a saved event log, oldest first
+	struct eventLogHeader *log;
+	struct eventRec *recs, *rec;
+	unsigned int head, pos, cnt;
+	size_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		printf("*** ERROR: could not open %s\n", path);
+		return -1;
+	}
+	len = sizeof(struct eventLogHeader) + EVENT_RECS * sizeof(struct eventRec);
+	log = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (log == MAP_FAILED)
+	{
+		printf("*** ERROR: could not map %s\n", path);
+		return -1;
+	}
+	if (memcmp(log->magic, EVENT_MAGIC, sizeof(log->magic)) != 0 ||
+		log->recSize != sizeof(struct eventRec) || log->numRecs != EVENT_RECS)
+	{
+		printf("*** ERROR: %s is not an event log from this version\n", path);
+		munmap(log, len);
+		return -1;
+	}
+
+	recs = (struct eventRec *) (log + 1);
+	head = atomic_load(&log->head);
+	cnt = head < EVENT_RECS ? head : EVENT_RECS;
+	printf("--- %s: %u events, %u shown, %u dropped by log worker\n", path, head, cnt, atomic_load(&log->dropped));
+	for (pos = head - cnt; pos != head; pos++)
+	{
+		rec = &recs[pos & (EVENT_RECS - 1)];
+		if (atomic_load(&rec->seq) != pos + 1)
+		{
+			printf("%10u  (incomplete)\n", pos);
+			continue;
+		}
+		printf("%10u %12.6f  %-12s dev=0x%02X blk=%-6u st=0x%02X arg=0x%08X\n", pos,
+			(rec->ns - log->startNs) / 1e9, rec->code < eNUM_EVENTS ? eventTypes[rec->code].name : "?",
+			rec->device, rec->block, rec->status, rec->arg);
+	}
+	munmap(log, len);
+	return 0;
+}
+
+//____________________
+struct traceHeader *mapTraceFile(const char *name, unsigned int seq)
+{
+	// New trace file, header filled in, no records yet
+	// Returns NULL if it can't be made
+	struct traceHeader *hdr;
+	struct timespec ts;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return NULL;
+	hdr = MAP_FAILED;
+	if (ftruncate(fd, TRACE_FILE_LEN) == 0)
+		hdr = mmap(0, TRACE_FILE_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return NULL;
+
+	memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+	hdr->fileLen = TRACE_FILE_LEN;
+	hdr->recSize = sizeof(struct traceRec);
+	hdr->startNs = nowNs();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr->startRealNs = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	hdr->seq = seq;
+	hdr->dropped = 0;
+	hdr->records = 0;
+	atomic_store_explicit(&hdr->used, 0, memory_order_release);
+	return hdr;
+}
+
+//____________________
+void rotateTraceFiles(void)
+{
+	// file -> .1 -> .2 ..., oldest goes
+	char from[256], to[256];
+	unsigned int i;
+
+	for (i=TRACE_FILES-1; i>0; i--)
+	{
+		if (i == 1)
+			snprintf(from, sizeof(from), "%s", tracePath);
+		else
+			snprintf(from, sizeof(from), "%s.%u", tracePath, i-1);
+		snprintf(to, sizeof(to), "%s.%u", tracePath, i);
+		rename(from, to);
+	}
+}
+
+//____________________
+int openTrace(const char *path)
+{
+	// Last run's files move down the rotation
+	// Ring is locked and touched here, before the bus thread starts
+	if (strcmp(path, "-") == 0)
+		return 0;
+	traceRing = mmap(0, TRACE_RING_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (traceRing == MAP_FAILED)
+	{
+		traceRing = NULL;
+		printf("*** ERROR: could not map packet trace ring, not tracing\n");
+		return -1;
+	}
+	if (mlock(traceRing, TRACE_RING_LEN) != 0)
+		printf("*** mlock of packet trace ring failed: %s\n", strerror(errno));
+	rotateTraceFiles();
+	traceSeq = 0;
+	trace = mapTraceFile(path, traceSeq++);
+	if (trace == NULL)
+	{
+		printf("*** ERROR: could not map packet trace %s, not tracing\n", path);
+		munmap(traceRing, TRACE_RING_LEN);
+		traceRing = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+//____________________
+void tracePacket(unsigned char dest, unsigned char type, unsigned char cmd, unsigned int block,
+	unsigned char device, char dataReply, unsigned char flags)
+{
+	// Bus thread, after GO/SKIP: packet A2 sent and what we answered
+	// PRU leaves the received packet alone until A2 has our reply
+	// A data reply is kept as the block it came from, PRU may encode it itself
+	// A record never wraps: if it won't fit before the end of the ring, the
+	//  rest is skipped, marked with TR_RING_SKIP if a record header fits
+	struct traceRec *rec;
+	unsigned char *bytes;
+	unsigned int rxLen, txLen, head, ofs, room, skip, odd, i;
+
+	if (traceRing == NULL)
+		return;
+	if (flags & TR_ERROR1)
+		rxLen = 28;										// like printRcvdPacket()
+	else
+	{
+		odd = rcvdPacketPtr[12] & 0x7F;
+		rxLen = 14 + (odd ? odd + 1 : 0) + (rcvdPacketPtr[13] & 0x7F) * 8 + 3;
+		if (rxInfoPtr[RX_INFO_CS] != eRX_CS_GOOD)
+			flags |= TR_RX_BAD_CS;
+	}
+	if (rxLen > TRACE_MAX_WIRE)
+	{
+		rxLen = TRACE_MAX_WIRE;
+		flags |= TR_TRUNCATED;
+	}
+	txLen = 0;
+	if ((flags & TR_ERROR1) == 0 && releaseWait != WAIT_SKIP)
+		txLen = dataReply ? 512 : TRACE_STAT_MAX;		// reply trimmed at end marker below
+
+	head = atomic_load_explicit(&traceHead, memory_order_relaxed);
+	ofs = head & (TRACE_RING_LEN - 1);
+	room = TRACE_RING_LEN - ofs;
+	skip = (room < sizeof(struct traceRec) + rxLen + txLen + 8) ? room : 0;
+	if (TRACE_RING_LEN - (head - atomic_load_explicit(&traceTail, memory_order_acquire)) <
+		skip + sizeof(struct traceRec) + rxLen + txLen + 8)
+	{
+		atomic_fetch_add_explicit(&traceDropped, 1, memory_order_relaxed);
+		return;
+	}
+	if (skip != 0)
+	{
+		if (room >= sizeof(struct traceRec))
+		{
+			rec = (struct traceRec *) (traceRing + ofs);
+			rec->len = room;
+			rec->flags = TR_RING_SKIP;
+		}
+		head += skip;
+		ofs = 0;
+	}
+
+	rec = (struct traceRec *) (traceRing + ofs);
+	bytes = (unsigned char *) (rec + 1);
+	memcpy(bytes, rcvdPacketPtr, rxLen);
+	if (dataReply && txLen != 0)
+	{
+		memcpy(bytes + rxLen, theImages[device][block], 512);
+		flags |= TR_TX_DATA;
+	}
+	else
+	{
+		for (i=0; i<txLen; i++)
+		{
+			bytes[rxLen + i] = respPacketPtr[i];
+			if (bytes[rxLen + i] == 0x00)
+				break;
+		}
+		txLen = i;
+	}
+
+	if (flags & TR_ERROR1)
+	{
+		rec->ns = nowNs();
+		rec->turnNs = 0;
+		rec->wait = WAIT_SET;
+	}
+	else
+	{
+		rec->ns = rcvdNs;
+		rec->turnNs = releaseNs - rcvdNs;
+		rec->wait = releaseWait;
+	}
+	rec->block	= block;
+	rec->rxLen	= rxLen;
+	rec->txLen	= txLen;
+	rec->len	= (sizeof(struct traceRec) + rxLen + txLen + 7) & ~7;
+	rec->dest	= dest;
+	rec->type	= type;
+	rec->cmd	= cmd;
+	rec->flags	= flags;
+	atomic_store_explicit(&traceHead, head + rec->len, memory_order_release);
+}
+
+//____________________
+unsigned int traceService(void)
+{
+	// Log worker: copy records bus thread published to the file, rotate it
+	//  when full. Returns records copied
+	struct traceRec *rec;
+	struct traceHeader *next;
+	unsigned int head, tail, ofs, used, n;
+
+	if (traceRing == NULL)
+		return 0;
+	head = atomic_load_explicit(&traceHead, memory_order_acquire);
+	tail = atomic_load_explicit(&traceTail, memory_order_relaxed);
+	n = 0;
+	while ((tail != head) && (trace != NULL))
+	{
+		ofs = tail & (TRACE_RING_LEN - 1);
+		rec = (struct traceRec *) (traceRing + ofs);
+		if (TRACE_RING_LEN - ofs < sizeof(struct traceRec))
+		{
+			tail += TRACE_RING_LEN - ofs;				// skipped, no room for a marker
+			continue;
+		}
+		if (rec->flags & TR_RING_SKIP)
+		{
+			tail += rec->len;
+			continue;
+		}
+
+		used = atomic_load_explicit(&trace->used, memory_order_relaxed);
+		if (sizeof(struct traceHeader) + used + rec->len > TRACE_FILE_LEN)
+		{
+			msync(trace, TRACE_FILE_LEN, MS_ASYNC);
+			munmap(trace, TRACE_FILE_LEN);
+			rotateTraceFiles();
+			next = mapTraceFile(tracePath, traceSeq++);
+			if (next == NULL)
+				printf("*** ERROR: could not map packet trace %s, not tracing\n", tracePath);
+			else
+			{
+				next->dropped = atomic_load_explicit(&traceDropped, memory_order_relaxed);
+				next->startRealNs -= next->startNs - rec->ns;	// starts at its first record, not at map
+				next->startNs = rec->ns;
+			}
+			trace = next;
+			continue;
+		}
+		memcpy((unsigned char *) (trace + 1) + used, rec, rec->len);
+		trace->records++;
+		atomic_store_explicit(&trace->used, used + rec->len, memory_order_release);
+		atomic_fetch_add_explicit(&traceRecords, 1, memory_order_relaxed);
+		tail += rec->len;
+		n++;
+	}
+	atomic_store_explicit(&traceTail, (trace != NULL) ? tail : head, memory_order_release);
+	return n;
+}
+
+//____________________
+void closeTrace(void)
+{
+	// Bus thread and workers stopped, copy what's left
+	if (traceRing == NULL)
+		return;
+	traceService();
+	if (trace != NULL)
+	{
+		msync(trace, TRACE_FILE_LEN, MS_SYNC);
+		munmap(trace, TRACE_FILE_LEN);
+		trace = NULL;
+	}
+	munmap(traceRing, TRACE_RING_LEN);
+	traceRing = NULL;
+}
+
+//____________________
+struct traceHeader *readTrace(const char *path, unsigned int *used)
+{
+	// Map a trace file read only, used = record bytes in it
+	// Returns NULL if it isn't one, caller unmaps TRACE_FILE_LEN
+	struct traceHeader *hdr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		printf("*** ERROR: could not open %s\n", path);
+		return NULL;
+	}
+	hdr = mmap(0, TRACE_FILE_LEN, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+	{
+		printf("*** ERROR: could not map %s\n", path);
+		return NULL;
+	}
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->fileLen != TRACE_FILE_LEN || hdr->recSize != sizeof(struct traceRec))
+	{
+		printf("*** ERROR: %s is not a packet trace from this version\n", path);
+		munmap(hdr, TRACE_FILE_LEN);
+		return NULL;
+	}
+
+	*used = atomic_load(&hdr->used);
+	if (*used > TRACE_FILE_LEN - sizeof(struct traceHeader))
+		*used = 0;
+	return hdr;
+}
+
+//____________________
+int dumpTrace(const char *path, const char *filter)
+{
+	// -D: print records in a trace file, -F picks some
+	// Filter: comma separated dev=0x81 cmd=0x81 blk=n or n-m slow=us err hex
+	static const char *cmdNames[10] = {"STATUS", "READBLK", "WRITEBLK", "FORMAT", "CONTROL",
+		"INIT", "OPEN", "CLOSE", "READ", "WRITE"};
+	struct traceHeader *hdr;
+	struct traceRec *rec;
+	unsigned char *bytes;
+	unsigned int pos, used, n, shown, i, seg, len, dev, cmd, blkLo, blkHi, slowUs, errOnly, hex;
+	char spec[256], *tok, *save, name[16], when[32];
+	const unsigned char *p;
+	time_t start;
+
+	dev = 0;
+	cmd = 0;
+	blkLo = 0;
+	blkHi = 0xFFFFFFFF;
+	slowUs = 0;
+	errOnly = 0;
+	hex = 0;
+	snprintf(spec, sizeof(spec), "%s", filter);
+	for (tok = strtok_r(spec, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+	{
+		if (strncmp(tok, "dev=", 4) == 0)
+			dev = strtoul(tok + 4, NULL, 0);
+		else if (strncmp(tok, "cmd=", 4) == 0)
+			cmd = strtoul(tok + 4, NULL, 0);
+		else if (strncmp(tok, "blk=", 4) == 0)
+		{
+			if (sscanf(tok + 4, "%u-%u", &blkLo, &blkHi) == 1)
+				blkHi = blkLo;
+		}
+		else if (strncmp(tok, "slow=", 5) == 0)
+			slowUs = strtoul(tok + 5, NULL, 0);
+		else if (strcmp(tok, "err") == 0)
+			errOnly = 1;
+		else if (strcmp(tok, "hex") == 0)
+			hex = 1;
+		else
+		{
+			printf("*** ERROR: unknown trace filter %s\n", tok);
+			return -1;
+		}
+	}
+
+	hdr = readTrace(path, &used);
+	if (hdr == NULL)
+		return -1;
+	start = hdr->startRealNs / 1000000000ULL;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&start));
+	printf("--- %s: file %u of run, started %s, %u records, %u dropped before it\n", path, hdr->seq, when,
+		hdr->records, hdr->dropped);
+	printf("%8s %12s  %4s %4s %-11s %8s %9s %4s %4s %4s  flags\n", "#", "time s", "dest", "type", "cmd",
+		"block", "turn us", "wait", "rx", "tx");
+
+	n = 0;
+	shown = 0;
+	for (pos = 0; pos + sizeof(struct traceRec) <= used; pos += rec->len, n++)
+	{
+		rec = (struct traceRec *) ((unsigned char *) (hdr + 1) + pos);
+		if (rec->len < sizeof(struct traceRec) || pos + rec->len > used)
+		{
+			printf("%8u  (bad record length %u)\n", n, rec->len);
+			break;
+		}
+		if ((dev != 0 && rec->dest != dev) || (cmd != 0 && (rec->type != 0x80 || rec->cmd != cmd)) ||
+			(rec->turnNs < slowUs * 1000ULL) || (errOnly && (rec->flags & (TR_RX_BAD_CS | TR_ERROR1)) == 0))
+			continue;
+		if (((blkLo != 0) || (blkHi != 0xFFFFFFFF)) && ((rec->block < blkLo) || (rec->block > blkHi)))
+			continue;
+
+		if (rec->flags & TR_ERROR1)
+			snprintf(name, sizeof(name), "ERROR1");
+		else if (rec->type == 0x82)
+			snprintf(name, sizeof(name), "data");
+		else if ((rec->cmd & 0xBF) >= 0x80 && (rec->cmd & 0xBF) <= 0x89)
+			snprintf(name, sizeof(name), "%s%s", rec->cmd & 0x40 ? "X" : "", cmdNames[(rec->cmd & 0xBF) - 0x80]);
+		else
+			snprintf(name, sizeof(name), "0x%02X", rec->cmd);
+		printf("%8u %12.6f  0x%02X 0x%02X %-11s ", n, (rec->ns - hdr->startNs) / 1e9, rec->dest, rec->type, name);
+		if (rec->type == 0x82 || ((rec->cmd & 0xBF) == 0x81) || ((rec->cmd & 0xBF) == 0x82))
+			printf("%8u", rec->block);
+		else
+			printf("%8s", "-");
+		printf(" %9.1f %4u %4u %4u  %s%s%s%s\n", rec->turnNs / 1e3, rec->wait, rec->rxLen, rec->txLen,
+			rec->flags & TR_RX_BAD_CS ? "badCS " : "", rec->flags & TR_TX_DATA ? "block " : "",
+			rec->flags & TR_TRUNCATED ? "cut " : "", rec->flags & TR_ERROR1 ? "ERROR1" : "");
+		if (hex)
+		{
+			bytes = (unsigned char *) (rec + 1);
+			for (seg=0; seg<2; seg++)
+			{
+				p = (seg == 0) ? bytes : bytes + rec->rxLen;
+				len = (seg == 0) ? rec->rxLen : rec->txLen;
+				for (i=0; i<len; i++)
+				{
+					if (i == 0)
+						printf("\t%s", seg == 0 ? "rx" : "tx");
+					else if (i % 16 == 0)
+						printf("\n\t  ");
+					printf(" %02X", p[i]);
+				}
+				if (len != 0)
+					printf("\n");
+			}
+		}
+		shown++;
+	}
+	printf("--- %u records, %u shown\n", n, shown);
+	munmap(hdr, TRACE_FILE_LEN);
+	return 0;
+}
+
+//____________________
+void startWorkers(void)
+{
+	unsigned int i;
+
+	mpscInit(&logQueue,		 1024, sizeof(struct logEntry));
+	spscInit(&storageQueue,	 1024, sizeof(struct storageOp));
+	spscInit(&statsQueue,	 1024, sizeof(struct statSample));
+	spscInit(&prefetchQueue, 256,  sizeof(struct prefetchOp));
+	spscInit(&cacheFillQueue, 64,  sizeof(struct cacheFillOp));
+
+	workersRunning = 1;
+	logRunning = 1;
+	for (i=0; i<eNUM_WORKERS; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, workers[i].func, &workers[i]) != 0)
+			printf("*** ERROR: could not start %s worker\n", workers[i].name);
+	}
+}
+
+//____________________
+void stopWorkers(void)
+{
+	// Workers drain their queues before exiting
+	// Log worker goes last so it prints what the others logged
+	unsigned int i;
+
+	workersRunning = 0;
+	for (i=0; i<eNUM_WORKERS; i++)
+	{
+		if (i != eLOG_WORKER)
+			pthread_join(workers[i].thread, NULL);
+	}
+	logRunning = 0;
+	pthread_join(workers[eLOG_WORKER].thread, NULL);
+}
+
+//____________________
+void workerDone(struct worker *w, unsigned long long enqNs)
+{
+	unsigned long long lag;
+
+	lag = nowNs() - enqNs;
+	w->lagSumNs += lag;
+	if (lag > w->lagMaxNs)
+		w->lagMaxNs = lag;
+	w->done++;
+}
+
+//____________________
+void *logWorker(void *arg)
+{
+	// Prints text messages and formats command path events
+	struct worker *w = arg;
+	struct logEntry entry;
+	unsigned int n;
+	unsigned long long lastSyncNs, now;
+
+	lastSyncNs = nowNs();
+	while (1)
+	{
+		n = drainEvents(w) + traceService();
+		if (mpscPop(&logQueue, &entry) == 0)
+		{
+			workerDone(w, entry.ns);
+			fputs(entry.text, stdout);
+			n++;
+		}
+		if (n != 0)
+			continue;
+		if (!logRunning)
+			break;
+		fflush(stdout);
+		now = nowNs();
+		if (eventFile != NULL && now - lastSyncNs >= FLUSH_INTERVAL_NS)
+		{
+			msync(eventFile, eventLogLen, MS_ASYNC);
+			lastSyncNs = now;
+		}
+		usleep(WORKER_IDLE_US);
+	}
+	fflush(stdout);
+	return NULL;
+}
+
+//____________________
+void *storageWorker(void *arg)
+{
+	// Writes blocks A2 changed to image in Saved folder
+	// First change to an image saves the whole image, then only changed blocks
+	struct worker *w = arg;
+	struct storageOp op;
+	int savedFd[2] = {-1, -1};						// -1 = not saved yet, -2 = save failed
+	unsigned char dirty[2] = {0, 0};
+	unsigned long long lastFlushNs;
+	char saveName[64];
+	unsigned int i;
+
+	lastFlushNs = nowNs();
+	while (1)
+	{
+		if (spscPop(&storageQueue, &op) == 0)
+		{
+			workerDone(w, op.ns);
+#ifdef PRU_SIM
+			continue;									// images are simFillImages() noise, not the Saved ones
+#endif
+			if (savedFd[op.device] == -1)
+			{
+				savedImageName(op.device, saveName);
+				logMsg("FYI - %s was modified. Saving to Saved folder\n", saveName);
+				savedFd[op.device] = saveDiskImage(op.device, saveName);
+				if (savedFd[op.device] < 0)
+					savedFd[op.device] = -2;
+			}
+			else if (savedFd[op.device] >= 0)
+			{
+				if (pwrite(savedFd[op.device], theImages[op.device][op.block], 512, (off_t) op.block * 512) != 512)
+					logMsg("*** Problem writing block %u to saved image %u\n", op.block, op.device + 1);
+			}
+			dirty[op.device] = 1;
+		}
+		else if (!workersRunning)
+			break;
+		else
+			usleep(WORKER_IDLE_US);
+
+		if (nowNs() - lastFlushNs > FLUSH_INTERVAL_NS)
+		{
+			for (i=0; i<2; i++)
+			{
+				if (dirty[i] && (savedFd[i] >= 0))
+					fdatasync(savedFd[i]);
+				dirty[i] = 0;
+			}
+			lastFlushNs = nowNs();
+		}
+	}
+
+	for (i=0; i<2; i++)
+	{
+		if (savedFd[i] >= 0)
+		{
+			fdatasync(savedFd[i]);
+			close(savedFd[i]);
+			savedImageName(i, saveName);
+			logMsg("FYI - %s saved\n", saveName);
+		}
+	}
+	return NULL;
+}
+
+//____________________
+void *statsWorker(void *arg)
+{
+	// Aggregates PRU timing and per-command latency, samples bus thread
+	//  CPU time per poller mode, makes -M text for the metrics thread
+	struct worker *w = arg;
+	struct statSample sample;
+	struct timespec ts;
+	unsigned long long busCpu, lastBusCpu, lastSampleNs;
+	unsigned int turnaround;
+
+	lastBusCpu = 0;
+	lastSampleNs = nowNs();
+	perfLastSeq = sharedMemPtr[PERF_OFS + PERF_SEQ] & ~1;
+	while (1)
+	{
+		samplePerf();
+		metricsSnapshot();
+
+		if (spscPop(&statsQueue, &sample) == 0)
+		{
+			workerDone(w, sample.ns);
+			if (sample.what == eSAMPLE_CMD)
+			{
+				histAdd(&cmdHist[sample.unit][sample.kind], sample.turnNs);
+				leAdd(cmdLe[sample.unit][sample.kind], sample.turnNs);
+			}
+			else
+			{
+				turnaround = sample.hostWait * (1000 / PRU_CYCLES_PER_US);
+				addTimingSample(&hostWaitStat, sample.hostWait);
+				histAdd(&pollStats[sample.mode].turnaround, turnaround);
+				histAdd(&allTurnaround, turnaround);
+
+				if (sample.goStart != 0)				// 0 = WAIT_SKIP, nothing sent
+				{
+					addTimingSample(&goStartStat, sample.goStart);
+					addTimingSample(&goFirstBitStat, sample.goFirstBit);
+				}
+			}
+		}
+		else if (!workersRunning)
+			break;
+		else
+			usleep(WORKER_IDLE_US);
+
+		if (busCpuClockValid && (nowNs() - lastSampleNs > STATS_SAMPLE_NS))
+		{
+			clock_gettime(busCpuClock, &ts);
+			busCpu = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			if (lastBusCpu != 0)
+				pollStats[pollMode].cpuNs += busCpu - lastBusCpu;
+			lastBusCpu = busCpu;
+			lastSampleNs = nowNs();
+		}
+	}
+	return NULL;
+}
+
+//____________________
+int openMetrics(const char *spec)
+{
+	// -M: listening socket stats worker looks at, non-blocking
+	// Digits, dots and a colon are [addr:]port, anything else is a path
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	const char *colon, *port;
+	char addr[32];
+	int one, ok;
+
+	if (spec == NULL)
+		return 0;
+	ok = 0;
+	if (strspn(spec, "0123456789.:") == strlen(spec))
+	{
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		port = spec;
+		colon = strrchr(spec, ':');
+		if (colon != NULL)
+		{
+			snprintf(addr, sizeof(addr), "%.*s", (int) (colon - spec), spec);
+			if (inet_pton(AF_INET, addr, &in.sin_addr) != 1)
+			{
+				printf("*** ERROR: bad metrics address %s\n", spec);
+				return -1;
+			}
+			port = colon + 1;
+		}
+		in.sin_port = htons(strtoul(port, NULL, 10));
+		metricsHttp = 1;
+		metricsFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (metricsFd != -1)
+		{
+			one = 1;
+			setsockopt(metricsFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			ok = (bind(metricsFd, (struct sockaddr *) &in, sizeof(in)) == 0) && (listen(metricsFd, 4) == 0);
+		}
+	}
+	else if (strlen(spec) < sizeof(un.sun_path))
+	{
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, spec);
+		unlink(spec);									// left by a run that didn't shut down
+		metricsHttp = 0;
+		metricsFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (metricsFd != -1)
+			ok = (bind(metricsFd, (struct sockaddr *) &un, sizeof(un)) == 0) && (listen(metricsFd, 4) == 0);
+	}
+	else
+		errno = ENAMETOOLONG;
+
+	if (!ok)
+	{
+		printf("*** ERROR: metrics socket %s: %s\n", spec, strerror(errno));
+		if (metricsFd != -1)
+			close(metricsFd);
+		metricsFd = -1;
+		return -1;
+	}
+	printf("--- Metrics on %s%s\n", metricsHttp ? "http://" : "", spec);
+	return 0;
+}
+
+//____________________
+void *metricsThread(void *arg)
+{
+	// Waits for scrapers so a slow one holds up nobody else
+	struct pollfd pfd;
+
+	(void) arg;
+	pfd.fd = metricsFd;
+	pfd.events = POLLIN;
+	while (running)
+	{
+		if (poll(&pfd, 1, 100) > 0)
+			metricsService();
+	}
+	return NULL;
+}
+
+//____________________
+void metricsService(void)
+{
+	// Metrics thread: answer one waiting scraper, if any. HTTP has its request
+	//  read first, a Unix socket just gets the text. Text comes from the
+	//  stats worker, a scraper gets METRICS_IO_MS in all
+	struct timeval tv;
+	char req[1024], head[160];
+	unsigned int got, sent, asked;
+	unsigned long long start;
+	ssize_t n;
+	int fd;
+
+	fd = accept(metricsFd, NULL, NULL);
+	if (fd == -1)
+		return;
+	tv.tv_sec = 0;
+	tv.tv_usec = METRICS_IO_MS * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	start = nowNs();
+
+	if (metricsHttp)
+	{
+		got = 0;
+		req[0] = '\0';
+		while ((got < sizeof(req) - 1) && (strstr(req, "\r\n\r\n") == NULL) &&
+			(nowNs() - start < METRICS_IO_MS * 1000000ULL))
+		{
+			n = recv(fd, req + got, sizeof(req) - 1 - got, 0);
+			if (n <= 0)
+				break;
+			got += n;
+			req[got] = '\0';
+		}
+	}
+
+	asked = atomic_fetch_add_explicit(&metricsAsked, 1, memory_order_release) + 1;
+	while ((atomic_load_explicit(&metricsMade, memory_order_acquire) != asked) &&
+		(nowNs() - start < METRICS_IO_MS * 1000000ULL))
+		usleep(1000);
+	if (atomic_load_explicit(&metricsMade, memory_order_acquire) != asked)
+	{
+		close(fd);										// stats worker busy or gone
+		return;
+	}
+
+	n = 0;
+	if (metricsHttp)
+	{
+		snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %u\r\nConnection: close\r\n\r\n", metricsBodyLen);
+		n = send(fd, head, strlen(head), MSG_NOSIGNAL);
+	}
+	for (sent = 0; (n >= 0) && (sent < metricsBodyLen) && (nowNs() - start < METRICS_IO_MS * 1000000ULL); sent += n)
+	{
+		n = send(fd, metricsBody + sent, metricsBodyLen - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+	}
+	close(fd);
+}
+
+//____________________
+void metricsSnapshot(void)
+{
+	// Stats worker: format the text if the metrics thread is waiting for it
+	// Metrics thread doesn't touch metricsBody until metricsMade says so
+	unsigned int asked;
+
+	asked = atomic_load_explicit(&metricsAsked, memory_order_acquire);
+	if (asked == atomic_load_explicit(&metricsMade, memory_order_relaxed))
+		return;
+	metricsBodyLen = formatMetrics(metricsBody, sizeof(metricsBody));
+	atomic_store_explicit(&metricsMade, asked, memory_order_release);
+}
+
+//____________________
+void closeMetrics(void)
+{
+	if (metricsFd == -1)
+		return;
+	if (metricsStarted)
+		pthread_join(metricsThreadId, NULL);			// sees running clear within 100 ms
+	metricsStarted = 0;
+	close(metricsFd);
+	metricsFd = -1;
+	if (!metricsHttp)
+		unlink(metricsSpec);
+}
+
+//____________________
+void leAdd(unsigned int *le, unsigned int value)
+{
+	// Counts value in the first leNs bucket it fits, none past the last
+	unsigned int i;
+
+	for (i=0; i<LE_BUCKETS; i++)
+	{
+		if (value <= leNs[i])
+		{
+			le[i]++;
+			return;
+		}
+	}
+}
+
+//____________________
+unsigned int formatMetrics(char *buf, unsigned int size)
+{
+	// Prometheus text format 0.0.4, series with samples only
+	// Buckets are cumulative exact counts on the fixed leNs ladder, so
+	//  scrapes can be aggregated
+	// Returns bytes in buf
+	static const char *errorNames[eERROR_UNDERRUN + 1] = {"", "ERROR1", "ERROR2", "ERROR3", "underrun"};
+	struct latHist *hist;
+	unsigned int unit, kind, i, len, n;
+
+	len = 0;
+	metricsAppend(buf, size, &len, "# HELP smartport_cmd_latency_seconds eRCVDPACK seen to GO/SKIP written, packets the Controller answered\n"
+		"# TYPE smartport_cmd_latency_seconds histogram\n");
+	for (unit=0; unit<CMD_UNITS; unit++)
+	{
+		for (kind=0; kind<eNUM_CK; kind++)
+		{
+			hist = &cmdHist[unit][kind];
+			if (hist->cnt == 0)
+				continue;
+			n = 0;
+			for (i=0; i<LE_BUCKETS; i++)
+			{
+				n += cmdLe[unit][kind][i];
+				metricsAppend(buf, size, &len, "smartport_cmd_latency_seconds_bucket{unit=\"%s\",cmd=\"%s\",le=\"%g\"} %u\n",
+					cmdUnitNames[unit], cmdKindNames[kind], leNs[i] / 1e9, n);
+			}
+			metricsAppend(buf, size, &len, "smartport_cmd_latency_seconds_bucket{unit=\"%s\",cmd=\"%s\",le=\"+Inf\"} %u\n"
+				"smartport_cmd_latency_seconds_sum{unit=\"%s\",cmd=\"%s\"} %.9f\n"
+				"smartport_cmd_latency_seconds_count{unit=\"%s\",cmd=\"%s\"} %u\n",
+				cmdUnitNames[unit], cmdKindNames[kind], hist->cnt,
+				cmdUnitNames[unit], cmdKindNames[kind], hist->sum / 1e9,
+				cmdUnitNames[unit], cmdKindNames[kind], hist->cnt);
+		}
+	}
+
+	metricsAppend(buf, size, &len, "# HELP smartport_cmd_latency_max_seconds Slowest eRCVDPACK to GO/SKIP this run\n"
+		"# TYPE smartport_cmd_latency_max_seconds gauge\n");
+	for (unit=0; unit<CMD_UNITS; unit++)
+	{
+		for (kind=0; kind<eNUM_CK; kind++)
+		{
+			if (cmdHist[unit][kind].cnt != 0)
+				metricsAppend(buf, size, &len, "smartport_cmd_latency_max_seconds{unit=\"%s\",cmd=\"%s\"} %.9f\n",
+					cmdUnitNames[unit], cmdKindNames[kind], cmdHist[unit][kind].max / 1e9);
+		}
+	}
+
+	metricsAppend(buf, size, &len, "# HELP smartport_checksum_errors_total Packets the Controller got with a bad checksum\n"
+		"# TYPE smartport_checksum_errors_total counter\n"
+		"smartport_checksum_errors_total{packet=\"command\"} %u\n"
+		"smartport_checksum_errors_total{packet=\"data\"} %u\n",
+		atomic_load(&badCmdCs), atomic_load(&badDataCs));
+	metricsAppend(buf, size, &len, "# HELP smartport_pru_packets_total Packets the PRU received, with the ones it answered itself\n"
+		"# TYPE smartport_pru_packets_total counter\n"
+		"smartport_pru_packets_total %u\n", sharedMemPtr[PERF_OFS + PF_PACKETS]);
+	metricsAppend(buf, size, &len, "# HELP smartport_pru_errors_total Error codes the PRU reported\n"
+		"# TYPE smartport_pru_errors_total counter\n");
+	for (i=eERROR1; i<=eERROR_UNDERRUN; i++)
+		metricsAppend(buf, size, &len, "smartport_pru_errors_total{error=\"%s\"} %u\n", errorNames[i],
+			atomic_load(&pruErrorCnt[i]));
+	return len;
+}
+
+//____________________
+void metricsAppend(char *buf, unsigned int size, unsigned int *len, const char *fmt, ...)
+{
+	// Text stops at size, scraper sees it cut short
+	va_list args;
+	int n;
+
+	if (*len >= size - 1)
+		return;
+	va_start(args, fmt);
+	n = vsnprintf(buf + *len, size - *len, fmt, args);
+	va_end(args);
+	if (n > 0)
+		*len = (*len + n < size - 1) ? *len + n : size - 1;
+}
+
+//____________________
+void *prefetchWorker(void *arg)
+{
+	// Touch the blocks after one just read so they are in cache when A2 asks
+	// and load them into PRU block cache so PRU can send them without us
+	struct worker *w = arg;
+	struct prefetchOp op;
+	unsigned int i, j;
+	volatile unsigned char sink;
+
+	while (1)
+	{
+		if (spscPop(&prefetchQueue, &op) == 0)
+		{
+			workerDone(w, op.ns);
+			for (i=1; i<=PREFETCH_BLOCKS; i++)
+			{
+				if (op.block + i >= NUM_BLOCKS)
+					break;
+				for (j=0; j<512; j+=64)					// one read per cache line
+					sink = theImages[op.device][op.block + i][j];
+				if (pruCache)
+					cacheFill(op.busID, op.device, op.block + i);
+			}
+		}
+		else if (!workersRunning)
+			break;
+		else
+			usleep(WORKER_IDLE_US);
+	}
+	(void) sink;
+	return NULL;
+}
+
+//____________________
+void cacheFill(unsigned char busID, unsigned char device, unsigned int block)
+{
+	// Prefetch worker: load block into a free PRU cache entry
+	// Bus thread publishes the tag from cacheService()
+	volatile unsigned int *tags = sharedMemPtr + CACHE_TAGS_OFS;
+	struct cacheFillOp op;
+	unsigned int i, entry, tag;
+
+	tag = CACHE_TAG(busID, block);
+	for (i=0; i<CACHE_ENTRIES; i++)
+	{
+		if ((tags[i] == tag) || (atomic_load(&cachePending[i]) && (cacheFillTag[i] == tag)))
+			return;										// already there or on its way
+	}
+
+	for (i=0; i<CACHE_ENTRIES; i++)
+	{
+		entry = (cacheNext + i) % CACHE_ENTRIES;
+		if (!atomic_load(&cachePending[entry]))
+			break;
+	}
+	if (i == CACHE_ENTRIES)
+		return;											// bus thread behind, skip
+	cacheNext = (entry + 1) % CACHE_ENTRIES;
+
+	op.gen = atomic_load_explicit(&cacheWriteGen, memory_order_acquire);
+	tags[entry] = 0;
+	__sync_synchronize();
+	while (sharedMemPtr[CACHE_BUSY_OFS] == entry)
+		usleep(100);									// PRU sending it, < 20 ms
+	memcpy(cacheDataPtr + entry*512, theImages[device][block], 512);
+
+	op.ns = nowNs();
+	op.entry = entry;
+	op.tag = tag;
+	cacheFillTag[entry] = tag;
+	atomic_store(&cachePending[entry], 1);
+	if (spscPush(&cacheFillQueue, &op) != 0)
+		atomic_store(&cachePending[entry], 0);
+}
+
+//____________________
+void cacheService(void)
+{
+	// Bus thread: publish loaded entries, notice blocks PRU sent from cache
+	struct cacheFillOp op;
+	struct prefetchOp prefetchOp;
+	unsigned int hits, tag;
+
+	while (spscPop(&cacheFillQueue, &op) == 0)
+	{
+		if (op.gen == atomic_load_explicit(&cacheWriteGen, memory_order_relaxed))
+		{
+			__sync_synchronize();
+			sharedMemPtr[CACHE_TAGS_OFS + op.entry] = op.tag;
+			cacheFills++;
+		}
+		else
+			cacheFillsDropped++;						// block may have been written since
+		atomic_store(&cachePending[op.entry], 0);
+	}
+
+	hits = sharedMemPtr[CACHE_HITS_OFS];
+	if (hits != cacheLastHits)
+	{
+		// Keep the window ahead of A2, only last hit matters for sequential reads
+		cacheLastHits = hits;
+		lastTrafficNs = nowNs();
+		tag = sharedMemPtr[CACHE_LAST_OFS];
+		prefetchOp.ns = lastTrafficNs;
+		prefetchOp.busID = tag >> 24;
+		prefetchOp.block = tag & 0xFFFFFF;
+		prefetchOp.device = (prefetchOp.busID == spID1) ? 0 : 1;
+		logEvent(eEV_CACHE_HIT, prefetchOp.busID, prefetchOp.block, 0, hits);
+		spscPush(&prefetchQueue, &prefetchOp);
+	}
+}
+
+//____________________
+void cacheInvalidate(unsigned char busID, unsigned int block)
+{
+	// Bus thread, after writing block and before GO
+	unsigned int i, tag;
+
+	tag = CACHE_TAG(busID, block);
+	for (i=0; i<CACHE_ENTRIES; i++)
+	{
+		if (sharedMemPtr[CACHE_TAGS_OFS + i] == tag)
+			sharedMemPtr[CACHE_TAGS_OFS + i] = 0;
+	}
+	__sync_synchronize();
+}
+
+//____________________
+void cacheInvalidateAll(void)
+{
+	unsigned int i;
+
+	atomic_fetch_add(&cacheWriteGen, 1);				// drop loads in flight too
+	for (i=0; i<CACHE_ENTRIES; i++)
+		sharedMemPtr[CACHE_TAGS_OFS + i] = 0;
+	__sync_synchronize();
+}
+
+//____________________
+void printCacheStats(void)
+{
+	unsigned int hits, misses;
+
+	hits = sharedMemPtr[CACHE_HITS_OFS];
+	misses = sharedMemPtr[CACHE_MISSES_OFS];
+	printf("--- PRU block cache%s\n", pruCache ? "" : " (off, -C)");
+	printf("\thits=%u\tmisses=%u\thit rate=%.1f%%\tfills=%u\tdropped=%u\n", hits, misses,
+		hits + misses ? 100.0 * hits / (hits + misses) : 0.0, cacheFills, cacheFillsDropped);
+}
+
+//____________________
+void pruCmdService(void)
+{
+	// Bus thread: notice STATUS, DIB and READBLK replies PRU sent by itself
+	unsigned int stat, dib, reads, tag;
+
+	stat = sharedMemPtr[STAT_REPLIES_OFS];
+	dib  = sharedMemPtr[DIB_REPLIES_OFS];
+	if ((stat != statLastReplies) || (dib != dibLastReplies))
+	{
+		lastTrafficNs = nowNs();
+		logEvent(eEV_PRU_STATUS, 0, stat - statLastReplies, 0, dib - dibLastReplies);
+		statLastReplies = stat;
+		dibLastReplies  = dib;
+	}
+
+	reads = sharedMemPtr[DDR_READS_OFS];
+	if (reads != ddrLastReads)
+	{
+		lastTrafficNs = nowNs();
+		tag = sharedMemPtr[DDR_LAST_OFS];
+		logEvent(eEV_DDR_READ, tag >> 24, tag & 0xFFFFFF, 0, reads);
+		ddrLastReads = reads;
+	}
+}
+
+//____________________
+void printPruCmdStats(void)
+{
+	if (sharedMemPtr[ENGINE_OFS] == ENGINE_MAGIC)
+		printf("--- Commands PRU handled (PRU0 engine, %u packets)\n", sharedMemPtr[ENGINE_JOBS_OFS]);
+	else
+		printf("--- Commands PRU handled (PRU1 only)\n");
+	printf("\tSTATUS=%u\tDIB=%u%s\tWRITEBLK=%u%s\n", sharedMemPtr[STAT_REPLIES_OFS], sharedMemPtr[DIB_REPLIES_OFS],
+		pruReplies ? "" : " (off, -S)", pruWrites, pruWriteCmds ? "" : " (off, -W)");
+	if (ddrAddr != 0)
+		printf("\tREADBLK from DDR=%u\timages at 0x%lX\n", sharedMemPtr[DDR_READS_OFS], ddrAddr);
+	if (pruStream)
+		printf("\tstreamed, Tx underruns=%u\n", sharedMemPtr[TX_UNDERRUNS_OFS]);
+}
+
+//____________________
+void printQueueStats(void)
+{
+	unsigned int i, depth[eNUM_WORKERS], highWater[eNUM_WORKERS], dropped[eNUM_WORKERS];
+	struct worker *w;
+
+	depth[eLOG_WORKER]		= mpscDepth(&logQueue);
+	highWater[eLOG_WORKER]	= atomic_load(&logQueue.highWater);
+	dropped[eLOG_WORKER]	= atomic_load(&logQueue.dropped);
+	depth[eSTORAGE_WORKER]		= spscDepth(&storageQueue);
+	highWater[eSTORAGE_WORKER]	= storageQueue.highWater;
+	dropped[eSTORAGE_WORKER]	= atomic_load(&storageQueue.dropped);
+	depth[eSTATS_WORKER]		= spscDepth(&statsQueue);
+	highWater[eSTATS_WORKER]	= statsQueue.highWater;
+	dropped[eSTATS_WORKER]		= atomic_load(&statsQueue.dropped);
+	depth[ePREFETCH_WORKER]		= spscDepth(&prefetchQueue);
+	highWater[ePREFETCH_WORKER]	= prefetchQueue.highWater;
+	dropped[ePREFETCH_WORKER]	= atomic_load(&prefetchQueue.dropped);
+
+	printf("--- Queues\n");
+	for (i=0; i<eNUM_WORKERS; i++)
+	{
+		w = &workers[i];
+		printf("\t%-8s depth=%u\thigh=%u\tdropped=%u\tdone=%llu\tlag avg=%.1f max=%.1f us\n",
+			w->name, depth[i], highWater[i], dropped[i], w->done,
+			w->done ? w->lagSumNs / 1000.0 / w->done : 0.0, w->lagMaxNs / 1000.0);
+	}
+	if (eventLog != NULL)
+		printf("\tevents   logged=%u\tdropped=%u\t%s\n",
+			atomic_load(&eventLog->head), atomic_load(&eventLog->dropped), eventLogPath);
+	if (traceRing != NULL)
+		printf("\ttrace    files=%u\trecords=%u\tdropped=%u\t%s\n",
+			traceSeq, atomic_load(&traceRecords), atomic_load(&traceDropped), tracePath);
+}
+
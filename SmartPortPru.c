@@ -2,6 +2,13 @@
 	Emulates two devices
 	Modern OS, shared memory
 
+	Built for PRU1 (PRUN=1) it owns the wire: receive, send, Init replies.
+	Built for PRU0 (PRUN=0) it is the protocol engine: plans the response
+	to each packet PRU1 received for our IDs (cache, STATUS templates,
+	WRITEBLK, Controller mailbox) and encodes data frames, while PRU1 is
+	free for the wire. They trade requests and jobs in scratch pad bank 10.
+	Without PRU0 running, PRU1 plans responses itself.
+
 	Inputs:
 		WDat	P8_45	R31_0
 		P0/REQ	P8_46	R31_1
@@ -22,21 +29,81 @@
 		Bus ID 2	0x302
 		Wait flag	0x303
 		Error		0x304
+		Rx rebuild	0x305	Controller sets after changing Rx windows
+		Stat ready	0x306	Controller sets after priming status templates
+		Write on	0x307	Controller sets to let us take WRITEBLK commands
+		Cal mode	0x308	Controller sets: 1 = adapt Rx windows, 2 = trim Tx cell
+		GO->start	0x310	cycles, GO to SendPacket()
+		GO->bit		0x314	cycles, GO to first bit on RDAT
+		Host wait	0x318	cycles, eRCVDPACK to GO
+		Timing seq	0x31C	incremented when timing updated
+		Rx windows	0x320	8 x cycles, upper limit for 1..7 bit cells, then timeout
 
 		Received packet start	0x400	1024
 		Sent packet start		0x800	2048
 		Init response #1 start	0xC00	3072
 		Init response #2 start	0xE00	3584
+		Rx cells table			0x1000	256 x cells by interval >> 6
+		Rx decoded data			0x1100	512, odd bytes then groups of 7
+		Rx info					0x1300	checksum result, header, length, cursor
+		Write descriptor		0x1310	WRITEBLK we took: valid, bus ID, cmd, block
+		DDR images				0x1324	physical address, 0 = Controller didn't map any
+		DDR blocks				0x1328	per image
+		Tx cell					0x132C	cycles, bit cell
+		Tx low					0x1330	cycles, RDAT low for a 1
+		Tx gap					0x1334	cycles, after Init reply
+		Tx no limit				0x1338	0xFFFFFFFF, send limit when not streaming
+		Tx cursor				0x133C	Controller -> PRU: end of what it wrote, WAIT_GO_STREAM
+		Tx block source ID		0x1320	for WAIT_GO_BLOCK
+		Tx block data status	0x1321
+		Tx raw block			0x1400	512, Controller -> PRU for WAIT_GO_BLOCK
+		Tx frame scratch		0x1600	head 16, group msbs 73, tail 4
+		Status templates		0x1700	4 x 64, STATUS dev 1, 2, DIB dev 1, 2
+
+	Shared RAM (0x10000):
+		Rx interval histogram	0x000	256 x count, 32 cycle bins
+		Rx count per cells		0x400	8 x count
+		Rx min per cells		0x420	8 x cycles
+		Rx max per cells		0x440	8 x cycles
+		Rx edge work max		0x460	cycles, edge seen to ready for next
+		Rx edge work sum		0x464	cycles, last packet
+		Rx edges				0x468	last packet
+		Cache hits				0x480	READBLKs sent from cache
+		Cache misses			0x484	READBLKs passed to Controller
+		Cache busy				0x488	entry being sent, 0xFFFFFFFF = none
+		Cache last hit			0x48C	tag of last hit
+		STATUS replies			0x490	sent from template
+		DIB replies				0x494	sent from template
+		Engine					0x498	PRU0 sets ENGINE_MAGIC when running
+		Engine jobs				0x49C	packets PRU0 planned
+		DDR reads				0x4A0	READBLKs sent from DDR images
+		DDR last read			0x4A4	bus ID << 24 | block
+		Cache tags				0x500	20 x (bus ID << 24 | block), 0 = empty
+		Perf block				0x580	seq, transaction phases, firmware counters
+		Cache blocks			0x800	20 x 512 raw
 
 	03/14/2020
 */
 #include <stdint.h>
+#ifdef PRU_HOST
+#include "SmartPortWire.h"				// built for Linux, SmartPortWire.c plays pins and A2
+#else
 #include <pru_cfg.h>
+#include <pru_intc.h>
 #include "resource_table_empty.h"
+#endif
 
 // First 0x200 bytes of PRU RAM are STACK & HEAP
+// Everything shared with Controller is in PRU1's Data RAM, PRU0 sees it at 0x2000
+#ifdef PRU_HOST
+volatile unsigned char *PRU1_RAM = simMem;
+#elif PRUN == 0
+#define PRU1_DRAM		0x02000			// Offset to PRU1 Data RAM
+volatile unsigned char *PRU1_RAM = (unsigned char *) PRU1_DRAM;
+#else
 #define PRU0_DRAM		0x00000			// Offset to Data RAM
 volatile unsigned char *PRU1_RAM = (unsigned char *) PRU0_DRAM;
+#endif
 
 // Fixed PRU Memory Locations
 #define STATUS_ADR			0x0300		// address of eBusState
@@ -46,7 +113,66 @@ volatile unsigned char *PRU1_RAM = (unsigned char *) PRU0_DRAM;
 #define WAIT_SET			0x00		// PRU -> Controller: waiting
 #define WAIT_GO				0x01		// Controller -> PRU: send response
 #define WAIT_SKIP			0x02		// Controller -> PRU: continue without sending response
+#define WAIT_GO_BLOCK		0x03		// Controller -> PRU: encode and send data packet from raw block
+#define WAIT_GO_STREAM		0x04		// Controller -> PRU: send packet while still writing it, up to TX_CURSOR
 #define ERROR_ADR			0x0304		// address of error code
+#define RX_REBUILD_ADR		0x0305		// Controller -> PRU: Rx windows changed
+#define STAT_READY_ADR		0x0306		// Controller -> PRU: status templates primed
+#define WRITE_ON_ADR		0x0307		// Controller -> PRU: take WRITEBLK commands
+#define CAL_MODE_ADR		0x0308		// Controller -> PRU: what to do with calibration
+#define CAL_ADAPT_RX		0x01		// re-centre Rx windows on measured cell
+#define CAL_TRIM_TX			0x02		// send at measured cell
+
+// Transaction timing, 32-bit values in PRU cycles (5 ns)
+#define GO_START_ADR		0x0310		// Controller GO to SendPacket() start
+#define GO_FIRSTBIT_ADR		0x0314		// Controller GO to first bit on RDAT
+#define HOST_WAIT_ADR		0x0318		// eRCVDPACK to Controller GO
+#define TIMING_SEQ_ADR		0x031C		// incremented each time timing is updated
+#define PRU1_RAM32(adr)		(*(volatile uint32_t *) (PRU1_RAM + (adr)))
+
+// Receive bit-cell windows, uint32 PRU cycles, Controller may rewrite them
+// Interval below limit n-1 is n bit cells, above last limit ends the packet
+#define RX_LIMITS_ADR		0x0320
+#define RX_CELLS			8
+#define RX_CELL_DEFAULT		800			// 4 us
+#define RX_LIMIT(n)			PRU1_RAM32(RX_LIMITS_ADR + (n)*4)
+
+// Interval -> cells lookup, built from the windows
+// Entry with RX_TABLE_SPLIT has a limit inside its bin: cells, or cells+1 if >= limit
+#define RX_TABLE_ADR		0x1000
+#define RX_TABLE_SHIFT		6			// 64 cycles (320 ns) per entry
+#define RX_TABLE_LEN		256
+#define RX_TABLE_SPLIT		0x80
+
+// Received packet decoded while it arrives
+#define RX_DATA_ADR			0x1100		// decoded odd bytes + groups of 7
+#define RX_DATA_LEN			512
+#define RX_INFO_ADR			0x1300
+#define RX_INFO_CS			0			// eRxChecksum
+#define RX_INFO_HDR			1			// 7 header bytes, dest to groups-of-7 count, wire form
+#define RX_INFO_LEN			8			// uint16 decoded bytes
+#define RX_INFO_CALC		10			// checksum we computed
+#define RX_INFO_SENT		11			// checksum in packet
+#define RX_INFO_CURSOR		12			// uint32, end of decoded data, moves per chunk
+#define RX_HDR_START		7			// dest, first byte in checksum
+#define RX_HDR_END			14			// first byte after groups-of-7 count
+
+// WRITEBLK command we took, for Controller when the data packet arrives
+#define WRITE_DESC_ADR		0x1310
+#define WRITE_DESC_VALID	0			// 1 = next data packet goes to block below
+#define WRITE_DESC_ID		1			// bus ID
+#define WRITE_DESC_CMD		2			// 0x82 or 0xC2
+#define WRITE_DESC_BLOCK	4			// uint32
+
+// Data packet encoded from a raw 512-byte block while it is sent
+#define TX_SRC_ADR			0x1320		// source ID, msb set
+#define TX_STAT_ADR			0x1321		// data status
+#define TX_RAW_ADR			0x1400		// raw block from Controller, or from DDR
+#define TX_FRAME_ADR		0x1600		// built by EncodeFrame() before first bit
+#define TX_HEAD_LEN			16			// sync, header, odd byte msbs, odd byte
+#define TX_GROUPS			73			// groups of 7 in 512-byte block
+#define TX_TAIL_ADR			(TX_FRAME_ADR + TX_HEAD_LEN + TX_GROUPS)
+#define TX_TAIL_LEN			4			// checksum x2, PEND, end marker
 
 #define RCVD_PACKET_ADR		0x0400		// 1048, command or data from A2
 #define RCVD_PBEGIN_ADR		0x0406		// Packet Begin
@@ -58,13 +184,164 @@ volatile unsigned char *PRU1_RAM = (unsigned char *) PRU0_DRAM;
 #define INIT_RESP_1_ADR		0x0C00		// 3072
 #define INIT_RESP_2_ADR		0x0E00		// 3584
 
+// Doorbell: Controller sets system event in INTC after writing WAIT_ADR
+#define FROM_HOST_EVENT		19			// system event, must match SmartPortController.c
+#define HOST_INT			((uint32_t) 0x1<<31)	// R31 bit 31, host interrupt 1
+
+// PRU1 control registers, for CYCLE counter
+#define PRU1_CTRL			0x00024000
+#define CTRL_CTR_EN			(0x1<<3)	// CONTROL[COUNTER_ENABLE]
+#define CTRL_CONTROL		0			// word offsets
+#define CTRL_CYCLE			3
+#ifndef PRU_HOST
+volatile uint32_t *pruCtrl = (uint32_t *) PRU1_CTRL;
+#endif
+#define CYCLE_BEFORE(t)		((int32_t) (pruCtrl[CTRL_CYCLE] - (t)) < 0)
+
+// Receive interval statistics in shared RAM, word offsets
+#define SHARED_RAM			0x00010000
+#define RX_HIST_SHIFT		5			// 32 cycles (160 ns) per bin
+#define RX_HIST_BINS		256
+#define RX_HIST_OFS			0
+#define RX_CNT_OFS			256
+#define RX_MIN_OFS			264
+#define RX_MAX_OFS			272
+#define RX_WORK_MAX_OFS		280
+#define RX_WORK_SUM_OFS		281
+#define RX_EDGES_OFS		282
+#ifdef PRU_HOST
+volatile uint32_t *sharedRam = (uint32_t *) (simMem + SHARED_RAM);
+#else
+volatile uint32_t *sharedRam = (uint32_t *) SHARED_RAM;
+#endif
+
+// Block cache in shared RAM, Controller fills it ahead of sequential READBLKs
+// Controller replaces an entry by clearing its tag, waiting while CACHE_BUSY
+//  is that entry, then writing block and tag. We set CACHE_BUSY before
+//  looking at the tag again, so a block can't change under SendBlock()
+#define CACHE_HITS_OFS		288			// word offsets
+#define CACHE_MISSES_OFS	289
+#define CACHE_BUSY_OFS		290
+#define CACHE_LAST_OFS		291
+#define CACHE_TAGS_OFS		320
+#define CACHE_ENTRIES		20
+#define CACHE_DATA			(SHARED_RAM + 0x0800)
+#define CACHE_NONE			0xFFFFFFFF
+#define CACHE_TAG(id, blk)	(((uint32_t) (id) << 24) | (blk))
+
+// STATUS and DIB replies Controller primed, one per device and status code
+// Source ID and checksum are patched in like an Init reply
+#define STAT_TMPL_ADR		0x1700
+#define STAT_TMPL_LEN		64
+#define STAT_TMPL_DIB		2			// first DIB template
+#define STAT_TMPL_CS		62			// offset of checksum in packet
+#define STAT_TMPL_PART		63			// checksum of all but source ID
+#define STAT_REPLIES_OFS	292			// word offsets in shared RAM
+#define DIB_REPLIES_OFS		293
+
+// PRU0 protocol engine
+// PRU1 XOUTs a request, PRU0 XOUTs its seq as ack, plans, then XOUTs the job
+// No ack within ENGINE_TIMEOUT and PRU1 clears ENGINE_OFS and plans alone
+// PRU1 clears it at start too, PRU0 sets it again when the next request
+//  finds it clear, so a stale one never reaches HandOff()
+#define ENGINE_OFS			294			// word offsets in shared RAM
+#define ENGINE_JOBS_OFS		295
+#define ENGINE_MAGIC		0x50525530	// "PRU0"
+#define ENGINE_TIMEOUT		2000		// cycles, 10 us
+#define SCRATCH_BANK		10			// shared by PRU0 and PRU1
+#define REQ_REG				18			// request, R18-R19
+#define ACK_REG				20			// R20
+#define JOB_REG				22			// job, R22-R25
+
+// Disk images in DDR carve-out Controller mapped, [device][block][512]
+// Controller writes blocks before it releases us, so what we read is current
+#define DDR_BASE_ADR		0x1324		// uint32, 0 = off
+#define DDR_BLOCKS_ADR		0x1328		// uint32, blocks per image
+#define DDR_READS_OFS		296			// word offsets in shared RAM
+#define DDR_LAST_OFS		297
+
+// Bit cell measured on the sync bytes of each packet, FF 3F CF F3 FC FF
+// From the first edge to the last 1 of the sync is 47 cells
+// Cells in 1/16 cycle; smoothed over about 8 packets
+#define SYNC_CELLS			47
+#define CAL_RECIP			22310		// 16 * 65536 / SYNC_CELLS
+#define CAL_MIN_CELL		(700*16)	// outside this the sync didn't decode
+#define CAL_MAX_CELL		(900*16)
+#define CAL_REBUILD			32			// windows re-centred if 2 cycles off
+#define CAL_PACKETS_OFS		298			// word offsets in shared RAM
+#define CAL_REJECTS_OFS		299			// sync not 47 cells, or cell out of range
+#define CAL_LAST_OFS		300			// 1/16 cycles
+#define CAL_AVG_OFS			301
+#define CAL_MIN_OFS			302
+#define CAL_MAX_OFS			303
+#define CAL_RX_CELL_OFS		304			// cell Rx windows were last built for
+
+// Transmit timing, uint32 PRU cycles, Controller may rewrite them between packets
+// SendBits() falls back to defaults if cell or low pulse is too short to run
+// With BITS_ASM, TxLoop() has 2 cycle delay loops: SendBits() rounds cell
+//  and low down to even, 10 ns steps, rather than let TxLoop() drop a cycle
+#define TX_CELL_ADR			0x132C		// bit cell, Calibrate() may trim it
+#define TX_LOW_ADR			0x1330		// RDAT low for a 1
+#define TX_GAP_ADR			0x1334		// after Init reply, before we look at the bus
+#define TX_CELL_DEFAULT		800			// 4 us
+#define TX_LOW_DEFAULT		350			// 1.75 us
+#define TX_GAP_DEFAULT		5000		// 25 us
+#define TX_LOW_MIN			16
+#define TX_HIGH_MIN			100			// NextTxByte() and deadline wait fit
+
+// Streaming: Controller writes the packet at RESP_PACKET_ADR and moves TX_CURSOR
+//  past each part it finished; we never send a byte at or past the cursor
+// Reaching it is an underrun: packet ends there, A2 sees it as bad and retries
+#define TX_NOLIMIT_ADR		0x1338		// uint32 0xFFFFFFFF, limit for packets we own
+#define TX_CURSOR_ADR		0x133C		// uint32, PRU1 address
+#define TX_UNDERRUNS_OFS	305			// word offset in shared RAM
+
+// Transaction phases and firmware counters, word offsets in shared RAM
+// Phases are cycles since REQ rose, 0 = didn't happen this transaction
+// PERF_SEQ is odd from packet end until the transaction is done, Controller
+//  copies the block when it is even and the same before and after
+#define PERF_OFS			352
+#define PERF(n)				sharedRam[PERF_OFS + (n)]
+#define PERF_SEQ			0
+#define PH_RX_START			1			// first WDAT edge
+#define PH_RX_END			2			// last WDAT edge
+#define PH_NOTIFY			3			// eRCVDPACK, Controller told
+#define PH_GO				4			// Controller's GO seen
+#define PH_SEND_START		5			// SendBits() called
+#define PH_FIRST_BIT		6
+#define PH_SEND_END			7			// end of last cell
+#define PH_DONE				8			// back to main loop
+#define PF_PACKETS			9			// counters from here
+#define PF_ERROR1			10			// not a packet
+#define PF_ERROR2			11			// third Init
+#define PF_ERROR3			12			// not our ID
+#define PF_RESETS			13
+#define PF_HOST_WAIT		14			// uint64, cycles NOTIFY to GO
+#define PF_REQ_WAIT			16			// uint64, cycles SendBits() waited on REQ
+#define PF_LAST_JOB			18			// eJobKind << 8 | eJobDone, 0 = no job
+#define PF_CYCLE_OFS		19			// CYCLE at the last reset, since REQ rose
+#define PF_WORDS			20
+#define PERF_NOW()			(PERF(PF_CYCLE_OFS) + pruCtrl[CTRL_CYCLE])
+
+// Addresses in a job are PRU1 local: Data RAM, or shared RAM
+#define PRU1_PTR(adr)		((adr) >= SHARED_RAM ? (volatile unsigned char *) sharedRam + (adr) - SHARED_RAM : PRU1_RAM + (adr))
+
+#ifndef PRU_HOST
 volatile register uint32_t __R30;
 volatile register uint32_t __R31;
+#endif
 
 // Globals
 uint32_t WDAT, REQ, P1, P2, P3;			// inputs
 uint32_t OUTEN, RDAT, ACK, LED, TEST;	// outputs
 unsigned char initCnt, busID1, busID2;
+uint32_t sendStartCycle, firstBitCycle;	// set by SendBits()
+
+// Transmit source for SendBits(): packet ready in RAM, or raw block encoded as sent
+uint32_t txPtr, txRaw, txLimitAdr;		// txLimitAdr: uint32 no byte at or past it is sent
+unsigned char txMode, txSeg, txIdx, txByte, txFramed, txUnderrun;
+uint32_t engineSeq;						// last request to PRU0, or taken from PRU1
+uint32_t rxSyncCycles;					// last packet, 47 sync cells, 0 = sync didn't decode
 
 // Must be identical to SmartPortController.c
 typedef enum
@@ -73,23 +350,114 @@ typedef enum
 } eBusState;
 typedef enum
 {
-	eNOERROR, eERROR1, eERROR2, eERROR3
+	eNOERROR, eERROR1, eERROR2, eERROR3, eERROR_UNDERRUN
 } ePruErrors;
+typedef enum
+{
+	eRX_CS_NONE, eRX_CS_GOOD, eRX_CS_BAD
+} eRxChecksum;
+typedef enum
+{
+	eTX_RAM, eTX_BLOCK
+} eTxMode;
+typedef enum
+{
+	eTX_HEAD, eTX_GROUPS, eTX_TAIL
+} eTxSegment;
+
+// Response to a packet for one of our IDs, planned by PRU0 or PRU1, run by PRU1
+typedef enum
+{
+	eJOB_NONE, eJOB_RAM, eJOB_BLOCK, eJOB_FRAMED, eJOB_WAIT_REQ, eJOB_STREAM
+} eJobKind;
+typedef enum
+{
+	eDONE_NONE, eDONE_CACHE, eDONE_STATUS, eDONE_DIB, eDONE_HOST, eDONE_DDR
+} eJobDone;
+typedef struct
+{
+	uint32_t seq;
+	unsigned char kind, src, stat, done;	// eJobKind, eJobDone
+	uint32_t adr;			// packet, or raw block for eJOB_BLOCK and eJOB_FRAMED
+	uint32_t arg;			// eDONE_CACHE, eDONE_DDR: tag, eDONE_HOST: GO cycle
+} txJob;
+typedef struct
+{
+	uint32_t seq;
+	unsigned char dest, cmd, pad[2];
+} engineReq;
 
+// Transmit source for TxLoop() in SmartPortBits.asm, must match it
+// head bytes as is, groups of msbs byte + 7 raw bytes with msb set, tail up to 0x00
+typedef struct
+{
+	uint32_t head, headLen, msbs, raw, groups, tail;
+	uint32_t cell, low;		// cycles
+	uint32_t limit;			// address of uint32, tail stops there: TX_CURSOR or TX_NOLIMIT
+} txSrc;
+
+void		InitDoorbell(void);
+void		ResetCycleCounter(void);
+void		InitRxStats(void);
+void		BuildRxTable(void);
 void		HandleReset(void);
 eBusState	GetBusState(void);
 char		WaitForReq(void);
 void		ReceivePacket(void);
-void		InsertBit(signed char bit);
+void		Calibrate(void);
+void		InitPerf(void);
+void		PerfRxDone(uint32_t rxStart, uint32_t rxEnd);
+void		PerfAdd64(unsigned int n, uint32_t value);
+void		EndTransaction(void);
 void		ProcessPacket(void);
+char		HandOff(unsigned char dest, unsigned char cmd, txJob *job);
+void		EngineLoop(void);
+void		PlanResponse(unsigned char dest, unsigned char cmd, txJob *job);
+void		RunJob(txJob *job);
+void		InitCache(void);
+char		ServeFromCache(unsigned char dest, unsigned char cmd, txJob *job);
+char		ServeFromDdr(unsigned char dest, unsigned char cmd, txJob *job);
+uint32_t	RcvdBlock(unsigned char cmd);
+void		InitStatusReplies(void);
+char		ServeStatus(unsigned char dest, unsigned char cmd, txJob *job);
+char		TakeWriteCmd(unsigned char dest, unsigned char cmd, txJob *job);
+void		AskController(txJob *job);
 void		SendInit1(unsigned char dest);
 void		SendInit2(unsigned char dest);
 void		SendPacket(char initFlag, unsigned int memPtr);
+void		SendStream(unsigned int memPtr);
+void		SendBlock(uint32_t rawAdr, unsigned char srcID, unsigned char dataStat);
+void		EncodeFrame(void);
+void		BuildFrame(uint32_t rawAdr, unsigned char srcID, unsigned char dataStat);
+unsigned char NextTxByte(void);
+void		SendBits(char initFlag);
+
+#ifdef BITS_ASM
+// SmartPortBits.asm, cycle budgets checked by cycles.awk at build time
+uint32_t	TxLoop(txSrc *src);			// 1 = underrun
+uint32_t	WaitEdge(uint32_t level, uint32_t lastEdge, uint32_t timeout);
+#endif
+
+#ifdef PRU_HOST
+// No main(), SmartPortWire.c calls in
+
+#elif PRUN == 0
+//____________________
+int main(int argc, char *argv[])
+{
+	// Protocol engine, no pins
+	CT_CFG.SYSCFG_bit.STANDBY_INIT = 0;
 
+	InitDoorbell();
+	EngineLoop();
+}
+
+#else
 //____________________
 int main(int argc, char *argv[])
 {
-	eBusState busState;
+	eBusState busState, lastState;
+	engineReq req;
 
 	// Set I/O constants
 	WDAT  = 0x1<<0;		// P8_45 input
@@ -106,11 +474,44 @@ int main(int argc, char *argv[])
 	// Clear SYSCFG[STANDBY_INIT] to enable OCP master port
 	CT_CFG.SYSCFG_bit.STANDBY_INIT = 0;
 
+	InitDoorbell();
+	InitRxStats();
+	InitCache();
+	InitStatusReplies();
+	PRU1_RAM[WRITE_ON_ADR] = 0;
+	PRU1_RAM[WRITE_DESC_ADR + WRITE_DESC_VALID] = 0;
+	PRU1_RAM32(DDR_BASE_ADR) = 0;
+	sharedRam[DDR_READS_OFS] = 0;
+	PRU1_RAM32(TX_CELL_ADR) = TX_CELL_DEFAULT;
+	PRU1_RAM32(TX_LOW_ADR)  = TX_LOW_DEFAULT;
+	PRU1_RAM32(TX_GAP_ADR)  = TX_GAP_DEFAULT;
+	PRU1_RAM32(TX_NOLIMIT_ADR) = 0xFFFFFFFF;
+	sharedRam[TX_UNDERRUNS_OFS] = 0;
+	InitPerf();
 	HandleReset();
+	lastState = eUNKNOWN;
+
+	__xin(SCRATCH_BANK, REQ_REG, 0, req);	// PRU0 may have seen this one
+	engineSeq = req.seq;
+	// Shared RAM keeps ENGINE_MAGIC from a PRU0 that has since stopped, so
+	//  clear it and send a request: a running PRU0 sees it with ENGINE_OFS
+	//  clear and sets it again, a stopped one costs no ENGINE_TIMEOUT
+	sharedRam[ENGINE_OFS] = 0;
+	engineSeq++;
+	req.seq  = engineSeq;
+	req.dest = 0;
+	req.cmd  = 0;
+	__xout(SCRATCH_BANK, REQ_REG, 0, req);
 
 	while (1)
 	{
+		if (PRU1_RAM[RX_REBUILD_ADR])
+			BuildRxTable();
+
 		busState = GetBusState();
+		if ((busState == eRESET) && (lastState != eRESET))
+			PERF(PF_RESETS)++;
+		lastState = busState;
 		switch (busState)
 		{
 			case eIDLE:
@@ -138,6 +539,8 @@ int main(int argc, char *argv[])
 				{
 					ReceivePacket();	// receive packet & store in memory
 					ProcessPacket();	// either send Init or wait for Controller
+					EndTransaction();
+					Calibrate();		// from sync bytes, once A2 has its reply
 				}
 				break;
 			}
@@ -146,6 +549,7 @@ int main(int argc, char *argv[])
 		}
 	}
 }
+#endif
 
 //____________________
 char WaitForReq(void)
@@ -172,6 +576,88 @@ char WaitForReq(void)
 	return result;
 }
 
+//____________________
+void InitDoorbell(void)
+{
+	// Route FROM_HOST_EVENT to host interrupt 1 so Controller's GO shows up in R31
+	CT_INTC.SIPR0 |=  (0x1<<FROM_HOST_EVENT);	// active high
+	CT_INTC.SITR0 &= ~(0x1<<FROM_HOST_EVENT);	// pulse
+	CT_INTC.CMR4_bit.CH_MAP_19 = 1;				// event 19 -> channel 1
+	CT_INTC.HMR0_bit.HINT_MAP_1 = 1;			// channel 1 -> host 1
+	CT_INTC.SICR = FROM_HOST_EVENT;				// clear stale event
+	CT_INTC.EISR = FROM_HOST_EVENT;				// enable event
+	CT_INTC.HIEISR = 1;							// enable host interrupt 1
+	CT_INTC.GER = 1;							// global enable
+}
+
+//____________________
+void ResetCycleCounter(void)
+{
+	// CYCLE stops at 0xFFFFFFFF, so restart it for each transaction
+	// It can only be written while disabled
+	// PF_CYCLE_OFS keeps phase stamps counting from REQ across the reset
+	PERF(PF_CYCLE_OFS) += pruCtrl[CTRL_CYCLE];
+	pruCtrl[CTRL_CONTROL] &= ~CTRL_CTR_EN;
+	pruCtrl[CTRL_CYCLE] = 0;
+	pruCtrl[CTRL_CONTROL] |= CTRL_CTR_EN;
+}
+
+//____________________
+void InitRxStats(void)
+{
+	// Default bit-cell windows: n cells up to n + 1/2 cells, timeout at 9 1/2
+	unsigned int i;
+
+	for (i=0; i<RX_CELLS; i++)
+		RX_LIMIT(i) = (2*i + 3) * RX_CELL_DEFAULT / 2;
+	RX_LIMIT(RX_CELLS-1) = 19 * RX_CELL_DEFAULT / 2;
+	BuildRxTable();
+
+	for (i=0; i<RX_HIST_BINS; i++)
+		sharedRam[RX_HIST_OFS + i] = 0;
+	for (i=0; i<RX_CELLS; i++)
+	{
+		sharedRam[RX_CNT_OFS + i] = 0;
+		sharedRam[RX_MIN_OFS + i] = 0xFFFFFFFF;
+		sharedRam[RX_MAX_OFS + i] = 0;
+	}
+	sharedRam[RX_WORK_MAX_OFS] = 0;
+	sharedRam[RX_WORK_SUM_OFS] = 0;
+	sharedRam[RX_EDGES_OFS] = 0;
+
+	sharedRam[CAL_PACKETS_OFS] = 0;
+	sharedRam[CAL_REJECTS_OFS] = 0;
+	sharedRam[CAL_LAST_OFS] = 0;
+	sharedRam[CAL_AVG_OFS] = 0;
+	sharedRam[CAL_MIN_OFS] = 0xFFFFFFFF;
+	sharedRam[CAL_MAX_OFS] = 0;
+	sharedRam[CAL_RX_CELL_OFS] = RX_CELL_DEFAULT * 16;
+	PRU1_RAM[CAL_MODE_ADR] = 0;
+}
+
+//____________________
+void BuildRxTable(void)
+{
+	// One entry per RX_TABLE_SHIFT cycles of interval
+	// Assumes limits are more than one bin apart
+	uint32_t bin, lo, hi;
+	unsigned char cells;
+
+	cells = 1;
+	for (bin=0; bin<RX_TABLE_LEN; bin++)
+	{
+		lo = bin << RX_TABLE_SHIFT;
+		hi = lo + (0x1<<RX_TABLE_SHIFT) - 1;
+		while ((cells < RX_CELLS) && (lo >= RX_LIMIT(cells-1)))
+			cells++;
+		if ((cells < RX_CELLS) && (hi >= RX_LIMIT(cells-1)))
+			PRU1_RAM[RX_TABLE_ADR + bin] = cells | RX_TABLE_SPLIT;
+		else
+			PRU1_RAM[RX_TABLE_ADR + bin] = cells;
+	}
+	PRU1_RAM[RX_REBUILD_ADR] = 0;
+}
+
 //____________________
 void HandleReset(void)
 {
@@ -218,131 +704,289 @@ eBusState GetBusState(void)
 //____________________
 void ReceivePacket(void)
 {
-	unsigned char count, lastWDAT;
-
-	// Set up InsertBit()
-	InsertBit(-1);
+	// Time each WDAT edge with CYCLE, interval in 5 ns units gives number of bit cells
+	// n cells = n-1 zeros then a one, shifted into shiftReg in one go
+	// At most 15 bits live in shiftReg, so at most one byte to store per edge
+	// Each byte is decoded as it completes, so data and checksum are ready at the end
+	// Intervals recorded in shared RAM so Controller can see the margins
+	// Time to the end of the sync bytes kept for Calibrate()
+	uint32_t lastWDAT, lastEdge, now, interval, timeout, bin, work, workSum, edges;
+	uint32_t syncStart, syncCells;
+	uint32_t shiftReg, bits, memPtr, pos, dataPtr;
+	unsigned char cells, wire, data, msbs, checksum, oddLeft, groupsLeft, chunkLeft, csLeft, csEven;
+
+	shiftReg = 0x01;					// we miss first 1 in byte 0
+	bits = 1;
+	memPtr = RCVD_PACKET_ADR;
+
+	pos = 0;
+	dataPtr = RX_DATA_ADR;
+	msbs = 0;
+	checksum = 0;
+	oddLeft = 0;
+	groupsLeft = 0;
+	chunkLeft = 0;
+	csLeft = 2;
+	csEven = 0;
+	PRU1_RAM[RX_INFO_ADR + RX_INFO_CS] = eRX_CS_NONE;
+	PRU1_RAM32(RX_INFO_ADR + RX_INFO_CURSOR) = RX_DATA_ADR;
+	workSum = 0;
+	edges = 0;
+	timeout = RX_LIMIT(RX_CELLS-1);
+	rxSyncCycles = 0;
+	syncCells = 0;
+	ResetCycleCounter();
+	PERF(PF_CYCLE_OFS) = 0;				// REQ just rose
 
 	while ((__R31 & WDAT) == WDAT);		// wait for WDAT to go low
+	lastEdge = pruCtrl[CTRL_CYCLE];
+	syncStart = lastEdge;
 
 	while (1)
 	{
-		count = 0;
 		lastWDAT = __R31 & WDAT;
-		while ((__R31 & WDAT) == lastWDAT)
-		{
-			count++;
-			if (count > 65)	// was 64
-				return;
-
-			__delay_cycles(100);	// 0.5 us
-		}
-
-		// Convert count into bit(s)
-		if (count < 10)			// 1
-		{
-			InsertBit(1);
-		}
-		else if (count < 17)	// 01
-		{
-			InsertBit(0);
-			InsertBit(1);
-		}
-		else if (count < 24)	// 001
-		{
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(1);
-		}
-		else if (count < 31)	// 0001
+#ifdef BITS_ASM
+		now = WaitEdge(lastWDAT, lastEdge, timeout);
+		if (now == 0)
 		{
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(1);
+			sharedRam[RX_WORK_SUM_OFS] = workSum;
+			sharedRam[RX_EDGES_OFS] = edges;
+			PerfRxDone(syncStart, lastEdge);
+			return;
 		}
-		else if (count < 38)	// 0 0001
+#else
+		// Four looks at WDAT per CYCLE read keeps the timestamp error to about one look
+		while (1)
 		{
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(1);
+			if ((__R31 & WDAT) != lastWDAT)
+				break;
+			if ((__R31 & WDAT) != lastWDAT)
+				break;
+			if ((__R31 & WDAT) != lastWDAT)
+				break;
+			if ((__R31 & WDAT) != lastWDAT)
+				break;
+			if (pruCtrl[CTRL_CYCLE] - lastEdge > timeout)
+			{
+				sharedRam[RX_WORK_SUM_OFS] = workSum;
+				sharedRam[RX_EDGES_OFS] = edges;
+				PerfRxDone(syncStart, lastEdge);
+				return;
+			}
 		}
-		else if (count < 45)	// 00 0001
+		now = pruCtrl[CTRL_CYCLE];
+#endif
+		interval = now - lastEdge;
+		lastEdge = now;
+
+		bin = interval >> RX_TABLE_SHIFT;
+		if (bin < RX_TABLE_LEN)
 		{
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(1);
+			cells = PRU1_RAM[RX_TABLE_ADR + bin];
+			if (cells & RX_TABLE_SPLIT)
+			{
+				cells &= ~RX_TABLE_SPLIT;
+				if (interval >= RX_LIMIT(cells-1))
+					cells++;
+			}
 		}
-		else if (count < 52)	// 000 0001
+		else
+			cells = RX_CELLS;
+
+		shiftReg = (shiftReg << cells) | 0x01;
+		bits += cells;
+		if (syncCells < SYNC_CELLS)
 		{
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(1);
+			syncCells += cells;
+			if (syncCells == SYNC_CELLS)	// overshoot leaves rxSyncCycles 0
+				rxSyncCycles = now - syncStart;
 		}
-		else					// 0000 0001
+		if (bits >= 8)
 		{
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(0);
-			InsertBit(1);
+			bits -= 8;
+			wire = shiftReg >> bits;
+			PRU1_RAM[memPtr] = wire;
+			memPtr++;
+
+			// Header, odd bytes, groups of 7, checksum; msbs byte leads each chunk
+			if (pos < RX_HDR_END)
+			{
+				if (pos >= RX_HDR_START)
+				{
+					checksum ^= wire;
+					PRU1_RAM[RX_INFO_ADR + RX_INFO_HDR + pos - RX_HDR_START] = wire;
+				}
+				if ((pos == RCVD_TYPE_ADR - RCVD_PACKET_ADR) && (wire == 0x82))
+					PRU1_RAM[STATUS_ADR] = eWRITING;	// data packet, Controller may copy chunks
+				else if (pos == RX_HDR_END-2)
+					oddLeft = wire & 0x7F;
+				else if (pos == RX_HDR_END-1)
+					groupsLeft = wire & 0x7F;
+				pos++;
+			}
+			else if (chunkLeft != 0)
+			{
+				msbs <<= 1;
+				data = (wire & 0x7F) | (msbs & 0x80);
+				if (dataPtr < RX_DATA_ADR + RX_DATA_LEN)
+				{
+					PRU1_RAM[dataPtr] = data;
+					dataPtr++;
+				}
+				checksum ^= data;
+				chunkLeft--;
+				if (chunkLeft == 0)
+					PRU1_RAM32(RX_INFO_ADR + RX_INFO_CURSOR) = dataPtr;
+			}
+			else if (oddLeft != 0)
+			{
+				msbs = wire;
+				chunkLeft = oddLeft;
+				oddLeft = 0;
+			}
+			else if (groupsLeft != 0)
+			{
+				msbs = wire;
+				chunkLeft = 7;
+				groupsLeft--;
+			}
+			else if (csLeft == 2)
+			{
+				csEven = wire & 0x55;			// 1 C6 1 C4 1 C2 1 C0
+				csLeft = 1;
+			}
+			else if (csLeft == 1)
+			{
+				csEven |= (wire & 0x55) << 1;	// 1 C7 1 C5 1 C3 1 C1
+				PRU1_RAM[RX_INFO_ADR + RX_INFO_CALC] = checksum;
+				PRU1_RAM[RX_INFO_ADR + RX_INFO_SENT] = csEven;
+				PRU1_RAM[RX_INFO_ADR + RX_INFO_LEN]   = (dataPtr - RX_DATA_ADR) & 0xFF;
+				PRU1_RAM[RX_INFO_ADR + RX_INFO_LEN+1] = (dataPtr - RX_DATA_ADR) >> 8;
+				PRU1_RAM[RX_INFO_ADR + RX_INFO_CS] = (checksum == csEven) ? eRX_CS_GOOD : eRX_CS_BAD;
+				csLeft = 0;
+			}
 		}
+
+		bin = interval >> RX_HIST_SHIFT;
+		if (bin >= RX_HIST_BINS)
+			bin = RX_HIST_BINS - 1;
+		sharedRam[RX_HIST_OFS + bin]++;
+		sharedRam[RX_CNT_OFS + cells-1]++;
+		if (interval < sharedRam[RX_MIN_OFS + cells-1])
+			sharedRam[RX_MIN_OFS + cells-1] = interval;
+		if (interval > sharedRam[RX_MAX_OFS + cells-1])
+			sharedRam[RX_MAX_OFS + cells-1] = interval;
+
+		work = pruCtrl[CTRL_CYCLE] - now;
+		workSum += work;
+		edges++;
+		if (work > sharedRam[RX_WORK_MAX_OFS])
+			sharedRam[RX_WORK_MAX_OFS] = work;
 	}
 }
 
 //____________________
-void InsertBit(signed char bit)
+void Calibrate(void)
 {
-	// Insert bit into byteInProcess and put in RAM when byte completed
-	// If bit = -1, reset parameters (start of packet)
-	static unsigned char bitCnt, byteInProcess;
-	static unsigned int memoryPtr;
+	// Bit cell from the last packet's sync bytes into shared RAM for Controller
+	// Per CAL_MODE, move Rx windows and Tx cell to it; main loop rebuilds the table
+	uint32_t cell, avg, i;
 
-	if (bit == -1)
+	if (rxSyncCycles == 0)
 	{
-		bitCnt = 1;
-		byteInProcess = 0x02;		// we miss first 1 in byte 0
-		memoryPtr = RCVD_PACKET_ADR;
+		sharedRam[CAL_REJECTS_OFS]++;
+		return;
 	}
-	else
+	cell = (rxSyncCycles * CAL_RECIP) >> 16;
+	if ((cell < CAL_MIN_CELL) || (cell > CAL_MAX_CELL))
 	{
-		if (bit == 0)
-			byteInProcess &= 0xFE;	// clear LSB
-		else
-			byteInProcess |= 0x01;	// set LSB
+		sharedRam[CAL_REJECTS_OFS]++;
+		return;
+	}
 
-		if (bitCnt == 7)
-		{
-			PRU1_RAM[memoryPtr] = byteInProcess;
-			memoryPtr++;
-			bitCnt = 0;
-		}
-		else
-		{
-			byteInProcess = byteInProcess<<1;	// shift bits left
-			bitCnt++;
-		}
+	if (sharedRam[CAL_PACKETS_OFS] == 0)
+		avg = cell;
+	else
+	{
+		avg = sharedRam[CAL_AVG_OFS];
+		avg = avg - (avg >> 3) + (cell >> 3);
+	}
+	sharedRam[CAL_PACKETS_OFS]++;
+	sharedRam[CAL_LAST_OFS] = cell;
+	sharedRam[CAL_AVG_OFS] = avg;
+	if (cell < sharedRam[CAL_MIN_OFS])
+		sharedRam[CAL_MIN_OFS] = cell;
+	if (cell > sharedRam[CAL_MAX_OFS])
+		sharedRam[CAL_MAX_OFS] = cell;
+
+	if ((PRU1_RAM[CAL_MODE_ADR] & CAL_ADAPT_RX) &&
+		((avg > sharedRam[CAL_RX_CELL_OFS] + CAL_REBUILD) || (avg + CAL_REBUILD < sharedRam[CAL_RX_CELL_OFS])))
+	{
+		// Same windows as InitRxStats(), n + 1/2 cells, timeout at 9 1/2
+		for (i=0; i<RX_CELLS-1; i++)
+			RX_LIMIT(i) = (2*i + 3) * avg / 32;
+		RX_LIMIT(RX_CELLS-1) = 19 * avg / 32;
+		sharedRam[CAL_RX_CELL_OFS] = avg;
+		PRU1_RAM[RX_REBUILD_ADR] = 1;
 	}
+
+	if (PRU1_RAM[CAL_MODE_ADR] & CAL_TRIM_TX)
+		PRU1_RAM32(TX_CELL_ADR) = (avg + 8) >> 4;
+}
+
+//____________________
+void InitPerf(void)
+{
+	unsigned int i;
+
+	for (i=0; i<PF_WORDS; i++)
+		PERF(i) = 0;
+}
+
+//____________________
+void PerfRxDone(uint32_t rxStart, uint32_t rxEnd)
+{
+	// Packet received, CYCLE is still time since REQ
+	// Start a new transaction in the perf block, Controller leaves it alone until EndTransaction()
+	unsigned int i;
+
+	PERF(PERF_SEQ)++;
+	PERF(PH_RX_START) = rxStart;
+	PERF(PH_RX_END) = rxEnd;
+	for (i=PH_NOTIFY; i<=PH_DONE; i++)
+		PERF(i) = 0;
+	PERF(PF_LAST_JOB) = 0;
+	PERF(PF_PACKETS)++;
+}
+
+//____________________
+void PerfAdd64(unsigned int n, uint32_t value)
+{
+	uint32_t lo;
+
+	lo = PERF(n) + value;
+	PERF(n) = lo;
+	if (lo < value)
+		PERF(n + 1)++;
+}
+
+//____________________
+void EndTransaction(void)
+{
+	// Packet handled: stamp it and let Controller copy the perf block
+	PERF(PH_DONE) = PERF_NOW();
+	if (PERF(PH_GO) != 0)
+		PerfAdd64(PF_HOST_WAIT, PERF(PH_GO) - PERF(PH_NOTIFY));
+	PERF(PERF_SEQ)++;
 }
 
 //____________________
 void ProcessPacket(void)
 {
 	// If packet is Init, immediately send Init response
-	// Otherwise, tell Controller and wait for instructions
+	// Otherwise, plan response and send it, maybe after asking Controller
 	unsigned char dest, cmd;
+	txJob job;
 
 	if (PRU1_RAM[RCVD_PBEGIN_ADR] == 0xC3)
 	{
@@ -368,30 +1012,401 @@ void ProcessPacket(void)
 					initCnt = 8;	// not 0 or 1
 				}
 				else
+				{
 					PRU1_RAM[ERROR_ADR] = eERROR2;
+					PERF(PF_ERROR2)++;
+				}
 			}
 		}
 
-		// We are inited so let Controller make the tough decisions
+		// We are inited: PRU0 decides the response if it is running, then we send it
 		else if ((dest == busID1) || (dest == busID2))
 		{
-			PRU1_RAM[STATUS_ADR] = eRCVDPACK;		// tell Controller packet received
-
 			__R30 &= ~ACK;			// ACK = 0, to tell A2 we are responding
 
-			PRU1_RAM[WAIT_ADR] = WAIT_SET;			// wait for Controller's response
-			while (PRU1_RAM[WAIT_ADR] == WAIT_SET)
-				__delay_cycles(1600);				// 8 us
-
-			if (PRU1_RAM[WAIT_ADR] == WAIT_GO)
-				SendPacket(0, RESP_PACKET_ADR);
+			if (!HandOff(dest, cmd, &job))
+				PlanResponse(dest, cmd, &job);
+			RunJob(&job);
 		}
 
 		else
+		{
 			PRU1_RAM[ERROR_ADR] = eERROR3;
+			PERF(PF_ERROR3)++;
+		}
 	}
 	else
+	{
 		PRU1_RAM[ERROR_ADR] = eERROR1;
+		PERF(PF_ERROR1)++;
+	}
+}
+
+//____________________
+char HandOff(unsigned char dest, unsigned char cmd, txJob *job)
+{
+	// PRU1: give packet to PRU0 and wait for its job
+	// Return 0 if PRU0 isn't running, we plan the response ourselves
+	engineReq req;
+	uint32_t ack, start;
+
+	if (sharedRam[ENGINE_OFS] != ENGINE_MAGIC)
+		return 0;
+
+	engineSeq++;
+	req.seq  = engineSeq;
+	req.dest = dest;
+	req.cmd  = cmd;
+	__xout(SCRATCH_BANK, REQ_REG, 0, req);
+
+	start = pruCtrl[CTRL_CYCLE];
+	do
+	{
+		__xin(SCRATCH_BANK, ACK_REG, 0, ack);
+		if (ack == engineSeq)
+			break;
+	} while (pruCtrl[CTRL_CYCLE] - start < ENGINE_TIMEOUT);
+	if (ack != engineSeq)
+	{
+		sharedRam[ENGINE_OFS] = 0;			// PRU0 stopped, PRU0 drops the request if it restarts
+		return 0;
+	}
+
+	// PRU0 has it, may wait for Controller as long as it takes
+	do
+		__xin(SCRATCH_BANK, JOB_REG, 0, *job);
+	while (job->seq != engineSeq);
+	return 1;
+}
+
+//____________________
+void EngineLoop(void)
+{
+	// PRU0: take packets from PRU1, plan response, build data frame, hand job back
+	engineReq req;
+	txJob job;
+
+	__xin(SCRATCH_BANK, REQ_REG, 0, req);	// anything there now is stale
+	engineSeq = req.seq;
+	sharedRam[ENGINE_JOBS_OFS] = 0;
+	sharedRam[ENGINE_OFS] = ENGINE_MAGIC;
+
+	while (1)
+	{
+		__xin(SCRATCH_BANK, REQ_REG, 0, req);
+		if (req.seq == engineSeq)
+			continue;
+		engineSeq = req.seq;
+
+		if (sharedRam[ENGINE_OFS] != ENGINE_MAGIC)
+		{
+			sharedRam[ENGINE_OFS] = ENGINE_MAGIC;	// PRU1 gave up on us or just started, it handles this one itself
+			continue;
+		}
+		__xout(SCRATCH_BANK, ACK_REG, 0, req.seq);
+
+		PlanResponse(req.dest, req.cmd, &job);
+		if (job.kind == eJOB_BLOCK)
+		{
+			BuildFrame(job.adr, job.src, job.stat);	// PRU1 just sends it
+			job.kind = eJOB_FRAMED;
+		}
+		job.seq = req.seq;
+		__xout(SCRATCH_BANK, JOB_REG, 0, job);
+		sharedRam[ENGINE_JOBS_OFS]++;
+	}
+}
+
+//____________________
+void PlanResponse(unsigned char dest, unsigned char cmd, txJob *job)
+{
+	// READBLK from cache or DDR, STATUS and WRITEBLK don't need Controller
+	// Anything else let Controller make the tough decisions
+	job->kind = eJOB_NONE;
+	job->done = eDONE_NONE;
+
+	if (ServeFromCache(dest, cmd, job) || ServeFromDdr(dest, cmd, job) ||
+		ServeStatus(dest, cmd, job) || TakeWriteCmd(dest, cmd, job))
+		return;
+	AskController(job);
+}
+
+//____________________
+void AskController(txJob *job)
+{
+	// Tell Controller about the packet and wait for its response
+	uint32_t goCycle;
+
+	// Arm doorbell before telling Controller, so its GO can't be overwritten
+	CT_INTC.SICR = FROM_HOST_EVENT;
+	PRU1_RAM[WAIT_ADR] = WAIT_SET;			// wait for Controller's response
+	ResetCycleCounter();
+	PERF(PH_NOTIFY) = PERF(PF_CYCLE_OFS);
+
+	PRU1_RAM[STATUS_ADR] = eRCVDPACK;		// tell Controller packet received
+
+	// Tight loop, no delay: doorbell event in R31 or WAIT_ADR changing
+	while (((__R31 & HOST_INT) == 0) && (PRU1_RAM[WAIT_ADR] == WAIT_SET));
+	while (PRU1_RAM[WAIT_ADR] == WAIT_SET);	// event can beat the RAM write
+	goCycle = pruCtrl[CTRL_CYCLE];
+	CT_INTC.SICR = FROM_HOST_EVENT;
+	PERF(PH_GO) = PERF(PF_CYCLE_OFS) + goCycle;
+
+	PRU1_RAM32(HOST_WAIT_ADR) = goCycle;
+	if (PRU1_RAM[WAIT_ADR] == WAIT_GO)
+	{
+		job->kind = eJOB_RAM;
+		job->adr  = RESP_PACKET_ADR;
+	}
+	else if (PRU1_RAM[WAIT_ADR] == WAIT_GO_BLOCK)
+	{
+		job->kind = eJOB_BLOCK;
+		job->adr  = TX_RAW_ADR;
+		job->src  = PRU1_RAM[TX_SRC_ADR];
+		job->stat = PRU1_RAM[TX_STAT_ADR];
+	}
+	else if (PRU1_RAM[WAIT_ADR] == WAIT_GO_STREAM)
+	{
+		job->kind = eJOB_STREAM;
+		job->adr  = RESP_PACKET_ADR;
+	}
+	job->done = eDONE_HOST;
+	job->arg  = goCycle;
+}
+
+//____________________
+void RunJob(txJob *job)
+{
+	// PRU1: send the response, then the bookkeeping that has to wait for it
+	PERF(PF_LAST_JOB) = (job->kind << 8) | job->done;
+	switch (job->kind)
+	{
+		case eJOB_RAM:
+			SendPacket(0, job->adr);
+			break;
+		case eJOB_BLOCK:
+			SendBlock(job->adr, job->src, job->stat);
+			break;
+		case eJOB_FRAMED:
+			txMode = eTX_BLOCK;
+			txRaw = job->adr;
+			txLimitAdr = TX_NOLIMIT_ADR;
+			txFramed = 1;
+			SendBits(0);
+			break;
+		case eJOB_WAIT_REQ:
+			while ((__R31 & REQ) == REQ);	// wait for REQ = 0, then main loop sets ACK for data
+			break;
+		case eJOB_STREAM:
+			SendStream(job->adr);
+			break;
+	}
+
+	switch (job->done)
+	{
+		case eDONE_CACHE:
+			sharedRam[CACHE_BUSY_OFS] = CACHE_NONE;
+			sharedRam[CACHE_LAST_OFS] = job->arg;
+			sharedRam[CACHE_HITS_OFS]++;
+			break;
+		case eDONE_STATUS:
+			sharedRam[STAT_REPLIES_OFS]++;
+			break;
+		case eDONE_DIB:
+			sharedRam[DIB_REPLIES_OFS]++;
+			break;
+		case eDONE_DDR:
+			sharedRam[DDR_LAST_OFS] = job->arg;
+			sharedRam[DDR_READS_OFS]++;
+			break;
+		case eDONE_HOST:
+			if (job->kind != eJOB_NONE)
+			{
+				PRU1_RAM32(GO_START_ADR)    = sendStartCycle - job->arg;
+				PRU1_RAM32(GO_FIRSTBIT_ADR) = firstBitCycle  - job->arg;
+			}
+			else
+			{
+				PRU1_RAM32(GO_START_ADR)    = 0;
+				PRU1_RAM32(GO_FIRSTBIT_ADR) = 0;
+			}
+			PRU1_RAM32(TIMING_SEQ_ADR)++;
+			break;
+	}
+}
+
+//____________________
+void InitCache(void)
+{
+	unsigned int i;
+
+	for (i=0; i<CACHE_ENTRIES; i++)
+		sharedRam[CACHE_TAGS_OFS + i] = 0;
+	sharedRam[CACHE_HITS_OFS]   = 0;
+	sharedRam[CACHE_MISSES_OFS] = 0;
+	sharedRam[CACHE_BUSY_OFS]   = CACHE_NONE;
+	sharedRam[CACHE_LAST_OFS]   = 0;
+}
+
+//____________________
+char ServeFromCache(unsigned char dest, unsigned char cmd, txJob *job)
+{
+	// READBLK or ExtREADBLK for a cached block: plan sending it, return 1
+	// Anything else return 0
+	uint32_t block, tag, i;
+
+	if ((PRU1_RAM[RCVD_TYPE_ADR] != 0x80) || ((cmd != 0x81) && (cmd != 0xC1)))
+		return 0;
+	if (PRU1_RAM[RX_INFO_ADR + RX_INFO_CS] != eRX_CS_GOOD)
+		return 0;
+
+	block = RcvdBlock(cmd);
+	tag = CACHE_TAG(dest, block);
+
+	for (i=0; i<CACHE_ENTRIES; i++)
+	{
+		if (sharedRam[CACHE_TAGS_OFS + i] == tag)
+			break;
+	}
+	if (i == CACHE_ENTRIES)
+	{
+		sharedRam[CACHE_MISSES_OFS]++;
+		return 0;
+	}
+
+	// Claim entry, then make sure Controller didn't take it first
+	// RunJob() releases it once the block is sent
+	sharedRam[CACHE_BUSY_OFS] = i;
+	if (sharedRam[CACHE_TAGS_OFS + i] != tag)
+	{
+		sharedRam[CACHE_BUSY_OFS] = CACHE_NONE;
+		sharedRam[CACHE_MISSES_OFS]++;
+		return 0;
+	}
+
+	job->kind = eJOB_BLOCK;
+	job->adr  = CACHE_DATA + i*512;
+	job->src  = dest;
+	job->stat = 0x00;			// 0x00 = no error
+	job->done = eDONE_CACHE;
+	job->arg  = tag;
+	return 1;
+}
+
+//____________________
+char ServeFromDdr(unsigned char dest, unsigned char cmd, txJob *job)
+{
+	// READBLK or ExtREADBLK with images in DDR: copy block to TX_RAW, plan sending it, return 1
+	// Anything else, or block past the image, return 0
+	// Copy is done now, while A2 waits for ACK, OCP reads are too slow for EncodeFrame()
+	volatile uint32_t *src, *dst;
+	uint32_t base, block, i;
+
+	base = PRU1_RAM32(DDR_BASE_ADR);
+	if (base == 0)
+		return 0;
+	if ((PRU1_RAM[RCVD_TYPE_ADR] != 0x80) || ((cmd != 0x81) && (cmd != 0xC1)))
+		return 0;
+	if (PRU1_RAM[RX_INFO_ADR + RX_INFO_CS] != eRX_CS_GOOD)
+		return 0;
+
+	block = RcvdBlock(cmd);
+	if (block >= PRU1_RAM32(DDR_BLOCKS_ADR))
+		return 0;				// Controller reports it
+	if (dest != PRU1_RAM[BUS_ID_1_ADR])
+		block += PRU1_RAM32(DDR_BLOCKS_ADR);	// second image
+
+	src = (volatile uint32_t *) (uintptr_t) (base + block*512);
+	dst = (volatile uint32_t *) (PRU1_RAM + TX_RAW_ADR);
+	for (i=0; i<512/4; i++)
+		dst[i] = src[i];
+
+	job->kind = eJOB_BLOCK;
+	job->adr  = TX_RAW_ADR;
+	job->src  = dest;
+	job->stat = 0x00;			// 0x00 = no error
+	job->done = eDONE_DDR;
+	job->arg  = CACHE_TAG(dest, RcvdBlock(cmd));
+	return 1;
+}
+
+//____________________
+uint32_t RcvdBlock(unsigned char cmd)
+{
+	// Block number of READBLK, WRITEBLK or their Ext versions, decoded by ReceivePacket()
+	// Params start at RX_DATA_ADR+2, Ext commands have one less
+	uint32_t i;
+
+	if (cmd < 0xC0)
+		i = RX_DATA_ADR + 4;
+	else
+		i = RX_DATA_ADR + 3;
+	return PRU1_RAM[i] | (PRU1_RAM[i+1] << 8) | (PRU1_RAM[i+2] << 16);
+}
+
+//____________________
+void InitStatusReplies(void)
+{
+	// Controller primes templates after we start
+	PRU1_RAM[STAT_READY_ADR] = 0;
+	sharedRam[STAT_REPLIES_OFS] = 0;
+	sharedRam[DIB_REPLIES_OFS]  = 0;
+}
+
+//____________________
+char ServeStatus(unsigned char dest, unsigned char cmd, txJob *job)
+{
+	// STATUS or ExtSTATUS with status code 0 or 3 (DIB): plan sending template, return 1
+	// Anything else return 0
+	unsigned char statCode, csOfs, checksum;
+	uint32_t tmpl;
+
+	if (PRU1_RAM[STAT_READY_ADR] == 0)
+		return 0;
+	if ((PRU1_RAM[RCVD_TYPE_ADR] != 0x80) || ((cmd != 0x80) && (cmd != 0xC0)))
+		return 0;
+	if (PRU1_RAM[RX_INFO_ADR + RX_INFO_CS] != eRX_CS_GOOD)
+		return 0;
+
+	tmpl = (dest == PRU1_RAM[BUS_ID_1_ADR]) ? 0 : 1;
+	statCode = PRU1_RAM[RCVD_PACKET_ADR + 20] & 0x7F;	// same byte Controller looks at
+	if (statCode == 0x03)
+		tmpl += STAT_TMPL_DIB;
+	else if (statCode != 0x00)
+		return 0;
+	tmpl = STAT_TMPL_ADR + tmpl*STAT_TMPL_LEN;
+
+	PRU1_RAM[tmpl+8] = dest;			// put ID in our response
+	csOfs = PRU1_RAM[tmpl+STAT_TMPL_CS];
+	checksum = PRU1_RAM[tmpl+STAT_TMPL_PART] ^ dest;
+	PRU1_RAM[tmpl+csOfs]   =  checksum       | 0xAA;	// 1 C6 1 C4 1 C2 1 C0
+	PRU1_RAM[tmpl+csOfs+1] = (checksum >> 1) | 0xAA;	// 1 C7 1 C5 1 C3 1 C1
+
+	job->kind = eJOB_RAM;
+	job->adr  = tmpl;
+	job->done = (statCode == 0x03) ? eDONE_DIB : eDONE_STATUS;
+	return 1;
+}
+
+//____________________
+char TakeWriteCmd(unsigned char dest, unsigned char cmd, txJob *job)
+{
+	// WRITEBLK or ExtWRITEBLK: note block for Controller, let A2 send data, return 1
+	// Controller only needs the block number, and gets it with the data packet
+	if (PRU1_RAM[WRITE_ON_ADR] == 0)
+		return 0;
+	if ((PRU1_RAM[RCVD_TYPE_ADR] != 0x80) || ((cmd != 0x82) && (cmd != 0xC2)))
+		return 0;
+	if (PRU1_RAM[RX_INFO_ADR + RX_INFO_CS] != eRX_CS_GOOD)
+		return 0;
+
+	PRU1_RAM32(WRITE_DESC_ADR + WRITE_DESC_BLOCK) = RcvdBlock(cmd);
+	PRU1_RAM[WRITE_DESC_ADR + WRITE_DESC_ID]  = dest;
+	PRU1_RAM[WRITE_DESC_ADR + WRITE_DESC_CMD] = cmd;
+	PRU1_RAM[WRITE_DESC_ADR + WRITE_DESC_VALID] = 1;
+
+	job->kind = eJOB_WAIT_REQ;
+	return 1;
 }
 
 //____________________
@@ -447,60 +1462,290 @@ void SendPacket(char initFlag, unsigned int memPtr)
 {
 	// Send packet starting at memPtr, ending with 0x00
 	// initFlag == 1, we are sending init and handle ending differently
-	unsigned char byteInProgress, bitMask, sendDone;
+	txMode = eTX_RAM;
+	txPtr = memPtr;
+	txLimitAdr = TX_NOLIMIT_ADR;
+	SendBits(initFlag);
+}
+
+//____________________
+void SendStream(unsigned int memPtr)
+{
+	// Like SendPacket(), Controller is still writing the packet and moving TX_CURSOR
+	txMode = eTX_RAM;
+	txPtr = memPtr;
+	txLimitAdr = TX_CURSOR_ADR;
+	SendBits(0);
+}
+
+//____________________
+void SendBlock(uint32_t rawAdr, unsigned char srcID, unsigned char dataStat)
+{
+	// Send 512-byte block at rawAdr as a data packet, encoding it as it goes
+	// srcID has msb set
+	txMode = eTX_BLOCK;
+	txRaw = rawAdr;
+	txLimitAdr = TX_NOLIMIT_ADR;
+	txFramed = 0;			// frame built by EncodeFrame()
+	PRU1_RAM[TX_FRAME_ADR + 8]  = srcID;
+	PRU1_RAM[TX_FRAME_ADR + 11] = dataStat | 0x80;
+	SendBits(0);
+}
+
+//____________________
+void EncodeFrame(void)
+{
+	// Runs while A2 gets ready to receive, group bytes come from raw block in NextTxByte()
+	// Source ID and data status already put in frame by SendBlock(),
+	//  whole frame already built if PRU0 planned it
+	if (!txFramed)
+		BuildFrame(txRaw, PRU1_RAM[TX_FRAME_ADR + 8], PRU1_RAM[TX_FRAME_ADR + 11] & 0x7F);
+
+	txSeg = eTX_HEAD;
+	txIdx = 0;
+	txByte = 0;
+	txPtr = txRaw + 1;
+}
 
+//____________________
+void BuildFrame(uint32_t rawAdr, unsigned char srcID, unsigned char dataStat)
+{
+	// Everything in a data packet that isn't a raw byte with msb set:
+	//	head, one msbs byte per group of 7, checksum and PEND
+	volatile unsigned char *raw = PRU1_PTR(rawAdr);
+	volatile unsigned char *frame = PRU1_RAM + TX_FRAME_ADR;
+	unsigned char checksum, msbs, b, i, group;
+
+	frame[0]  = 0xFF;				// sync bytes
+	frame[1]  = 0x3F;
+	frame[2]  = 0xCF;
+	frame[3]  = 0xF3;
+	frame[4]  = 0xFC;
+	frame[5]  = 0xFF;
+	frame[6]  = 0xC3;				// packet begin
+	frame[7]  = 0x80;				// destination
+	frame[8]  = srcID;				// source
+	frame[9]  = 0x82;				// type: 2 = data
+	frame[10] = 0x80;				// aux type: 0 = standard packet
+	frame[11] = dataStat | 0x80;	// data status
+	frame[12] = 0x81;				// odd byte count: 1
+	frame[13] = 0xC9;				// groups-of-7 count: 73
+
+	b = raw[0];
+	frame[14] = ((b >> 1) & 0x40) | 0x80;
+	frame[15] = b | 0x80;
+	checksum = b ^ frame[7] ^ frame[8] ^ frame[9] ^ frame[10] ^ frame[11] ^ frame[12] ^ frame[13];
+
+	raw++;
+	for (group=0; group<TX_GROUPS; group++)
+	{
+		msbs = 0x80;
+		for (i=0; i<7; i++)
+		{
+			b = raw[i];
+			checksum ^= b;
+			msbs |= (b >> (i+1)) & (0x80 >> (i+1));
+		}
+		frame[TX_HEAD_LEN + group] = msbs;
+		raw += 7;
+	}
+
+	frame[TX_HEAD_LEN + TX_GROUPS]     =  checksum       | 0xAA;	// 1 c6 1 c4 1 c2 1 c0
+	frame[TX_HEAD_LEN + TX_GROUPS + 1] = (checksum >> 1) | 0xAA;	// 1 c7 1 c5 1 c3 1 c1
+	frame[TX_HEAD_LEN + TX_GROUPS + 2] = 0xC8;						// PEND
+	frame[TX_HEAD_LEN + TX_GROUPS + 3] = 0x00;						// end of packet marker
+}
+
+//____________________
+unsigned char NextTxByte(void)
+{
+	// Next wire byte, once per byte from SendBits()
+	unsigned char b;
+
+	if (txMode == eTX_RAM)
+	{
+		if (txPtr >= PRU1_RAM32(txLimitAdr))
+		{
+			txUnderrun = 1;
+			return 0x00;		// ends packet here
+		}
+		b = PRU1_RAM[txPtr];
+		txPtr++;
+		return b;
+	}
+
+	switch (txSeg)
+	{
+		case eTX_HEAD:
+			b = PRU1_RAM[TX_FRAME_ADR + txIdx];
+			txIdx++;
+			if (txIdx == TX_HEAD_LEN)
+			{
+				txSeg = eTX_GROUPS;
+				txIdx = 0;
+			}
+			break;
+
+		case eTX_GROUPS:
+			if (txByte == 0)
+				b = PRU1_RAM[TX_FRAME_ADR + TX_HEAD_LEN + txIdx];	// group msbs
+			else
+			{
+				b = PRU1_RAM[txPtr] | 0x80;
+				txPtr++;
+			}
+			txByte++;
+			if (txByte == 8)
+			{
+				txByte = 0;
+				txIdx++;
+				if (txIdx == TX_GROUPS)
+				{
+					txSeg = eTX_TAIL;
+					txIdx = 0;
+				}
+			}
+			break;
+
+		default:
+			b = PRU1_RAM[TX_TAIL_ADR + txIdx];
+			if (txIdx < TX_TAIL_LEN-1)
+				txIdx++;
+	}
+	return b;
+}
+
+//____________________
+void SendBits(char initFlag)
+{
+	// Bit engine for SendPacket() and SendBlock(), bytes from NextTxByte()
+	//  or, with BITS_ASM, whole packet sent by TxLoop()
+	// C loop: edges on CYCLE deadlines, so byte fetches don't stretch the cell
+	// BITS_ASM: TxLoop() counts cycles, even cell and low only
+	// Cell, low pulse and Init gap from TX_TIMING, Controller may rewrite them
+	uint32_t cell, low, deadline, reqStart, reqWait;
+#ifdef BITS_ASM
+	txSrc src;
+#else
+	unsigned char byteInProgress, bitMask, sendDone, txCurrent;
+#endif
+
+	sendStartCycle = pruCtrl[CTRL_CYCLE];
 	PRU1_RAM[STATUS_ADR] = eSENDING;	// for Controller
+	txUnderrun = 0;
+
+	cell = PRU1_RAM32(TX_CELL_ADR);
+	low  = PRU1_RAM32(TX_LOW_ADR);
+#ifdef BITS_ASM
+	cell &= ~1;
+	low  &= ~1;
+#endif
+	if ((low < TX_LOW_MIN) || (cell < low + TX_HIGH_MIN))
+	{
+		cell = TX_CELL_DEFAULT;
+		low  = TX_LOW_DEFAULT;
+	}
 
 	while((__R31 & REQ) == REQ);	// wait for A2 to finish its send cycle, REQ = 0
+	reqStart = pruCtrl[CTRL_CYCLE];
+	reqWait = reqStart - sendStartCycle;
 
 	// Set up outputs
 	__R30 |= ACK;		// ACK = 1, ready to send
 	__R30 |= RDAT;		// set to know value, 1
 	__R30 &= ~OUTEN;	// clear OUTEN to enable RDAT
 
+	if (txMode == eTX_BLOCK)
+		EncodeFrame();
+
+#ifdef BITS_ASM
+	if (txMode == eTX_BLOCK)
+	{
+		src.head    = TX_FRAME_ADR;
+		src.headLen = TX_HEAD_LEN;
+		src.msbs    = TX_FRAME_ADR + TX_HEAD_LEN;
+		src.raw     = txRaw + 1;
+		src.groups  = TX_GROUPS;
+		src.tail    = TX_TAIL_ADR;
+	}
+	else
+	{
+		src.head    = txPtr;		// not sent, read for timing
+		src.headLen = 0;
+		src.groups  = 0;
+		src.tail    = txPtr;
+	}
+	src.cell  = cell;
+	src.low   = low;
+	src.limit = txLimitAdr;
+
+	reqStart = pruCtrl[CTRL_CYCLE];
+	while ((__R31 & REQ) == 0);		// wait for A2 to indicate ready to receive, ~60 us
+	firstBitCycle = pruCtrl[CTRL_CYCLE];
+	txUnderrun = TxLoop(&src);		// cycle counted but for RAM contention, returns at end of last cell
+	deadline = pruCtrl[CTRL_CYCLE];
+#else
 	// Set up parameters
 	bitMask = 0x80;		// we send msb first
 	sendDone = 0;		// 1 = done
+	txCurrent = NextTxByte();
 
+	reqStart = pruCtrl[CTRL_CYCLE];
 	while ((__R31 & REQ) == 0);		// wait for A2 to indicate ready to receive, ~60 us
+	firstBitCycle = pruCtrl[CTRL_CYCLE];
+	deadline = firstBitCycle;
 
 	while (sendDone == 0)
 	{
-		byteInProgress = PRU1_RAM[memPtr];
+		byteInProgress = txCurrent;
 		if (byteInProgress == 0x00)		// end of packet marker
 			sendDone = 1;
 
 		byteInProgress &= bitMask;
+		while (CYCLE_BEFORE(deadline));
 		if (byteInProgress == bitMask)	// we have a 1
 			__R30 &= ~RDAT;		// RDAT = 0
 		else
 			__R30 |= RDAT;		// RDAT still 1, for timing
 
-		__delay_cycles(350);	// 1.75 us
-
+		while (CYCLE_BEFORE(deadline + low));
 		__R30 |= RDAT;			// RDAR = 1
+		deadline += cell;
 
 		if (bitMask == 1)		// we just sent lsb so time for next byte
 		{
-			memPtr++;
+			if (sendDone == 0)
+				txCurrent = NextTxByte();
 			bitMask = 0x80;
 		}
 		else
 			bitMask = bitMask >> 1;
-
-		// send timing experiments; all seem to work
-//		__delay_cycles(420);	// 2.10 us
-		__delay_cycles(410);	// 2.05 us starting point
-//		__delay_cycles(400);
-//		__delay_cycles(390);	// 1.95 us
 	}
+	while (CYCLE_BEFORE(deadline));	// end of last cell
+#endif
 
 	__R30 &= ~ACK;			// ACK = 0, tell A2 we are done with this packet
 	__R30 |= OUTEN;			// float RDAT
 
+	reqWait += firstBitCycle - reqStart;
+	PERF(PH_SEND_START) = PERF(PF_CYCLE_OFS) + sendStartCycle;
+	PERF(PH_FIRST_BIT)  = PERF(PF_CYCLE_OFS) + firstBitCycle;
+	PERF(PH_SEND_END)   = PERF(PF_CYCLE_OFS) + deadline;
+
+	if (txUnderrun)
+	{
+		sharedRam[TX_UNDERRUNS_OFS]++;
+		PRU1_RAM[ERROR_ADR] = eERROR_UNDERRUN;
+	}
+
 	if (initFlag == 1)
-		__delay_cycles(5000);	// 25 us
+		while (CYCLE_BEFORE(deadline + PRU1_RAM32(TX_GAP_ADR)));
 
 	else
+	{
+		reqStart = pruCtrl[CTRL_CYCLE];
 		while ((__R31 & REQ) == REQ);	// wait for REQ = 0
+		reqWait += pruCtrl[CTRL_CYCLE] - reqStart;
+	}
+	PerfAdd64(PF_REQ_WAIT, reqWait);
 }
@@ -0,0 +1,491 @@
+/*	SmartPort wire simulator
+	Runs SmartPortPru.c (PRU1, C bit loops) on Linux against a simulated A2
+	gcc -O2 -DPRU_HOST -DPRUN=1 SmartPortPru.c SmartPortWire.c -o PruWire
+
+	Time is PRU cycles (5 ns). The firmware only sees time pass when it
+	looks at R31 or a control register, each look costs what it would on
+	the PRU; work between looks is free, so the hardware's Rx edge work
+	stats are the check for that part.
+
+	A2 -> PRU: WDAT toggles at the start of each 1 cell, A2 clock off by
+	skew and each edge moved by up to +/- jitter. ReceivePacket() must
+	store the same bytes and decode the same data, margins come from the
+	per-cells min/max it keeps against its Rx windows.
+	PRU -> A2: SendPacket() and SendBlock() on RDAT, A2 sees each falling
+	edge up to jitter late or early and counts cells with its skewed
+	clock, n cells from n-1/2 to n+1/2, and must see the same bits.
+	Margin is the closest an interval came to a window edge.
+
+	Sweeps skew and jitter, prints a line per case, exit status 1 if any
+	packet didn't come through.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "SmartPortWire.h"
+
+// Must match SmartPortPru.c
+#define STATUS_ADR			0x0300
+#define RCVD_PACKET_ADR		0x0400
+#define RESP_PACKET_ADR		0x0800
+#define RX_DATA_ADR			0x1100
+#define RX_DATA_LEN			512
+#define RX_INFO_ADR			0x1300
+#define RX_INFO_CS			0
+#define RX_INFO_LEN			8
+#define eRX_CS_GOOD			1
+#define TX_RAW_ADR			0x1400
+#define TX_CELL_ADR			0x132C
+#define TX_LOW_ADR			0x1330
+#define TX_GAP_ADR			0x1334
+#define TX_NOLIMIT_ADR		0x1338
+#define RX_LIMITS_ADR		0x0320
+#define RX_CELLS			8
+#define SHARED_RAM			0x10000
+#define RX_CNT_OFS			256
+#define RX_MIN_OFS			264
+#define RX_MAX_OFS			272
+#define CAL_AVG_OFS			301
+#define CTRL_CONTROL		0
+#define CTRL_CTR_EN			(0x1<<3)
+#define CTRL_CYCLE			3
+
+// Firmware
+extern uint32_t WDAT, REQ, P1, P2, P3, OUTEN, RDAT, ACK, LED, TEST;
+void InitRxStats(void);
+void InitPerf(void);
+void ReceivePacket(void);
+void Calibrate(void);
+void SendPacket(char initFlag, unsigned int memPtr);
+void SendBlock(uint32_t rawAdr, unsigned char srcID, unsigned char dataStat);
+
+// What a look costs on the PRU, cycles
+#define SIM_R31_CYCLES		2			// read R31, test, branch
+#define SIM_CTRL_CYCLES		4			// LBBO from control registers, compare
+
+#define SIM_CELL			800			// 4 us
+#define SIM_REQ_LEAD		2000		// REQ to first WDAT edge
+#define SIM_REQ_READY		12000		// A2 raises REQ to receive, 60 us
+#define SIM_REQ_DROP		400			// A2 drops REQ after ACK
+#define SIM_IDLE			4000		// between packets
+#define SIM_MAX_EDGES		8192
+#define SIM_MAX_BYTES		1024
+
+unsigned char simMem[SIM_MEM_LEN];
+uint32_t simR30;
+volatile simIntc CT_INTC;
+uint32_t simCtrl[16];
+
+unsigned long long simTime;				// cycles since start
+uint32_t simLastR30;
+
+// A2 transmitting: WDAT edge times, level starts at 1
+unsigned long long rxEdges[SIM_MAX_EDGES];
+unsigned int rxEdgeCnt, rxEdgeNext;
+unsigned long long reqRiseAt, reqFallAt;	// REQ = 1 from rise until fall
+
+// A2 receiving: RDAT falling edges while OUTEN enables it
+unsigned long long txEdges[SIM_MAX_EDGES];
+unsigned int txEdgeCnt;
+unsigned int simJitter;					// cycles, either way
+
+unsigned int simSeed = 0x2F6B1D35;
+
+void			SimAdvance(unsigned int cycles);
+unsigned int	SimEncode(unsigned char *wire, unsigned char dest, unsigned char src, unsigned char type,
+					unsigned char stat, const unsigned char *data, unsigned int len);
+void			SimA2Send(const unsigned char *wire, unsigned int len, double cell);
+long long		SimJitter(void);
+int				SimRxPacket(double cell, unsigned char data);
+int				SimTxPacket(double cell, unsigned char block, unsigned int *margin);
+unsigned int	SimA2Decode(double cell, unsigned char *bits, unsigned int *margin);
+unsigned int	SimRxMargin(void);
+int				SimCase(int skewPpm, unsigned int jitterNs, unsigned int packets);
+unsigned int	SimRand(void);
+
+//____________________
+int main(int argc, char *argv[])
+{
+	const int skews[] = {0, -10000, 10000, -20000, 20000};
+	const unsigned int jitters[] = {0, 100, 250, 500};
+	unsigned int i, j, packets, jitterNs;
+	int opt, skewPpm, single, failed;
+
+	packets = 20;
+	single = 0;
+	skewPpm = 0;
+	jitterNs = 0;
+	while ((opt = getopt(argc, argv, "n:k:j:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				packets = strtoul(optarg, NULL, 0);
+				break;
+			case 'k':
+				skewPpm = strtol(optarg, NULL, 0);
+				single = 1;
+				break;
+			case 'j':
+				jitterNs = strtoul(optarg, NULL, 0);
+				single = 1;
+				break;
+			default:
+				printf("Usage: %s [-n packets] [-k skewPpm] [-j jitterNs]\n", argv[0]);
+				printf("\tno -k or -j: sweep skew and jitter\n");
+				return EXIT_FAILURE;
+		}
+	}
+
+	// Pin map, as main() sets it
+	WDAT  = 0x1<<0;
+	REQ   = 0x1<<1;
+	P1    = 0x1<<2;
+	P2    = 0x1<<3;
+	P3    = 0x1<<4;
+	OUTEN = 0x1<<5;
+	RDAT  = 0x1<<6;
+	ACK   = 0x1<<7;
+	LED   = 0x1<<8;
+	TEST  = 0x1<<9;
+	simR30 = OUTEN | RDAT;
+	simLastR30 = simR30;
+	simCtrl[CTRL_CONTROL] = CTRL_CTR_EN;
+
+	printf("--- PRU wire simulation, %u packets each way per case\n", packets);
+	printf("\tskew ppm  jitter ns   Rx ok   Rx margin ns  cell seen ns   Tx ok   Tx margin ns\n");
+	failed = 0;
+	if (single)
+		failed = SimCase(skewPpm, jitterNs, packets);
+	else
+	{
+		for (i=0; i<sizeof(skews)/sizeof(skews[0]); i++)
+			for (j=0; j<sizeof(jitters)/sizeof(jitters[0]); j++)
+				failed |= SimCase(skews[i], jitters[j], packets);
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//____________________
+int SimCase(int skewPpm, unsigned int jitterNs, unsigned int packets)
+{
+	// packets each way with A2 clock off by skewPpm, edges off by up to jitterNs
+	// Returns 1 if any packet didn't come through
+	double cell;
+	unsigned int i, rxOk, txOk, margin, txMargin;
+
+	// As main() and InitRxStats() set up, Rx stats per case
+	InitRxStats();
+	InitPerf();
+	*(uint32_t *) (simMem + TX_CELL_ADR) = SIM_CELL;
+	*(uint32_t *) (simMem + TX_LOW_ADR)  = 350;
+	*(uint32_t *) (simMem + TX_GAP_ADR)  = 5000;
+	*(uint32_t *) (simMem + TX_NOLIMIT_ADR) = 0xFFFFFFFF;
+
+	cell = SIM_CELL * (1.0 + skewPpm / 1e6);
+	simJitter = jitterNs / 5;
+	rxOk = 0;
+	txOk = 0;
+	txMargin = 0xFFFFFFFF;
+	for (i=0; i<packets; i++)
+	{
+		rxOk += SimRxPacket(cell, i & 1);
+		txOk += SimTxPacket(cell, i & 1, &margin);
+		if (margin < txMargin)
+			txMargin = margin;
+	}
+
+	printf("\t%8d  %9u  %3u/%-3u  %12u  %13.1f  %3u/%-3u  %13u\n", skewPpm, jitterNs,
+		rxOk, packets, SimRxMargin() * 5, *(uint32_t *) (simMem + SHARED_RAM + CAL_AVG_OFS*4) * 5 / 16.0,
+		txOk, packets, txMargin * 5);
+	return (rxOk != packets) || (txOk != packets);
+}
+
+//____________________
+int SimRxPacket(double cell, unsigned char data)
+{
+	// A2 sends a READBLK command or a data packet, ReceivePacket() takes it
+	// Returns 1 if stored bytes, decoded data and checksum are right
+	unsigned char wire[SIM_MAX_BYTES], payload[RX_DATA_LEN];
+	unsigned int i, len, n;
+
+	if (data)
+	{
+		for (i=0; i<RX_DATA_LEN; i++)
+			payload[i] = SimRand();
+		n = RX_DATA_LEN;
+		len = SimEncode(wire, 0x81, 0x80, 0x82, 0x00, payload, n);
+	}
+	else
+	{
+		memset(payload, 0, 9);
+		payload[0] = 0x01;						// READBLK
+		payload[1] = 3;
+		payload[4] = SimRand();
+		payload[5] = SimRand();
+		n = 9;
+		len = SimEncode(wire, 0x81, 0x80, 0x80, 0x00, payload, n);
+	}
+
+	memset(simMem + RCVD_PACKET_ADR, 0, SIM_MAX_BYTES);
+	reqRiseAt = simTime;
+	reqFallAt = ~0ULL;
+	SimA2Send(wire, len - 1, cell);				// not the 0x00 marker
+	ReceivePacket();
+	Calibrate();
+	reqFallAt = simTime;
+	SimAdvance(SIM_IDLE);
+
+	// PEND's last 1 is the last edge, so its trailing zeros never make a byte
+	if (memcmp(simMem + RCVD_PACKET_ADR, wire, len - 2) != 0)
+		return 0;
+	if (simMem[RX_INFO_ADR + RX_INFO_CS] != eRX_CS_GOOD)
+		return 0;
+	if ((unsigned int)(simMem[RX_INFO_ADR + RX_INFO_LEN] | (simMem[RX_INFO_ADR + RX_INFO_LEN+1] << 8)) != n)
+		return 0;
+	return memcmp(simMem + RX_DATA_ADR, payload, n) == 0;
+}
+
+//____________________
+int SimTxPacket(double cell, unsigned char block, unsigned int *margin)
+{
+	// PRU sends a STATUS reply from RAM, or a data packet it encodes from a raw block
+	// Returns 1 if A2 sees the same bits
+	unsigned char wire[SIM_MAX_BYTES], payload[RX_DATA_LEN], bits[SIM_MAX_BYTES*8];
+	unsigned int i, j, len, n, nbits;
+
+	if (block)
+	{
+		for (i=0; i<RX_DATA_LEN; i++)
+			payload[i] = SimRand();
+		len = SimEncode(wire, 0x80, 0x81, 0x82, 0x00, payload, RX_DATA_LEN);
+		memcpy(simMem + TX_RAW_ADR, payload, RX_DATA_LEN);
+	}
+	else
+	{
+		payload[0] = 0xF8;						// device status, block count
+		payload[1] = 0x00;
+		payload[2] = 0x00;
+		payload[3] = 0x01;
+		len = SimEncode(wire, 0x80, 0x81, 0x81, 0x00, payload, 4);
+		memcpy(simMem + RESP_PACKET_ADR, wire, len);
+	}
+
+	txEdgeCnt = 0;
+	reqRiseAt = simTime + SIM_REQ_READY;		// REQ 0 now, A2 done sending
+	reqFallAt = ~0ULL;
+	if (block)
+		SendBlock(TX_RAW_ADR, 0x81, 0x00);
+	else
+		SendPacket(0, RESP_PACKET_ADR);
+	SimAdvance(SIM_IDLE);
+
+	// Expected bits: every byte msb first, trailing 0 cells have no edge
+	n = 0;
+	for (i=0; i<len-1; i++)
+		for (j=0; j<8; j++)
+			bits[n++] = (wire[i] >> (7-j)) & 1;
+	while ((n > 0) && (bits[n-1] == 0))
+		n--;
+
+	nbits = SimA2Decode(cell, bits, margin);
+	return nbits == n;
+}
+
+//____________________
+unsigned int SimA2Decode(double cell, unsigned char *bits, unsigned int *margin)
+{
+	// A2 side of RDAT: first falling edge is the first 1, n cells to the next is
+	//  n-1 zeros and a 1. Returns how many bits matched, margin = closest to a window edge
+	unsigned int i, n, k, cells, pos;
+	double interval, frac, m;
+
+	*margin = 0xFFFFFFFF;
+	if (txEdgeCnt == 0 || bits[0] != 1)
+		return 0;
+	pos = 1;
+	for (i=1; i<txEdgeCnt; i++)
+	{
+		interval = (double) ((long long) (txEdges[i] - txEdges[i-1]));
+		cells = (unsigned int) (interval / cell + 0.5);
+		frac = interval / cell - cells;				// -0.5 .. 0.5
+		m = (0.5 - (frac < 0 ? -frac : frac)) * cell;
+		if (m < *margin)
+			*margin = (unsigned int) m;
+		if (cells == 0)
+			return pos;
+		for (k=0; k<cells; k++)
+		{
+			n = (k == cells-1);
+			if (bits[pos] != n)
+				return pos;
+			pos++;
+		}
+	}
+	return pos;
+}
+
+//____________________
+unsigned int SimRxMargin(void)
+{
+	// Closest any interval came to its Rx window, as Controller's printRxStats() works it out
+	volatile uint32_t *stats = (volatile uint32_t *) (simMem + SHARED_RAM);
+	volatile uint32_t *limits = (volatile uint32_t *) (simMem + RX_LIMITS_ADR);
+	unsigned int n, margin, lo;
+
+	margin = 0xFFFFFFFF;
+	for (n=0; n<RX_CELLS-1; n++)
+	{
+		if (stats[RX_CNT_OFS + n] == 0)
+			continue;
+		lo = (n == 0) ? 0 : limits[n-1];
+		if (stats[RX_MIN_OFS + n] - lo < margin)
+			margin = stats[RX_MIN_OFS + n] - lo;
+		if (limits[n] - stats[RX_MAX_OFS + n] < margin)
+			margin = limits[n] - stats[RX_MAX_OFS + n];
+	}
+	return margin;
+}
+
+//____________________
+void SimA2Send(const unsigned char *wire, unsigned int len, double cell)
+{
+	// Edge times for WDAT, each 1 toggles it at the start of its cell
+	unsigned int i, j;
+	long long t;
+
+	rxEdgeCnt = 0;
+	rxEdgeNext = 0;
+	for (i=0; i<len; i++)
+	{
+		for (j=0; j<8; j++)
+		{
+			if (((wire[i] >> (7-j)) & 1) == 0)
+				continue;
+			t = (long long) (simTime + SIM_REQ_LEAD + (i*8 + j) * cell);
+			t += SimJitter();
+			if ((rxEdgeCnt != 0) && (t <= (long long) rxEdges[rxEdgeCnt-1]))
+				t = rxEdges[rxEdgeCnt-1] + 1;
+			rxEdges[rxEdgeCnt++] = t;
+		}
+	}
+}
+
+//____________________
+uint32_t SimR31(void)
+{
+	// WDAT from A2's edges, REQ from its schedule, no doorbell
+	uint32_t r31;
+
+	SimAdvance(SIM_R31_CYCLES);
+	while ((rxEdgeNext < rxEdgeCnt) && (rxEdges[rxEdgeNext] <= simTime))
+		rxEdgeNext++;
+	r31 = (rxEdgeNext & 1) ? 0 : WDAT;
+	if ((simTime >= reqRiseAt) && (simTime < reqFallAt))
+		r31 |= REQ;
+	return r31;
+}
+
+//____________________
+volatile uint32_t *SimCtrl(void)
+{
+	SimAdvance(SIM_CTRL_CYCLES);
+	return (volatile uint32_t *) simCtrl;
+}
+
+//____________________
+void SimAdvance(unsigned int cycles)
+{
+	// Outputs firmware wrote since last look happen now, then time moves on
+	uint32_t changed;
+
+	changed = simR30 ^ simLastR30;
+	if ((changed & RDAT) && !(simR30 & RDAT) && !(simR30 & OUTEN) && (txEdgeCnt < SIM_MAX_EDGES))
+		txEdges[txEdgeCnt++] = simTime + SimJitter();
+	if ((changed & ACK) && !(simR30 & ACK) && (simTime >= reqRiseAt) && (reqFallAt == ~0ULL))
+		reqFallAt = simTime + SIM_REQ_DROP;			// A2 saw end of packet
+	simLastR30 = simR30;
+	if (CT_INTC.SICR != 0)
+		CT_INTC.SICR = 0;
+
+	simTime += cycles;
+	if (simCtrl[CTRL_CONTROL] & CTRL_CTR_EN)
+	{
+		if (simCtrl[CTRL_CYCLE] > 0xFFFFFFFF - cycles)
+			simCtrl[CTRL_CYCLE] = 0xFFFFFFFF;		// CYCLE stops, doesn't wrap
+		else
+			simCtrl[CTRL_CYCLE] += cycles;
+	}
+}
+
+//____________________
+unsigned int SimEncode(unsigned char *wire, unsigned char dest, unsigned char src, unsigned char type,
+	unsigned char stat, const unsigned char *data, unsigned int len)
+{
+	// Packet as it goes on the wire: sync, header, odd bytes, groups of 7,
+	//  checksum, PEND, then 0x00 end marker. Returns bytes with marker
+	unsigned int i, j, odd, groups, n;
+	unsigned char checksum, msbs;
+
+	odd = len % 7;
+	groups = len / 7;
+	memcpy(wire, "\xFF\x3F\xCF\xF3\xFC\xFF", 6);
+	wire[6]  = 0xC3;
+	wire[7]  = dest;
+	wire[8]  = src;
+	wire[9]  = type;
+	wire[10] = 0x80;
+	wire[11] = stat | 0x80;
+	wire[12] = odd | 0x80;
+	wire[13] = groups | 0x80;
+
+	checksum = 0;
+	for (i=7; i<14; i++)
+		checksum ^= wire[i];
+	for (i=0; i<len; i++)
+		checksum ^= data[i];
+
+	n = 14;
+	if (odd != 0)
+	{
+		msbs = 0x80;
+		for (i=0; i<odd; i++)
+			msbs |= (data[i] >> (i+1)) & (0x80 >> (i+1));
+		wire[n++] = msbs;
+		for (i=0; i<odd; i++)
+			wire[n++] = data[i] | 0x80;
+	}
+	for (i=0; i<groups; i++)
+	{
+		msbs = 0x80;
+		for (j=0; j<7; j++)
+			msbs |= (data[odd + i*7 + j] >> (j+1)) & (0x80 >> (j+1));
+		wire[n++] = msbs;
+		for (j=0; j<7; j++)
+			wire[n++] = data[odd + i*7 + j] | 0x80;
+	}
+	wire[n++] =  checksum       | 0xAA;			// 1 C6 1 C4 1 C2 1 C0
+	wire[n++] = (checksum >> 1) | 0xAA;			// 1 C7 1 C5 1 C3 1 C1
+	wire[n++] = 0xC8;							// PEND
+	wire[n++] = 0x00;
+	return n;
+}
+
+//____________________
+long long SimJitter(void)
+{
+	if (simJitter == 0)
+		return 0;
+	return (long long) (SimRand() % (2*simJitter + 1)) - simJitter;
+}
+
+//____________________
+unsigned int SimRand(void)
+{
+	// xorshift32, same traffic every run
+	simSeed ^= simSeed << 13;
+	simSeed ^= simSeed >> 17;
+	simSeed ^= simSeed << 5;
+	return simSeed;
+}
@@ -0,0 +1,32 @@
+/*	SmartPort PRU firmware built for Linux
+	SmartPortPru.c includes this instead of the TI headers with -DPRU_HOST
+	Pins, CYCLE counter, INTC and memory are SmartPortWire.c's simulator:
+	every look at R31 or the control registers costs simulated cycles,
+	so the firmware's own wait loops move time along
+*/
+#include <string.h>
+
+// PRU1 local address space: Data RAM at 0, shared RAM at 0x10000
+#define SIM_MEM_LEN			0x13000
+extern unsigned char simMem[SIM_MEM_LEN];
+
+uint32_t			SimR31(void);
+volatile uint32_t	*SimCtrl(void);
+extern uint32_t		simR30;
+
+#define __R30				simR30
+#define __R31				SimR31()
+#define pruCtrl				SimCtrl()
+
+// No PRU0 on a host: scratch pad reads as empty, engine never starts
+#define __xin(bank, reg, mode, obj)		memset((void *) &(obj), 0, sizeof(obj))
+#define __xout(bank, reg, mode, obj)	((void) (obj))
+
+// Only the INTC registers the firmware touches, SICR write clears the doorbell
+typedef struct
+{
+	uint32_t SIPR0, SITR0, SICR, EISR, HIEISR, GER;
+	struct { uint32_t CH_MAP_19; } CMR4_bit;
+	struct { uint32_t HINT_MAP_1; } HMR0_bit;
+} simIntc;
+extern volatile simIntc CT_INTC;
@@ -0,0 +1,108 @@
+# Cycle budget check for SmartPortBits.asm
+#	;@begin NAME [dim=path,path]	count for NAME, on every path or the listed
+#									paths of branch dim
+#	;@add NAME2						add budget NAME2 (a call)
+#	;@end NAME						stop counting
+#	NAME .set N						budget, every combination of paths of NAME
+#									must total N
+#	;@strict ... ;@end strict		every instruction in here must be counted
+#									by some NAME, or be inside
+#	;@begin uncounted why ... ;@end uncounted
+# Instructions are one cycle, LBBO/LBCO count LBBO_CYCLES, an uncontended
+# load; waits for RAM the ARM or the other PRU is using aren't counted
+# Exit status 1 if any combination misses its budget, or an instruction in
+# a strict stretch is neither counted nor marked uncounted
+
+function count(name, tag, n,    d, v, k) {
+	if (tag == "") {
+		common[name] += n
+		return
+	}
+	split(tag, d, "=")
+	if (!((name, d[1]) in dimSeen)) {
+		dimSeen[name, d[1]] = 1
+		dims[name] = dims[name] " " d[1]
+	}
+	split(d[2], v, ",")
+	for (k in v) {
+		if (!((name, d[1], v[k]) in cyc)) {
+			cyc[name, d[1], v[k]] = 0
+			vals[name, d[1]] = vals[name, d[1]] " " v[k]
+		}
+		cyc[name, d[1], v[k]] += n
+	}
+}
+
+# every combination of one path per dim
+function walk(name, dl, nd, i, t, label,    vl, nv, k) {
+	if (i > nd) {
+		printf("%-16s %4d / %4d %s\n", name, t, budget[name], label)
+		if (t != budget[name])
+			bad = 1
+		return
+	}
+	nv = split(vals[name, dl[i]], vl, " ")
+	for (k = 1; k <= nv; k++)
+		walk(name, dl, nd, i + 1, t + cyc[name, dl[i], vl[k]], label " " dl[i] "=" vl[k])
+}
+
+/^[A-Za-z_][A-Za-z0-9_]*[ \t]+\.set[ \t]/ {
+	if ($3 ~ /^[0-9]+$/)
+		budget[$1] = $3 + 0
+	next
+}
+
+/^;@strict/ { strict = 1; next }
+/^;@end strict/ { strict = 0; next }
+/^;@begin uncounted/ { uncounted = 1; next }
+/^;@end uncounted/ { uncounted = 0; next }
+/^;@begin/ { tag[$2] = $3; on[$2] = 1; names[$2] = 1; count($2, $3, 0); next }
+/^;@end/ { delete on[$2]; next }
+/^;@add/ {
+	for (n in on)
+		pending[n, tag[n]] = pending[n, tag[n]] " " $2
+	next
+}
+
+{
+	line = $0
+	sub(/;.*/, "", line)
+	sub(/^[A-Za-z_][A-Za-z0-9_]*:/, "", line)
+	sub(/^[ \t]+/, "", line)
+	split(line, f, /[ \t]+/)
+	op = toupper(f[1])
+	if (op == "" || op ~ /^\./)
+		next
+	counted = 0
+	for (n in on) {
+		count(n, tag[n], (op ~ /^LB[BC]O$/) ? budget["LBBO_CYCLES"] : 1)
+		counted = 1
+	}
+	if (strict && !counted && !uncounted) {
+		printf("*** ERROR: line %d not counted: %s\n", NR, $0)
+		stray = 1
+	}
+}
+
+END {
+	# calls are added once budgets are all known
+	for (key in pending) {
+		split(key, kp, SUBSEP)
+		na = split(pending[key], al, " ")
+		for (k = 1; k <= na; k++)
+			count(kp[1], kp[2], budget[al[k]])
+	}
+	bad = stray
+	for (n in names) {
+		if (!(n in budget)) {
+			printf("*** ERROR: no budget for %s\n", n)
+			bad = 1
+			continue
+		}
+		nd = split(dims[n], dl, " ")
+		walk(n, dl, nd, 1, common[n], "")
+	}
+	if (bad)
+		print "*** ERROR: cycle budget broken in SmartPortBits.asm"
+	exit bad
+}
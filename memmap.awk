@@ -0,0 +1,58 @@
+# Data RAM check for a lnkpru map file (-m)
+#	awk -v limit=0x300 -f memmap.awk TARGET.map
+# Every output section on page 1 below 0x2000 (.stack, .bss, .sysmem, .data
+# ...) must end at or below limit, where the Controller mailbox starts
+# Exit status 1 if one doesn't, or if the map has no sections
+
+function hex(s,    i, n, c) {
+	s = tolower(s)
+	sub(/^0x/, "", s)
+	n = 0
+	for (i = 1; i <= length(s); i++) {
+		c = index("0123456789abcdef", substr(s, i, 1))
+		if (c == 0)
+			return -1
+		n = n * 16 + c - 1
+	}
+	return n
+}
+
+BEGIN {
+	if (limit == "")
+		limit = "0x300"
+	max = hex(limit)
+}
+
+/^SECTION ALLOCATION MAP/ { inMap = 1; next }
+/^GLOBAL SYMBOLS/ || /^MODULE SUMMARY/ { inMap = 0 }
+
+# output section lines start in column 0, a long name puts the rest on a
+#  line of its own starting with *
+inMap && /^[.*]/ {
+	if (NF == 1) {
+		name = $1
+		next
+	}
+	if ($1 != "*")
+		name = $1
+	if ($2 != "1" || hex($3) < 0 || hex($4) < 0)
+		next
+	org = hex($3)
+	end = org + hex($4)
+	if (org >= 8192)								# other PRU's RAM
+		next
+	seen++
+	printf("%-16s %04X - %04X\n", name, org, end)
+	if (end > max) {
+		printf("*** %s ends at %04X, past %s\n", name, end, limit)
+		bad = 1
+	}
+}
+
+END {
+	if (seen == 0) {
+		print "*** no page 1 sections in map"
+		exit 1
+	}
+	exit bad
+}